@@ -0,0 +1,576 @@
+#!/usr/bin/env python
+# coding=utf8
+
+"""Benchmarks for the Python <-> lua boundary and the sandbox lifecycle.
+
+Results are printed (or written to the file given with -o) as JSON, one
+entry per benchmark with the best time per operation out of several
+repeats, so runs can be compared between releases.
+
+Usage: luabench.py [-o OUTPUT] [-r REPEAT] [-f FILTER]
+"""
+
+import array
+import gc
+import json
+import optparse
+import os
+import platform
+import sys
+import time
+
+import luabox
+
+TESTS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'tests')
+
+benchmarks = []
+
+def benchmark(number):
+	"""Register a benchmark. The decorated function gets the number of
+	iterations and returns a function running them."""
+	def register(f):
+		benchmarks.append((f.__name__, number, f))
+		return f
+	return register
+
+def run_benchmark(setup, number, repeat):
+	times = []
+	for i in range(repeat):
+		fn = setup(number)
+		gc.collect()
+		gc.disable()
+		try:
+			start = time.time()
+			fn()
+			times.append(time.time() - start)
+		finally:
+			gc.enable()
+	return min(times)
+
+
+# sandbox lifecycle
+
+@benchmark(10000)
+def sandbox_new(n):
+	def run():
+		for i in xrange(n):
+			luabox.Sandbox()
+	return run
+
+@benchmark(10000)
+def sandbox_new_pooled(n):
+	def run():
+		for i in xrange(n):
+			luabox.Sandbox(pooled = True)
+	return run
+
+LIBRARIES = ['base', 'string', 'table', 'math', 'os']
+
+@benchmark(10000)
+def sandbox_new_libraries(n):
+	def run():
+		for i in xrange(n):
+			luabox.Sandbox(libraries = LIBRARIES)
+	return run
+
+@benchmark(10000)
+def sandbox_libraries_math_only(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(libraries = LIBRARIES)
+			s.loadstring("return math.floor(2.5)")
+			s.call()
+	return run
+
+@benchmark(10000)
+def sandboxpool_acquire_release(n):
+	pool = luabox.SandboxPool(4)
+	def run():
+		for i in xrange(n):
+			pool.release(pool.acquire())
+	return run
+
+TEMPLATE_SCRIPT = """
+config = {}
+for i = 1, 1000 do
+	config['key' .. i] = {i, 'value' .. i}
+end
+function lookup(k)
+	return config[k][2]
+end
+"""
+
+@benchmark(1000)
+def sandbox_new_setup(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox()
+			s.loadstring(TEMPLATE_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(1000)
+def sandbox_new_from_template(n):
+	template = luabox.Sandbox()
+	template.loadstring(TEMPLATE_SCRIPT)
+	template.pcall()
+	template.freeze()
+	def run():
+		for i in xrange(n):
+			luabox.Sandbox(template = template)
+	return run
+
+@benchmark(1000)
+def sandbox_template_first_use(n):
+	template = luabox.Sandbox()
+	template.loadstring(TEMPLATE_SCRIPT)
+	template.pcall()
+	template.freeze()
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(template = template)
+			s.loadstring("return lookup('key500')")
+			s.call()
+	return run
+
+
+# compilation
+
+SCRIPT = """
+local t = {}
+for i = 1, 10 do
+	t[i] = i * 2
+end
+return t
+"""
+
+@benchmark(10000)
+def loadstring_compile(n):
+	s = luabox.Sandbox()
+	def run():
+		luabox.set_bytecode_cache_size(0)
+		for i in xrange(n):
+			s.loadstring(SCRIPT)
+			s.pop_all()
+	return run
+
+@benchmark(10000)
+def loadstring_cached(n):
+	s = luabox.Sandbox()
+	def run():
+		luabox.set_bytecode_cache_size(8*1024*1024)
+		for i in xrange(n):
+			s.loadstring(SCRIPT)
+			s.pop_all()
+	return run
+
+
+# calls
+
+@benchmark(100000)
+def pcall_empty(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring("")
+			s.pcall()
+	return run
+
+@benchmark(100000)
+def call_empty(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring("")
+			s.call()
+	return run
+
+@benchmark(100000)
+def call_multret(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring("return ...")
+			s.call(1, 2.5, "three", True, None)
+	return run
+
+LOOP_SCRIPT = "local x = 0 for i = 1, 1000000 do x = x + i end"
+
+@benchmark(10)
+def pcall_loop(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring(LOOP_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(10)
+def pcall_loop_timeout(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring(LOOP_SCRIPT)
+			s.pcall(timeout = 60)
+	return run
+
+@benchmark(10)
+def pcall_loop_profiled(n):
+	s = luabox.Sandbox()
+	s.start_profiler()
+	def run():
+		for i in xrange(n):
+			s.loadstring(LOOP_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(10)
+def pcall_loop_profiled_sampled(n):
+	s = luabox.Sandbox()
+	s.start_profiler(rate = 0.1)
+	def run():
+		for i in xrange(n):
+			s.loadstring(LOOP_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(10)
+def callback_roundtrip(n):
+	s = luabox.Sandbox()
+	s.register('add', lambda a, b: a + b)
+	def run():
+		for i in xrange(n):
+			s.loadstring("local x = 0 for i = 1, 10000 do x = add(x, i) end")
+			s.pcall()
+	return run
+
+COROUTINE_SCRIPT = """
+return function(n)
+	local x = 0
+	for i = 1, n do
+		x = x + i
+		if i % 100 == 0 then x = x + tick(i) end
+	end
+	return x
+end
+"""
+
+@benchmark(1)
+def scheduler_1000_coroutines(n):
+	s = luabox.Sandbox()
+	s.register_async('tick')
+	def run():
+		for i in xrange(n):
+			sched = luabox.Scheduler(slice = 1000, on_yield = lambda co, values: sched.wake(co, 1))
+			for j in xrange(1000):
+				s.loadstring(COROUTINE_SCRIPT)
+				s.pcall(nresults = 1)
+				sched.wake(s.coroutine(), 1000)
+			sched.run()
+	return run
+
+
+# conversion
+
+@benchmark(100000)
+def convert_number(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.push(12345)
+			s.pop()
+	return run
+
+@benchmark(100000)
+def convert_number_result(n):
+	s = luabox.Sandbox()
+	def run():
+		for i in xrange(n):
+			s.loadstring("return 1, 2.5, 3, 4")
+			s.call()
+	return run
+
+@benchmark(100)
+def convert_number_array(n):
+	s = luabox.Sandbox()
+	s.loadstring("local t = {} for i = 1, 10000 do t[i] = i end return t")
+	s.pcall(nresults = 1)
+	tbl = s.pop()
+	def run():
+		for i in xrange(n):
+			tbl.to_python()
+	return run
+
+@benchmark(100)
+def convert_number_array_buffer(n):
+	s = luabox.Sandbox()
+	s.loadstring("local t = {} for i = 1, 10000 do t[i] = i end return t")
+	s.pcall(nresults = 1)
+	tbl = s.pop()
+	def run():
+		for i in xrange(n):
+			tbl.to_buffer('d')
+	return run
+
+@benchmark(100)
+def push_number_array(n):
+	s = luabox.Sandbox()
+	value = array.array('d', range(10000))
+	def run():
+		for i in xrange(n):
+			s.push_array(value, 'd')
+			s.pop_all()
+	return run
+
+@benchmark(100000)
+def convert_string(n):
+	s = luabox.Sandbox()
+	value = "x" * 64
+	def run():
+		for i in xrange(n):
+			s.push(value)
+			s.pop()
+	return run
+
+@benchmark(1000)
+def convert_string_1mb(n):
+	s = luabox.Sandbox()
+	value = "x" * (1024*1024)
+	def run():
+		for i in xrange(n):
+			s.push(value)
+			s.pop()
+	return run
+
+@benchmark(10000)
+def convert_many(n):
+	s = luabox.Sandbox()
+	values = range(20)
+	def run():
+		for i in xrange(n):
+			s.push_many(values)
+			s.pop_all()
+	return run
+
+@benchmark(100)
+def convert_table_to_lua(n):
+	s = luabox.Sandbox()
+	value = dict(('key%d' % i, [i, i+1, {'x': i}]) for i in range(1000))
+	def run():
+		for i in xrange(n):
+			s.push(value)
+			s.pop()
+	return run
+
+def make_table(s, size):
+	s.loadstring("local t = {} for i = 1, %d do t['k' .. i] = i end return t" % size)
+	s.pcall(nresults = 1)
+	return s.pop()
+
+@benchmark(10)
+def table_per_key(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 10000)
+	keys = ['k%d' % i for i in range(1, 10001)]
+	def run():
+		for i in xrange(n):
+			dict((k, tbl[k]) for k in keys)
+	return run
+
+@benchmark(10)
+def table_items(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 10000)
+	def run():
+		for i in xrange(n):
+			dict(tbl.items())
+	return run
+
+@benchmark(10)
+def table_to_python(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 10000)
+	def run():
+		for i in xrange(n):
+			tbl.to_python()
+	return run
+
+RECORD_SCRIPT = "return {id = 1, name = 'record', tags = {'a', 'b', 'c'}, score = 0.5, ok = true}"
+
+@benchmark(10000)
+def dump_value_record(n):
+	s = luabox.Sandbox()
+	s.loadstring(RECORD_SCRIPT)
+	s.pcall(nresults = 1)
+	def run():
+		for i in xrange(n):
+			s.load_value(s.dump_value())
+	return run
+
+@benchmark(10000)
+def json_record(n):
+	s = luabox.Sandbox()
+	s.loadstring(RECORD_SCRIPT)
+	s.pcall(nresults = 1)
+	def run():
+		for i in xrange(n):
+			value = json.dumps(s.pop(deep = True))
+			s.push(json.loads(value))
+	return run
+
+@benchmark(100000)
+def table_subscript(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 100)
+	def run():
+		for i in xrange(n):
+			tbl['k50']
+	return run
+
+@benchmark(100000)
+def table_subscript_nested(n):
+	s = luabox.Sandbox()
+	s.loadstring("return {c = {x = 1}}")
+	s.pcall(nresults = 1)
+	tbl = s.pop()
+	c = tbl['c']
+	def run():
+		for i in xrange(n):
+			tbl['c']['x']
+	return run
+
+@benchmark(100000)
+def table_subscript_nested_uncached(n):
+	s = luabox.Sandbox()
+	s.loadstring("return {c = {x = 1}}")
+	s.pcall(nresults = 1)
+	tbl = s.pop()
+	def run():
+		for i in xrange(n):
+			tbl['c']['x']
+	return run
+
+@benchmark(100000)
+def table_setitem(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 100)
+	def run():
+		for i in xrange(n):
+			tbl['k50'] = i
+	return run
+
+@benchmark(1000)
+def table_update(n):
+	s = luabox.Sandbox()
+	tbl = make_table(s, 100)
+	items = dict(('k%d' % i, i) for i in xrange(100))
+	def run():
+		for i in xrange(n):
+			tbl.update(items)
+	return run
+
+
+# allocator
+
+ALLOC_SCRIPT = """
+local t = {}
+for i = 1, 20000 do
+	t[i % 100] = {i, i .. ""}
+end
+"""
+
+@benchmark(20)
+def allocator_limited(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(memory_limit = 4*1024*1024)
+			s.loadstring(ALLOC_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(20)
+def allocator_limited_pooled(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(memory_limit = 4*1024*1024, pooled = True)
+			s.loadstring(ALLOC_SCRIPT)
+			s.pcall()
+	return run
+
+@benchmark(3)
+def lotsofmem(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(memory_limit = 16*1024*1024)
+			s.loadstring("print = function() end")
+			s.pcall()
+			s.loadfile(os.path.join(TESTS_DIR, 'lotsofmem.lua'))
+			try:
+				s.pcall()
+			except luabox.OutOfMemory:
+				pass
+	return run
+
+@benchmark(3)
+def lotsofmem_generational(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(memory_limit = 16*1024*1024)
+			s.gc_policy = 'generational'
+			s.loadstring("print = function() end")
+			s.pcall()
+			s.loadfile(os.path.join(TESTS_DIR, 'lotsofmem.lua'))
+			try:
+				s.pcall()
+			except luabox.OutOfMemory:
+				pass
+	return run
+
+GARBAGE_SCRIPT = "for i = 1, 20000 do local t = {} for j = 1, 20 do t[j] = j end end"
+
+@benchmark(20)
+def garbage_near_limit(n):
+	def run():
+		for i in xrange(n):
+			s = luabox.Sandbox(memory_limit = 256*1024)
+			s.loadstring(GARBAGE_SCRIPT)
+			s.pcall()
+	return run
+
+
+def main():
+	parser = optparse.OptionParser(usage = "%prog [-o OUTPUT] [-r REPEAT] [-f FILTER]")
+	parser.add_option('-o', '--output', help = "write JSON results to OUTPUT instead of stdout")
+	parser.add_option('-r', '--repeat', type = 'int', default = 3, help = "number of runs per benchmark, the best is reported")
+	parser.add_option('-f', '--filter', help = "only run benchmarks whose name contains FILTER")
+	opts, args = parser.parse_args()
+
+	results = []
+	for name, number, setup in benchmarks:
+		if opts.filter and opts.filter not in name: continue
+		best = run_benchmark(setup, number, opts.repeat)
+		results.append({
+			'name': name,
+			'iterations': number,
+			'repeat': opts.repeat,
+			'best': best,
+			'per_op': best / number,
+		})
+		print >>sys.stderr, "%-32s %12.3f us/op" % (name, best / number * 1e6)
+
+	report = {
+		'timestamp': time.time(),
+		'python': platform.python_version(),
+		'platform': platform.platform(),
+		'benchmarks': results,
+	}
+
+	if opts.output:
+		with open(opts.output, 'w') as f:
+			json.dump(report, f, indent = 1)
+	else:
+		json.dump(report, sys.stdout, indent = 1)
+		print
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,272 @@
+/**
+ * Process-wide cache of compiled lua chunks.
+ *
+ * Sandbox.loadstring compiles the same sources over and over again. The
+ * bytecode cache stores the output of lua_dump for each source string and
+ * hands it to lua_load on subsequent loads, skipping the parser.
+ *
+ * The cache is bounded by the total size of its entries (source and
+ * bytecode) and evicts the least recently used entry first. Entries are
+ * keyed by a hash of the source, the source itself is kept to rule out
+ * collisions.
+ *
+ * All functions in here must be called with the GIL held, which also
+ * serializes access to the cache. Entries are reference counted, so an
+ * entry that is evicted while a sandbox is loading it (without the GIL)
+ * stays valid until it is released.
+ */
+#include "luaboxmodule.h"
+
+#define BYTECACHE_BUCKETS 1024
+#define BYTECACHE_DEFAULT_SIZE (8*1024*1024)
+
+typedef struct ByteCacheEntry {
+	struct ByteCacheEntry *hnext;   /* next entry in hash bucket */
+	struct ByteCacheEntry *prev;    /* LRU list, towards most recent */
+	struct ByteCacheEntry *next;    /* LRU list, towards least recent */
+	unsigned long hash;
+	int refcount;
+	int cached;                     /* still linked into the cache? */
+	char *source;
+	size_t sourcelen;
+	ByteCode code;
+} ByteCacheEntry;
+
+static struct {
+	ByteCacheEntry *buckets[BYTECACHE_BUCKETS];
+	ByteCacheEntry *head;           /* most recently used */
+	ByteCacheEntry *tail;           /* least recently used */
+	size_t size;
+	size_t max_size;
+	unsigned long entries;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} bytecache = {{NULL}, NULL, NULL, 0, BYTECACHE_DEFAULT_SIZE, 0, 0, 0, 0};
+
+/* FNV-1a */
+static unsigned long bytecache_hash(const char *s, size_t len) {
+	unsigned long h = 2166136261UL;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static inline size_t bytecache_entry_size(ByteCacheEntry *e) {
+	return sizeof(ByteCacheEntry) + e->sourcelen + e->code.len;
+}
+
+static void bytecache_entry_free(ByteCacheEntry *e) {
+	free(e->source);
+	free(e->code.buf);
+	free(e);
+}
+
+static void bytecache_lru_unlink(ByteCacheEntry *e) {
+	if (e->prev) e->prev->next = e->next;
+	else bytecache.head = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else bytecache.tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void bytecache_lru_push(ByteCacheEntry *e) {
+	e->prev = NULL;
+	e->next = bytecache.head;
+	if (bytecache.head) bytecache.head->prev = e;
+	bytecache.head = e;
+	if (! bytecache.tail) bytecache.tail = e;
+}
+
+/**
+ * Remove an entry from the cache. It is freed once it is not in use.
+ */
+static void bytecache_remove(ByteCacheEntry *e) {
+	ByteCacheEntry **p = &bytecache.buckets[e->hash % BYTECACHE_BUCKETS];
+
+	while (*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+
+	bytecache_lru_unlink(e);
+	bytecache.size -= bytecache_entry_size(e);
+	--bytecache.entries;
+	e->cached = 0;
+
+	if (! e->refcount) bytecache_entry_free(e);
+}
+
+/**
+ * Evict least recently used entries until `needed` more bytes fit.
+ */
+static void bytecache_make_room(size_t needed) {
+	while (bytecache.tail && bytecache.size + needed > bytecache.max_size) {
+		bytecache_remove(bytecache.tail);
+		++bytecache.evictions;
+	}
+}
+
+/**
+ * lua_Writer that appends to a ByteCode buffer.
+ */
+int bytecode_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	ByteCode *bc = (ByteCode*) ud;
+
+	if (bc->len + sz > bc->alloc) {
+		size_t nalloc = bc->alloc ? bc->alloc : 256;
+		char *nbuf;
+		while (nalloc < bc->len + sz) nalloc *= 2;
+		if (! (nbuf = realloc(bc->buf, nalloc))) return 1;
+		bc->buf = nbuf;
+		bc->alloc = nalloc;
+	}
+
+	memcpy(bc->buf + bc->len, p, sz);
+	bc->len += sz;
+	return 0;
+}
+
+/**
+ * Returns nonzero if compiled chunks should be added to the cache.
+ */
+int bytecache_enabled(void) {
+	return 0 != bytecache.max_size;
+}
+
+/**
+ * Look up compiled code for a source string.
+ *
+ * Returns an opaque handle whose code stays valid until it is passed to
+ * bytecache_release, or NULL if the source is not cached.
+ */
+void *bytecache_lookup(const char *source, size_t len, const ByteCode **code) {
+	unsigned long h;
+	ByteCacheEntry *e;
+
+	if (! bytecache.max_size) return NULL;
+
+	h = bytecache_hash(source, len);
+	for (e = bytecache.buckets[h % BYTECACHE_BUCKETS]; e; e = e->hnext) {
+		if (e->hash == h && e->sourcelen == len && 0 == memcmp(e->source, source, len)) break;
+	}
+
+	if (! e) {
+		++bytecache.misses;
+		return NULL;
+	}
+
+	++bytecache.hits;
+
+	/* move to front */
+	bytecache_lru_unlink(e);
+	bytecache_lru_push(e);
+
+	++e->refcount;
+	*code = &e->code;
+	return e;
+}
+
+/**
+ * Release a handle obtained from bytecache_lookup.
+ */
+void bytecache_release(void *handle) {
+	ByteCacheEntry *e = (ByteCacheEntry*) handle;
+
+	if (0 == --e->refcount && ! e->cached) bytecache_entry_free(e);
+}
+
+/**
+ * Add compiled code for a source string to the cache.
+ *
+ * Takes ownership of the buffer in `code`, which is freed if it cannot be
+ * cached.
+ */
+void bytecache_insert(const char *source, size_t len, ByteCode *code) {
+	ByteCacheEntry *e;
+	ByteCacheEntry **bucket;
+	size_t esize = sizeof(ByteCacheEntry) + len + code->len;
+	unsigned long h;
+
+	if (esize > bytecache.max_size) {
+		free(code->buf);
+		return;
+	}
+
+	h = bytecache_hash(source, len);
+	bucket = &bytecache.buckets[h % BYTECACHE_BUCKETS];
+
+	/* another thread might have compiled the same source meanwhile */
+	for (e = *bucket; e; e = e->hnext) {
+		if (e->hash == h && e->sourcelen == len && 0 == memcmp(e->source, source, len)) {
+			free(code->buf);
+			return;
+		}
+	}
+
+	if (! (e = malloc(sizeof(ByteCacheEntry)))) {
+		free(code->buf);
+		return;
+	}
+	if (! (e->source = malloc(len ? len : 1))) {
+		free(e);
+		free(code->buf);
+		return;
+	}
+
+	memcpy(e->source, source, len);
+	e->sourcelen = len;
+	e->hash = h;
+	e->refcount = 0;
+	e->cached = 1;
+	e->code = *code;
+
+	bytecache_make_room(esize);
+
+	e->hnext = *bucket;
+	*bucket = e;
+	bytecache_lru_push(e);
+	bytecache.size += esize;
+	++bytecache.entries;
+}
+
+/**
+ * Returns a dict of cache statistics.
+ *
+ * Python signature: bytecode_cache_stats()
+ */
+PyObject *bytecache_stats(PyObject *self, PyObject *args) {
+	return Py_BuildValue("{s:k,s:k,s:k,s:k,s:n,s:n}",
+	                     "hits", bytecache.hits,
+	                     "misses", bytecache.misses,
+	                     "evictions", bytecache.evictions,
+	                     "entries", bytecache.entries,
+	                     "size", (Py_ssize_t) bytecache.size,
+	                     "max_size", (Py_ssize_t) bytecache.max_size);
+}
+
+/**
+ * Set the maximum cache size in bytes. A size of 0 disables and empties
+ * the cache. Counters are reset.
+ *
+ * Python signature: set_bytecode_cache_size(max_size)
+ */
+PyObject *bytecache_set_size(PyObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"max_size", NULL};
+	Py_ssize_t max_size;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &max_size)) return NULL;
+
+	if (max_size < 0) {
+		PyErr_SetString(PyExc_ValueError, "Cache size must not be negative.");
+		return NULL;
+	}
+
+	bytecache.max_size = (size_t) max_size;
+	bytecache_make_room(0);
+
+	bytecache.hits = bytecache.misses = bytecache.evictions = 0;
+
+	Py_RETURN_NONE;
+}
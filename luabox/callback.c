@@ -0,0 +1,229 @@
+/**
+ * Python callables exposed to lua.
+ *
+ * Sandbox.register() installs a lua C closure as a global, which forwards
+ * its arguments to a Python callable and returns its results to lua. The
+ * callables are kept in a list on the sandbox, the closure only holds the
+ * index into that list, so lua never owns a reference to a Python object.
+ *
+ * Lua code usually runs without the GIL, so the callback takes it with
+ * PyGILState_Ensure. Lua reports errors with longjmp, which must never
+ * skip releasing the GIL. The Python side is therefore run as a separate
+ * protected call, and the dispatching closure releases the GIL and all
+ * Python references if that call was aborted by a lua error (e.g. running
+ * out of memory while converting a result).
+ *
+ * Every callback is charged `callback_cost` instructions against the cpu
+ * limit, and checks the deadline of the running pcall when it returns.
+ */
+#include "luaboxmodule.h"
+
+/* maximum length of an error message passed on to lua */
+#define CALLBACK_MSG_SIZE 512
+
+/**
+ * State shared between the dispatcher and the protected callback body, so
+ * the dispatcher can clean up after a lua error.
+ */
+typedef struct {
+	Py_ssize_t index;
+	PyGILState_STATE gil;
+	int gil_held;
+	PyObject *args;
+	PyObject *result;
+} CallbackState;
+
+/**
+ * Releases everything the callback body holds. Must be called with the GIL
+ * held via the state.
+ */
+static void callback_release(CallbackState *cs) {
+	Py_CLEAR(cs->args);
+	Py_CLEAR(cs->result);
+	cs->gil_held = 0;
+	PyGILState_Release(cs->gil);
+}
+
+/**
+ * Writes "ExceptionName: message" for the current Python exception to
+ * `msg`, and clears it.
+ */
+static void callback_format_exception(char *msg) {
+	PyObject *type, *value, *tb, *str = NULL;
+	const char *name = "Exception";
+
+	PyErr_Fetch(&type, &value, &tb);
+	PyErr_NormalizeException(&type, &value, &tb);
+
+	if (type && PyType_Check(type)) {
+		name = ((PyTypeObject*) type)->tp_name;
+		/* strip the module, lua users don't care */
+		if (strrchr(name, '.')) name = strrchr(name, '.') + 1;
+	}
+	if (value) str = PyObject_Str(value);
+
+	if (str && PyString_Check(str) && PyString_GET_SIZE(str)) {
+		PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "%s: %s", name, PyString_AS_STRING(str));
+	} else {
+		PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "%s", name);
+	}
+
+	Py_XDECREF(str);
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+	PyErr_Clear();
+}
+
+/**
+ * lua_CFunction running the Python side of a callback in protected mode.
+ *
+ * Called with the CallbackState as a light userdata, followed by the
+ * arguments of the callback.
+ */
+static int callback_body(lua_State *L) {
+	CallbackState *cs = (CallbackState*) lua_touserdata(L, 1);
+	int i, n = lua_gettop(L) - 1;
+	Py_ssize_t nresults;
+	PyObject *item, **items;
+	char msg[CALLBACK_MSG_SIZE];
+	Sandbox *box;
+	lua_getallocf(L, (void**) &box);
+
+	cs->gil = PyGILState_Ensure();
+	cs->gil_held = 1;
+
+	/* a closure copied from a template may refer past the callables
+	 * copied when the child was created */
+	if (! box->callbacks || cs->index < 0 || cs->index >= PyList_GET_SIZE(box->callbacks)) {
+		PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "Function is not available in this sandbox.");
+		goto fail;
+	}
+
+	/* arguments go straight into the argument tuple */
+	if (! (cs->args = PyTuple_New(n))) goto error;
+	for (i = 0; i < n; ++i) {
+		lua_pushvalue(L, i + 2);
+		if (! (item = luabox_pop_from(box, L))) goto error;
+		PyTuple_SET_ITEM(cs->args, i, item);
+	}
+
+	cs->result = PyObject_Call(PyList_GET_ITEM(box->callbacks, cs->index), cs->args, NULL);
+	if (! cs->result) goto error;
+	Py_CLEAR(cs->args);
+
+	/* budgets, only while a pcall is running */
+	if (box->pcall_depth) {
+		box->instructions += box->callback_cost;
+		if (box->cpu_limit && box->instructions >= box->cpu_limit) {
+			box->cpu_exceeded = 1;
+			PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "CPU limit exceeded.");
+			goto fail;
+		}
+		if (0 < box->deadline && luabox_monotonic() >= box->deadline) {
+			box->timed_out = 1;
+			PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "Timeout.");
+			goto fail;
+		}
+	}
+
+	/* a tuple is returned as multiple results, None as no result */
+	if (PyTuple_Check(cs->result)) {
+		nresults = PyTuple_GET_SIZE(cs->result);
+		items = &PyTuple_GET_ITEM(cs->result, 0);
+	} else if (Py_None == cs->result) {
+		nresults = 0;
+		items = NULL;
+	} else {
+		nresults = 1;
+		items = &cs->result;
+	}
+
+	if (nresults > INT_MAX || ! lua_checkstack(L, (int) nresults)) {
+		PyOS_snprintf(msg, CALLBACK_MSG_SIZE, "Too many results.");
+		goto fail;
+	}
+	for (i = 0; i < nresults; ++i) {
+		if (! python_to_lua(L, items[i])) goto error;
+	}
+
+	callback_release(cs);
+	return (int) nresults;
+
+error:
+	callback_format_exception(msg);
+fail:
+	callback_release(cs);
+	if (box->pcall_depth && (box->cpu_exceeded || box->timed_out)) lua_sandbox_limit_error(L, box);
+	return luaL_error(L, "%s", msg);
+}
+
+/**
+ * lua_CFunction installed for a registered callable.
+ *
+ * Upvalues are the index of the callable and callback_body. Runs the body
+ * in protected mode, cleans up if it was aborted and passes on errors.
+ */
+static int callback_dispatch(lua_State *L) {
+	CallbackState cs;
+	int status;
+
+	cs.index = (Py_ssize_t) lua_tointeger(L, lua_upvalueindex(1));
+	cs.gil_held = 0;
+	cs.args = NULL;
+	cs.result = NULL;
+
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 1);
+	lua_pushlightuserdata(L, &cs);
+	lua_insert(L, 2);
+
+	status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+
+	if (cs.gil_held) {
+		/* aborted by a lua error while holding the GIL */
+		PyErr_Clear();
+		callback_release(&cs);
+	}
+
+	if (status) return lua_error(L);
+	return lua_gettop(L);
+}
+
+typedef struct {
+	const char *name;
+	Py_ssize_t index;
+} RegisterArgs;
+
+/**
+ * lua_CFunction creating the closure and storing it as a global.
+ */
+static int callback_register_protected(lua_State *L) {
+	RegisterArgs *args = (RegisterArgs*) lua_touserdata(L, 1);
+
+	lua_pushinteger(L, (lua_Integer) args->index);
+	lua_pushcfunction(L, callback_body);
+	lua_pushcclosure(L, callback_dispatch, 2);
+	lua_setglobal(L, args->name);
+
+	return 0;
+}
+
+/**
+ * Register `callable` as the global function `name`. The caller must hold
+ * the sandbox lock.
+ *
+ * Returns the lua error status, 0 on success, or -1 with a Python
+ * exception set.
+ */
+int luabox_register(Sandbox *self, const char *name, PyObject *callable) {
+	RegisterArgs args;
+
+	if (! self->callbacks && ! (self->callbacks = PyList_New(0))) return -1;
+	if (-1 == PyList_Append(self->callbacks, callable)) return -1;
+
+	args.name = name;
+	args.index = PyList_GET_SIZE(self->callbacks) - 1;
+
+	return lua_cpcall(self->L, callback_register_protected, &args);
+}
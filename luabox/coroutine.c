@@ -0,0 +1,692 @@
+/**
+ * Lua coroutines driven from Python, and a scheduler multiplexing many of
+ * them on one thread.
+ *
+ * A Coroutine wraps a lua thread created with lua_newthread. resume() runs
+ * it with lua_resume until it yields, returns or, if a time slice is
+ * given, has executed that many instructions. Preemption is done by
+ * yielding from the count hook, which lua 5.1 only allows while no C
+ * function, metamethod or for iterator is active on the coroutine's
+ * stack. The hook therefore inspects the stack first and postpones
+ * preemption while that is not the case (e.g. inside pcall).
+ *
+ * Host calls that must not block are registered with register_async():
+ * calling one from lua yields the coroutine with the function's name and
+ * arguments, and the values it is resumed with are the call's results.
+ *
+ * The Scheduler round-robins over ready coroutines, one time slice each
+ * per step(). A coroutine that yields hands the yielded values to the
+ * scheduler's on_yield callback, and is resumed once the host calls
+ * wake() with the results. step() never blocks, so it can be driven by
+ * any event loop; the host side of a yield can be asynchronous.
+ */
+#include "luaboxmodule.h"
+
+PyTypeObject CoroutineType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.Coroutine",                 /*tp_name*/
+	sizeof(Coroutine)                   /*tp_basicsize*/
+};
+
+PyTypeObject SchedulerType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.Scheduler",                 /*tp_name*/
+	sizeof(Scheduler)                   /*tp_basicsize*/
+
+	/* The other members are initialized in SchedulerType_INIT */
+};
+
+/* Default time slice of a Scheduler, in instructions. */
+#define SCHEDULER_SLICE 10000
+
+/**
+ * Releases the lua thread of a coroutine. The caller must hold the sandbox
+ * lock.
+ */
+static void coroutine_release(Coroutine *self) {
+	if (LUA_NOREF == self->ref) return;
+
+	luaL_unref(self->sandbox->L, LUA_REGISTRYINDEX, self->ref);
+	self->ref = LUA_NOREF;
+	self->T = NULL;
+	--self->sandbox->nrefs;
+}
+
+static void Coroutine_dealloc(Coroutine *self) {
+	if (LUA_NOREF != self->ref) {
+		Sandbox_lock(self->sandbox);
+		coroutine_release(self);
+		Sandbox_unlock(self->sandbox);
+	}
+	Py_DECREF(self->sandbox);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/* Events whose metamethods lua 5.1 calls through a C boundary. */
+static const char *const coroutine_events[] = {
+	"__index", "__newindex", "__eq", "__lt", "__le", "__add", "__sub", "__mul",
+	"__div", "__mod", "__pow", "__unm", "__len", "__concat", NULL
+};
+
+/**
+ * Whether the function at `fn` is a metamethod of the value on top of the
+ * stack, which is popped.
+ */
+static int coroutine_is_metamethod(lua_State *L, int fn) {
+	const char *const *event;
+	int found = 0;
+
+	if (! lua_getmetatable(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	for (event = coroutine_events; *event && ! found; ++event) {
+		lua_pushstring(L, *event);
+		lua_rawget(L, -2);
+		found = lua_rawequal(L, -1, fn);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	return found;
+}
+
+/**
+ * Whether the running coroutine `L` can yield from a hook.
+ *
+ * lua 5.1 cannot yield across a C boundary: a C function, or a lua
+ * function called as a metamethod or for iterator. Frames entered by a
+ * call or tail call instruction are fine, named or not.
+ *
+ * The debug API does not tell an unnamed call from a metamethod call, so
+ * an unnamed function is taken for a metamethod if it is a metamethod of
+ * its first or second argument.
+ */
+static int coroutine_preemptible(lua_State *L) {
+	lua_Debug ar, next;
+	int level, i, fn, metamethod;
+
+	for (level = 0; lua_getstack(L, level, &ar); ++level) {
+		if (! lua_getinfo(L, "Sn", &ar) || 'C' == ar.what[0]) return 0;
+
+		/* a frame lost to a tail call */
+		if ('t' == ar.what[0]) continue;
+
+		/* the bottom frame was entered by lua_resume */
+		if (! lua_getstack(L, level + 1, &next)) break;
+
+		if (ar.name && ! strcmp(ar.name, "(for generator)")) return 0;
+		if (ar.namewhat[0]) continue;
+
+		/* entered by a tail call */
+		if (! lua_getinfo(L, "S", &next)) return 0;
+		if ('t' == next.what[0]) continue;
+
+		lua_getinfo(L, "f", &ar);
+		fn = lua_gettop(L);
+		for (metamethod = 0, i = 1; i <= 2 && ! metamethod && lua_getlocal(L, &ar, i); ++i) {
+			metamethod = coroutine_is_metamethod(L, fn);
+		}
+		lua_pop(L, 1);
+		if (metamethod) return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Count hook of a running coroutine.
+ *
+ * Enforces the sandbox's cpu limit over the lifetime of the coroutine and
+ * the deadline of the running resume, and preempts the coroutine once its
+ * time slice is used up.
+ *
+ * Threads created by the script inherit this hook. When such a thread is
+ * resumed later from a plain pcall, no coroutine is running: the
+ * instructions are charged to the pcall and the thread gets its hook.
+ */
+static void coroutine_hook(lua_State *L, lua_Debug *ar) {
+	Sandbox *box;
+	Coroutine *co;
+	lua_getallocf(L, (void**) &box);
+	co = (Coroutine*) box->coroutine;
+
+	/* the error was caught by lua code */
+	if (box->cpu_exceeded || box->timed_out) lua_sandbox_limit_error(L, box);
+
+	/* the thread may have been created with another coroutine's count */
+	box->instructions += lua_gethookcount(L);
+
+	if (! co) {
+		if (box->cpu_limit || box->deadline || box->profiling) lua_sethook(L, lua_sandbox_hook, LUA_MASKCOUNT, box->hook_count);
+		else lua_sethook(L, NULL, 0, 0);
+
+		if (box->cpu_limit && box->instructions >= box->cpu_limit) {
+			box->cpu_exceeded = 1;
+			lua_sandbox_limit_error(L, box);
+		}
+		return;
+	}
+
+	if (box->cpu_limit && box->instructions >= box->cpu_limit) {
+		box->cpu_exceeded = 1;
+		lua_sandbox_limit_error(L, box);
+	}
+	if (0 < box->deadline && luabox_monotonic() >= box->deadline) {
+		box->timed_out = 1;
+		lua_sandbox_limit_error(L, box);
+	}
+
+	/* threads created by the script itself are never preempted */
+	if (! co->slice || L != co->T) return;
+
+	co->used += co->hook_count;
+	if (co->used >= co->slice && coroutine_preemptible(L)) {
+		co->status = COROUTINE_PREEMPTED;
+		lua_yield(L, 0);
+	}
+}
+
+/**
+ * Resumes a coroutine with the values in the tuple `args`.
+ *
+ * \param slice Number of instructions after which the coroutine is
+ *              preempted, 0 for no limit.
+ * \param timeout Wall-clock time limit of this resume in seconds, 0 for
+ *                none.
+ *
+ * Returns a tuple with the yielded or returned values, or NULL with an
+ * exception set.
+ */
+static PyObject *coroutine_resume(Coroutine *self, PyObject *args, unsigned long slice, double timeout) {
+	Sandbox *box = self->sandbox;
+	lua_State *T = self->T;
+	Py_ssize_t i, n = PyTuple_GET_SIZE(args);
+	PyObject *rval = NULL, *item;
+	const char *msg;
+	int status, top;
+
+	if (COROUTINE_DEAD == self->status) {
+		PyErr_SetString(PyExc_ValueError, "Cannot resume a dead coroutine.");
+		return NULL;
+	}
+	if (COROUTINE_PREEMPTED == self->status && n) {
+		PyErr_SetString(PyExc_ValueError, "A preempted coroutine must be resumed without arguments.");
+		return NULL;
+	}
+
+	Sandbox_lock(box);
+
+	/* the hook state of the sandbox is used by the running call */
+	if (box->pcall_depth) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot resume a coroutine while its sandbox is running.");
+		goto out;
+	}
+	if (box->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot run code in a frozen sandbox.");
+		goto out;
+	}
+
+	top = lua_gettop(T);
+	if (n > INT_MAX - top || ! lua_checkstack(T, (int) n)) {
+		PyErr_SetString(PyExc_MemoryError, "Too many values for lua stack.");
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		if (! python_to_lua(T, PyTuple_GET_ITEM(args, i))) {
+			lua_settop(T, top);
+			goto out;
+		}
+	}
+
+	/* cpu accounting continues where the last resume stopped */
+	box->instructions = self->instructions;
+	box->cpu_exceeded = 0;
+	box->timed_out = 0;
+	box->deadline = 0;
+	box->alloc_since_check = 0;
+	if (0 < timeout) {
+		box->last_check = luabox_monotonic();
+		box->deadline = box->last_check + timeout;
+	}
+	box->coroutine = (PyObject*) self;
+
+	self->used = 0;
+	self->slice = slice;
+	self->hook_count = slice && slice < INT_MAX ? (int) slice : 0;
+	if ((box->cpu_limit || box->deadline) && (! self->hook_count || self->hook_count > box->cpu_granularity)) self->hook_count = box->cpu_granularity;
+	if (self->hook_count) lua_sethook(T, coroutine_hook, LUA_MASKCOUNT, self->hook_count);
+	else lua_sethook(T, NULL, 0, 0);
+
+	self->status = COROUTINE_SUSPENDED;
+	++box->pcall_depth;
+	Py_BEGIN_ALLOW_THREADS
+	status = lua_resume(T, (int) n);
+	Py_END_ALLOW_THREADS
+	--box->pcall_depth;
+
+	box->coroutine = NULL;
+	box->deadline = 0;
+	self->instructions = box->instructions;
+	lua_sethook(T, NULL, 0, 0);
+
+	switch (status) {
+		case 0:
+			self->status = COROUTINE_DEAD;
+			/* fall through */
+
+		case LUA_YIELD:
+			/* the stack holds exactly the yielded or returned values */
+			n = lua_gettop(T);
+			if (! (rval = PyTuple_New(n))) {
+				lua_settop(T, 0);
+				break;
+			}
+			for (i = n - 1; i >= 0; --i) {
+				if (! (item = luabox_pop_from(box, T))) {
+					Py_CLEAR(rval);
+					lua_settop(T, 0);
+					break;
+				}
+				PyTuple_SET_ITEM(rval, i, item);
+			}
+			break;
+
+		default:
+			self->status = COROUTINE_DEAD;
+			if (! (msg = lua_tostring(T, -1))) msg = "(error object is not a string)";
+
+			/* allocations are denied after the deadline */
+			if ((LUA_ERRRUN == status || LUA_ERRMEM == status) && box->timed_out) PyErr_SetString(Exc_Timeout, msg);
+			else if (LUA_ERRMEM == status) PyErr_SetString(Exc_OutOfMemory, msg);
+			else if (LUA_ERRRUN == status && box->cpu_exceeded) PyErr_SetString(Exc_CPULimitExceeded, msg);
+			else if (LUA_ERRRUN == status) PyErr_SetString(Exc_RuntimeError, msg);
+			else PyErr_SetString(Exc_LuaBoxException, msg);
+			break;
+	}
+
+	if (COROUTINE_DEAD == self->status) coroutine_release(self);
+
+out:
+	Sandbox_unlock(box);
+	return rval;
+}
+
+/**
+ * Resume the coroutine.
+ *
+ * The arguments are passed to the function on the first resume, and
+ * returned by the yielding call (e.g. an async host call) afterwards.
+ *
+ * \param slice If given, the coroutine is preempted after about this
+ *              many instructions, and `status` becomes 'preempted'.
+ * \param timeout If positive, the resume is aborted with Timeout after
+ *                that many seconds, like Sandbox.pcall(). Time spent
+ *                suspended does not count.
+ *
+ * Returns the values yielded, or returned by the
+ * function, as a tuple. An error in the coroutine is raised like by
+ * Sandbox.pcall() and leaves it dead.
+ *
+ * Python signature: resume(*args, slice=0, timeout=0)
+ */
+static PyObject* Coroutine_resume(Coroutine *self, PyObject *args, PyObject *kwds) {
+	PyObject *value;
+	unsigned long slice = 0;
+	double timeout = 0;
+	Py_ssize_t found = 0;
+
+	if (kwds && PyDict_Size(kwds)) {
+		if ((value = PyDict_GetItemString(kwds, "slice"))) {
+			++found;
+			slice = PyInt_AsUnsignedLongMask(value);
+			if (PyErr_Occurred()) return NULL;
+		}
+		if ((value = PyDict_GetItemString(kwds, "timeout"))) {
+			++found;
+			timeout = PyFloat_AsDouble(value);
+			if (PyErr_Occurred()) return NULL;
+			if (0 > timeout) {
+				PyErr_SetString(PyExc_ValueError, "Timeout must not be negative.");
+				return NULL;
+			}
+		}
+		if (found != PyDict_Size(kwds)) {
+			PyErr_SetString(PyExc_TypeError, "resume() only accepts the keyword arguments slice and timeout.");
+			return NULL;
+		}
+	}
+
+	return coroutine_resume(self, args, slice, timeout);
+}
+
+/**
+ * Getter for status: 'suspended', 'preempted' or 'dead'.
+ */
+static PyObject *Coroutine_getstatus(Coroutine *self, void *closure) {
+	switch (self->status) {
+		case COROUTINE_PREEMPTED: return PyString_FromString("preempted");
+		case COROUTINE_DEAD: return PyString_FromString("dead");
+		default: return PyString_FromString("suspended");
+	}
+}
+
+static PyMethodDef Coroutine_methods[] = {
+	{"resume", SUPPRESS_PYMCFUNCTION_WARNINGS Coroutine_resume, METH_VARARGS | METH_KEYWORDS, "resume the coroutine, return yielded or returned values"},
+	{NULL}
+};
+
+static PyGetSetDef Coroutine_getset[] = {
+	{"status", (getter)Coroutine_getstatus, NULL, "'suspended', 'preempted' or 'dead'", NULL},
+	{NULL}
+};
+
+static PyMemberDef Coroutine_members[] = {
+	{"instructions", T_ULONG, offsetof(Coroutine, instructions), READONLY, "instructions used so far (in multiples of the hook interval)"},
+	{NULL}
+};
+
+void CoroutineType_INIT(PyTypeObject *t) {
+	t->tp_new = 0; // created by Sandbox.coroutine only
+	t->tp_dealloc = (destructor)Coroutine_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT;
+	t->tp_doc = "Lua coroutine that can be resumed from Python.";
+	t->tp_methods = Coroutine_methods;
+	t->tp_getset = Coroutine_getset;
+	t->tp_members = Coroutine_members;
+
+	if(PyType_Ready(t) < 0) return;
+}
+
+/**
+ * lua_CFunction of an async host call. Yields its name (the upvalue)
+ * followed by the arguments.
+ */
+static int coroutine_host_call(lua_State *L) {
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	return lua_yield(L, lua_gettop(L));
+}
+
+/**
+ * lua_CFunction creating an async host call named by the string argument
+ * and storing it as a global.
+ */
+static int coroutine_register_protected(lua_State *L) {
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, coroutine_host_call, 1);
+	lua_setglobal(L, lua_tostring(L, 1));
+	return 0;
+}
+
+/**
+ * Register the global function `name` as an async host call. The caller
+ * must hold the sandbox lock.
+ *
+ * Returns the lua error status, 0 on success.
+ */
+int luabox_register_async(Sandbox *self, const char *name) {
+	return lua_cpcall(self->L, coroutine_register_protected, (void*) name);
+}
+
+/**
+ * lua_CFunction creating the thread of the coroutine passed as a light
+ * userdata, and the registry reference keeping it alive.
+ */
+static int coroutine_init(lua_State *L) {
+	Coroutine *self = (Coroutine*) lua_touserdata(L, 1);
+	lua_State *T = lua_newthread(L);
+
+	self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	self->T = T;
+	return 0;
+}
+
+/**
+ * Creates a coroutine for the function on top of the stack, which is
+ * popped. The caller must hold the sandbox lock.
+ *
+ * On errors, the function stays on the stack.
+ */
+PyObject *Coroutine_from_stack(Sandbox *sandbox) {
+	Coroutine *self;
+	int status;
+
+	if (! lua_isfunction(sandbox->L, -1)) {
+		PyErr_SetString(PyExc_TypeError, "Top of lua stack is not a function.");
+		return NULL;
+	}
+
+	if (! (self = PyObject_New(Coroutine, &CoroutineType))) return NULL;
+
+	Py_INCREF(sandbox);
+	self->sandbox = sandbox;
+	self->status = COROUTINE_SUSPENDED;
+	self->instructions = 0;
+	self->used = 0;
+	self->slice = 0;
+	self->hook_count = 0;
+	self->T = NULL;
+	self->ref = LUA_NOREF;
+
+	if ((status = lua_cpcall(sandbox->L, coroutine_init, self))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(sandbox->L, -1));
+		lua_pop(sandbox->L, 1);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	/* a new thread has room for the function, moving it does not allocate */
+	lua_xmove(sandbox->L, self->T, 1);
+
+	/* keep track of refs, so the sandbox is not reset while in use */
+	++sandbox->nrefs;
+
+	return (PyObject*) self;
+}
+
+/* Scheduler */
+
+static void Scheduler_dealloc(Scheduler *self) {
+	Py_XDECREF(self->ready);
+	Py_XDECREF(self->on_yield);
+	Py_XDECREF(self->on_done);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/**
+ * new-function for Python object.
+ *
+ * \param slice Time slice per coroutine and step, in instructions.
+ * \param on_yield Called as on_yield(coroutine, values) when a coroutine
+ *                 yields. The coroutine is resumed after wake() was
+ *                 called for it. Without on_yield, yielding coroutines
+ *                 are resumed right away.
+ * \param on_done Called as on_done(coroutine, results, exception) when a
+ *                coroutine finished; results is None if it failed.
+ *                Without on_done, errors are raised by step().
+ *
+ * Python signature: Scheduler(slice=10000, on_yield=None, on_done=None)
+ */
+static PyObject* Scheduler_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	Scheduler *self = (Scheduler*) type->tp_alloc(type, 0);
+	static char *kwlist[] = {"slice", "on_yield", "on_done", NULL};
+	PyObject *on_yield = NULL, *on_done = NULL;
+
+	if (! self) return NULL;
+
+	self->slice = SCHEDULER_SLICE;
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|kOO", kwlist, &self->slice, &on_yield, &on_done)) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	if (on_yield && Py_None != on_yield) {
+		Py_INCREF(on_yield);
+		self->on_yield = on_yield;
+	}
+	if (on_done && Py_None != on_done) {
+		Py_INCREF(on_done);
+		self->on_done = on_done;
+	}
+
+	if (! (self->ready = PyList_New(0))) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject*) self;
+}
+
+/**
+ * Queue a coroutine to be resumed with the given values by the next
+ * step(). Used both to start a coroutine and to answer a yield.
+ *
+ * Python signature: wake(coroutine, *args)
+ */
+static PyObject* Scheduler_wake(Scheduler *self, PyObject *args) {
+	PyObject *co, *entry;
+	int rval;
+
+	if (1 > PyTuple_GET_SIZE(args) || ! PyObject_TypeCheck(co = PyTuple_GET_ITEM(args, 0), &CoroutineType)) {
+		PyErr_SetString(PyExc_TypeError, "wake() requires a coroutine.");
+		return NULL;
+	}
+
+	if (! (entry = Py_BuildValue("(ON)", co, PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args))))) return NULL;
+	rval = PyList_Append(self->ready, entry);
+	Py_DECREF(entry);
+
+	if (-1 == rval) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Handles the outcome of resuming `co`: requeues it, or passes it to the
+ * callbacks. Returns 0 on success, -1 with an exception set.
+ */
+static int scheduler_dispatch(Scheduler *self, Coroutine *co, PyObject *values) {
+	PyObject *type, *value, *tb, *rval, *entry;
+	int status;
+
+	if (! values) {
+		if (! self->on_done) return -1;
+
+		PyErr_Fetch(&type, &value, &tb);
+		PyErr_NormalizeException(&type, &value, &tb);
+		rval = PyObject_CallFunctionObjArgs(self->on_done, co, Py_None, value ? value : Py_None, NULL);
+		Py_XDECREF(type);
+		Py_XDECREF(value);
+		Py_XDECREF(tb);
+	} else if (COROUTINE_DEAD == co->status) {
+		if (! self->on_done) return 0;
+		rval = PyObject_CallFunctionObjArgs(self->on_done, co, values, Py_None, NULL);
+	} else if (COROUTINE_PREEMPTED == co->status || ! self->on_yield) {
+		/* back into the queue, without values */
+		if (! (entry = Py_BuildValue("(O())", co))) return -1;
+		status = PyList_Append(self->ready, entry);
+		Py_DECREF(entry);
+		return status;
+	} else {
+		rval = PyObject_CallFunctionObjArgs(self->on_yield, co, values, NULL);
+	}
+
+	if (! rval) return -1;
+	Py_DECREF(rval);
+	return 0;
+}
+
+/**
+ * Resume every ready coroutine for one time slice.
+ *
+ * Coroutines woken during the step run in the next one. Returns the
+ * number of ready coroutines, so a host event loop can schedule the next
+ * step while it is positive.
+ *
+ * Python signature: step()
+ */
+static PyObject* Scheduler_step(Scheduler *self, PyObject *args) {
+	PyObject *batch = self->ready, *entry, *values, *rest;
+	Py_ssize_t i, n = PyList_GET_SIZE(batch);
+	Coroutine *co;
+
+	if (! (self->ready = PyList_New(0))) {
+		self->ready = batch;
+		return NULL;
+	}
+
+	for (i = 0; i < n; ++i) {
+		entry = PyList_GET_ITEM(batch, i);
+		co = (Coroutine*) PyTuple_GET_ITEM(entry, 0);
+
+		values = coroutine_resume(co, PyTuple_GET_ITEM(entry, 1), self->slice, 0);
+		if (-1 == scheduler_dispatch(self, co, values)) {
+			Py_XDECREF(values);
+
+			/* keep the coroutines that did not run */
+			rest = PyList_GetSlice(batch, i + 1, n);
+			if (rest) {
+				PyList_SetSlice(self->ready, 0, 0, rest);
+				Py_DECREF(rest);
+			}
+			Py_DECREF(batch);
+			return NULL;
+		}
+		Py_XDECREF(values);
+	}
+
+	Py_DECREF(batch);
+	return PyInt_FromSsize_t(PyList_GET_SIZE(self->ready));
+}
+
+/**
+ * Step until no coroutine is ready.
+ *
+ * Python signature: run()
+ */
+static PyObject* Scheduler_run(Scheduler *self, PyObject *args) {
+	PyObject *rval;
+
+	while (PyList_GET_SIZE(self->ready)) {
+		if (! (rval = Scheduler_step(self, NULL))) return NULL;
+		Py_DECREF(rval);
+	}
+
+	Py_RETURN_NONE;
+}
+
+static Py_ssize_t Scheduler_length(PyObject *self) {
+	return PyList_GET_SIZE(((Scheduler*) self)->ready);
+}
+
+static PySequenceMethods Scheduler_sequence;
+
+static PyMethodDef Scheduler_methods[] = {
+	{"wake", SUPPRESS_PYMCFUNCTION_WARNINGS Scheduler_wake, METH_VARARGS, "queue a coroutine to be resumed with values"},
+	{"step", SUPPRESS_PYMCFUNCTION_WARNINGS Scheduler_step, METH_NOARGS, "resume every ready coroutine for one time slice"},
+	{"run", SUPPRESS_PYMCFUNCTION_WARNINGS Scheduler_run, METH_NOARGS, "step until no coroutine is ready"},
+	{NULL}
+};
+
+static PyMemberDef Scheduler_members[] = {
+	{"slice", T_ULONG, offsetof(Scheduler, slice), 0, "time slice per coroutine and step, in instructions"},
+	{NULL}
+};
+
+/**
+ * INIT-function for Scheduler type.
+ */
+void SchedulerType_INIT(PyTypeObject *t) {
+	t->tp_dealloc = (destructor)Scheduler_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+	t->tp_doc = "Round-robin scheduler for lua coroutines.";
+	t->tp_methods = Scheduler_methods;
+	t->tp_members = Scheduler_members;
+	t->tp_new = Scheduler_new;
+
+	t->tp_as_sequence = &Scheduler_sequence;
+	Scheduler_sequence.sq_length = Scheduler_length;
+
+	if(PyType_Ready(t) < 0) return;
+}
@@ -0,0 +1,426 @@
+/**
+ * Whitelisted standard libraries, opened lazily.
+ *
+ * Sandbox(libraries=[...]) makes approved libraries available. An entry is
+ * either a library name, which opens its safe subset, or "library.function"
+ * for a single (safe or optional) function. Anything not in these lists,
+ * such as io, debug, os.execute or string.dump, cannot be requested.
+ *
+ * Nothing is opened up front. The globals table gets an __index stub,
+ * which opens a library the first time one of its globals is read: the
+ * library's table for modules, any of the approved functions for base.
+ * A library is opened by running its luaopen_* function in a scratch
+ * thread whose globals are a fresh table. Only the approved fields are
+ * then copied into the sandbox, so unapproved functions never become
+ * reachable. Globals a script defined itself take precedence over base
+ * functions. A library is opened again if its global is removed, e.g. by
+ * resetting to a snapshot taken before it was first used.
+ *
+ * The time and lua memory spent opening each library are available from
+ * Sandbox.library_stats().
+ */
+#include "luaboxmodule.h"
+
+/* maximum number of single functions that can be requested */
+#define LIBRARY_MAX_REQUESTS 128
+
+/* upvalues of library_index */
+#define LIBRARY_PENDING lua_upvalueindex(1)
+#define LIBRARY_WANTED lua_upvalueindex(2)
+#define LIBRARY_FALLBACK lua_upvalueindex(3)
+
+typedef struct {
+	const char *name;
+	lua_CFunction open;
+	const char *const *safe;       /* opened when the library is requested */
+	const char *const *optional;   /* only opened when requested by name */
+} LuaBoxLibrary;
+
+/* pcall and xpcall cannot keep limit errors from ending the call, see
+ * lua_sandbox_limit_error */
+static const char *const base_safe[] = {
+	"assert", "error", "getmetatable", "ipairs", "next", "pairs", "pcall",
+	"rawequal", "rawget", "rawset", "require", "select", "setmetatable",
+	"tonumber", "tostring", "type", "unpack", "xpcall", "_G", "_VERSION",
+	NULL
+};
+static const char *const base_optional[] = {"print", "collectgarbage", "gcinfo", NULL};
+
+static const char *const coroutine_safe[] = {
+	"create", "resume", "running", "status", "wrap", "yield", NULL
+};
+
+static const char *const string_safe[] = {
+	"byte", "char", "find", "format", "gmatch", "gsub", "len", "lower",
+	"match", "rep", "reverse", "sub", "upper", NULL
+};
+
+static const char *const table_safe[] = {"concat", "insert", "maxn", "remove", "sort", NULL};
+static const char *const table_optional[] = {"foreach", "foreachi", "getn", "setn", NULL};
+
+static const char *const math_safe[] = {
+	"abs", "acos", "asin", "atan", "atan2", "ceil", "cos", "cosh", "deg",
+	"exp", "floor", "fmod", "frexp", "huge", "ldexp", "log", "log10", "max",
+	"min", "modf", "pi", "pow", "rad", "random", "sin", "sinh", "sqrt",
+	"tan", "tanh", NULL
+};
+/* reseeds the C library's generator, shared by the whole process */
+static const char *const math_optional[] = {"randomseed", NULL};
+
+static const char *const os_safe[] = {"clock", "date", "difftime", "time", NULL};
+
+static const char *const none[] = {NULL};
+
+/* the coroutine library is opened by luaopen_base in lua 5.1 */
+static const LuaBoxLibrary luabox_libraries[LUABOX_NUM_LIBRARIES] = {
+	{"base", luaopen_base, base_safe, base_optional},
+	{LUA_COLIBNAME, luaopen_base, coroutine_safe, none},
+	{LUA_STRLIBNAME, luaopen_string, string_safe, none},
+	{LUA_TABLIBNAME, luaopen_table, table_safe, table_optional},
+	{LUA_MATHLIBNAME, luaopen_math, math_safe, math_optional},
+	{LUA_OSLIBNAME, luaopen_os, os_safe, none},
+};
+
+/**
+ * Libraries and functions requested for a sandbox.
+ */
+typedef struct {
+	unsigned int whole;
+	int nfunctions;
+	int library[LIBRARY_MAX_REQUESTS];
+	const char *function[LIBRARY_MAX_REQUESTS];
+} LibraryRequest;
+
+/**
+ * Returns the index of the library called `name` (of length `len`), or
+ * -1.
+ */
+static int library_find(const char *name, size_t len) {
+	int i;
+
+	for (i = 0; i < LUABOX_NUM_LIBRARIES; ++i) {
+		if (strlen(luabox_libraries[i].name) == len && 0 == memcmp(luabox_libraries[i].name, name, len)) return i;
+	}
+	return -1;
+}
+
+/**
+ * Returns the entry for `name` in the NULL-terminated `list`, or NULL.
+ */
+static const char *library_find_function(const char *const *list, const char *name) {
+	for (; *list; ++list) {
+		if (0 == strcmp(*list, name)) return *list;
+	}
+	return NULL;
+}
+
+/**
+ * lua_CFunction replacing require: returns an approved library, opening
+ * it if needed. The upvalue is the table of pending globals.
+ */
+static int library_require(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+
+	lua_pushvalue(L, 1);
+	lua_rawget(L, lua_upvalueindex(1));
+	if (! lua_isstring(L, -1) || strcmp(name, lua_tostring(L, -1))) {
+		return luaL_error(L, "module '%s' not found", name);
+	}
+
+	lua_getfield(L, LUA_GLOBALSINDEX, name);
+	return 1;
+}
+
+/**
+ * Removes the tables luaL_register keeps in the registry for `name`. When
+ * they exist, luaL_register fills them instead of the globals of the
+ * scratch thread, so opening a library a second time would find nothing.
+ * They also hold the unapproved functions. luaopen_base registers both _G
+ * and the coroutine library.
+ */
+static void library_forget(lua_State *L, const char *name) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		lua_setfield(L, -2, name);
+		lua_pushnil(L);
+		lua_setfield(L, -2, "_G");
+		lua_pushnil(L);
+		lua_setfield(L, -2, LUA_COLIBNAME);
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Opens the library `lib` and installs its wanted fields. Called from
+ * library_index, whose upvalues are used.
+ */
+static void library_open(lua_State *L, int lib) {
+	const LuaBoxLibrary *def = &luabox_libraries[lib];
+	int is_base = (0 == lib), top = lua_gettop(L), wanted, src, dst;
+	size_t mem;
+	double start;
+	lua_State *T;
+	Sandbox *box;
+
+	lua_getallocf(L, (void**) &box);
+	start = luabox_monotonic();
+	mem = box->lua_current_mem;
+
+	lua_getfield(L, LIBRARY_WANTED, def->name);
+	wanted = lua_gettop(L);
+
+	/* open into the globals of a scratch thread */
+	library_forget(L, def->name);
+	T = lua_newthread(L);
+	lua_newtable(T);
+	lua_replace(T, LUA_GLOBALSINDEX);
+	lua_pushcfunction(T, def->open);
+	if (lua_pcall(T, 0, 0, 0)) {
+		lua_xmove(T, L, 1);
+		lua_error(L);
+	}
+
+	lua_pushvalue(T, LUA_GLOBALSINDEX);
+	if (! is_base) {
+		lua_getfield(T, -1, def->name);
+		lua_remove(T, -2);
+	}
+	lua_xmove(T, L, 1);
+	src = lua_gettop(L);
+
+	if (is_base) {
+		dst = LUA_GLOBALSINDEX;
+	} else {
+		lua_newtable(L);
+		dst = lua_gettop(L);
+	}
+
+	/* copy the wanted fields */
+	lua_pushnil(L);
+	while (lua_next(L, wanted)) {
+		lua_pop(L, 1);
+
+		if (is_base) {
+			/* globals defined by the script win */
+			lua_pushvalue(L, -1);
+			lua_rawget(L, LUA_GLOBALSINDEX);
+			if (! lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_pop(L, 1);
+		}
+
+		lua_pushvalue(L, -1);
+		if (is_base && 0 == strcmp("_G", lua_tostring(L, -1))) {
+			lua_pushvalue(L, LUA_GLOBALSINDEX);
+		} else if (is_base && 0 == strcmp("require", lua_tostring(L, -1))) {
+			lua_pushvalue(L, LIBRARY_PENDING);
+			lua_pushcclosure(L, library_require, 1);
+		} else {
+			lua_pushvalue(L, -1);
+			lua_rawget(L, src);
+		}
+		lua_rawset(L, dst);
+	}
+
+	if (! is_base) {
+		/* string methods must not reach string.dump via the metatable */
+		lua_pushliteral(L, "");
+		if (0 == strcmp(LUA_STRLIBNAME, def->name) && lua_getmetatable(L, -1)) {
+			lua_pushvalue(L, dst);
+			lua_setfield(L, -2, "__index");
+		}
+		lua_pushvalue(L, dst);
+		lua_setfield(L, LUA_GLOBALSINDEX, def->name);
+	}
+
+	library_forget(L, def->name);
+	lua_settop(L, top);
+
+	++box->libstats[lib].opened;
+	box->libstats[lib].time += luabox_monotonic() - start;
+	if (box->lua_current_mem > mem) box->libstats[lib].memory += box->lua_current_mem - mem;
+}
+
+/**
+ * __index metamethod of the globals. Opens the library providing the
+ * global if there is one, otherwise defers to the previous __index, e.g.
+ * that of a template (see template.c).
+ */
+static int library_index(lua_State *L) {
+	int lib;
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, LIBRARY_PENDING);
+	if (lua_isstring(L, -1)) {
+		lib = library_find(lua_tostring(L, -1), lua_objlen(L, -1));
+		lua_pop(L, 1);
+		library_open(L, lib);
+
+		lua_pushvalue(L, 2);
+		lua_rawget(L, 1);
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	if (lua_isfunction(L, LIBRARY_FALLBACK)) {
+		lua_pushvalue(L, LIBRARY_FALLBACK);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_call(L, 2, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Adds `name` to the set of wanted fields of library `lib`, and marks the
+ * global that opens it as pending.
+ */
+static void library_want(lua_State *L, int pending, int wanted, int lib, const char *name) {
+	const char *libname = luabox_libraries[lib].name;
+
+	lua_getfield(L, wanted, libname);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, wanted, libname);
+	}
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+
+	lua_pushstring(L, libname);
+	lua_setfield(L, pending, 0 == lib ? name : libname);
+}
+
+/**
+ * lua_CFunction installing the __index stub for the LibraryRequest passed
+ * as a light userdata.
+ */
+static int library_attach(lua_State *L) {
+	LibraryRequest *req = (LibraryRequest*) lua_touserdata(L, 1);
+	const char *const *name;
+	int i, pending, wanted;
+
+	lua_newtable(L);
+	pending = lua_gettop(L);
+	lua_newtable(L);
+	wanted = lua_gettop(L);
+
+	for (i = 0; i < LUABOX_NUM_LIBRARIES; ++i) {
+		if (! (req->whole & (1u << i))) continue;
+		for (name = luabox_libraries[i].safe; *name; ++name) library_want(L, pending, wanted, i, *name);
+	}
+	for (i = 0; i < req->nfunctions; ++i) library_want(L, pending, wanted, req->library[i], req->function[i]);
+
+	/* keep an existing __index as fallback */
+	if (! lua_getmetatable(L, LUA_GLOBALSINDEX)) {
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setmetatable(L, LUA_GLOBALSINDEX);
+	}
+	lua_getfield(L, -1, "__index");
+	lua_pushcclosure(L, library_index, 3);
+	lua_setfield(L, -2, "__index");
+
+	return 0;
+}
+
+/**
+ * Make the libraries named in the sequence `names` available to `self`,
+ * see above. The caller must hold the sandbox lock.
+ *
+ * Returns the lua error status, 0 on success, or -1 with a Python
+ * exception set.
+ */
+int luabox_open_libraries(Sandbox *self, PyObject *names) {
+	LibraryRequest req;
+	PyObject *seq, *item;
+	const char *name, *dot, *function;
+	Py_ssize_t i, n;
+	int lib;
+
+	if (! (seq = PySequence_Fast(names, "Libraries must be a sequence of names."))) return -1;
+
+	req.whole = 0;
+	req.nfunctions = 0;
+	n = PySequence_Fast_GET_SIZE(seq);
+
+	for (i = 0; i < n; ++i) {
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (! PyString_Check(item)) {
+			PyErr_SetString(PyExc_TypeError, "Library names must be strings.");
+			goto error;
+		}
+		name = PyString_AS_STRING(item);
+
+		if (! (dot = strchr(name, '.'))) {
+			if (-1 == (lib = library_find(name, strlen(name)))) {
+				PyErr_Format(PyExc_ValueError, "'%s' is not an approved library.", name);
+				goto error;
+			}
+			req.whole |= 1u << lib;
+			self->libraries |= 1u << lib;
+			continue;
+		}
+
+		lib = library_find(name, dot - name);
+		function = NULL;
+		if (-1 != lib && ! (function = library_find_function(luabox_libraries[lib].safe, dot + 1))) {
+			function = library_find_function(luabox_libraries[lib].optional, dot + 1);
+		}
+		if (! function) {
+			PyErr_Format(PyExc_ValueError, "'%s' is not an approved library function.", name);
+			goto error;
+		}
+		if (LIBRARY_MAX_REQUESTS == req.nfunctions) {
+			PyErr_SetString(PyExc_ValueError, "Too many library functions.");
+			goto error;
+		}
+		req.library[req.nfunctions] = lib;
+		req.function[req.nfunctions++] = function;
+		self->libraries |= 1u << lib;
+	}
+
+	Py_DECREF(seq);
+	return lua_cpcall(self->L, library_attach, &req);
+
+error:
+	Py_DECREF(seq);
+	return -1;
+}
+
+/**
+ * Returns a dict mapping the name of each requested library to a dict of
+ * how often it was opened, and the total time and lua memory that took.
+ *
+ * Python signature: library_stats()
+ */
+PyObject *luabox_library_stats(Sandbox *self) {
+	PyObject *rval, *stats;
+	int i;
+
+	if (! (rval = PyDict_New())) return NULL;
+
+	for (i = 0; i < LUABOX_NUM_LIBRARIES; ++i) {
+		if (! (self->libraries & (1u << i))) continue;
+
+		stats = Py_BuildValue("{s:k,s:d,s:n}",
+			"opened", (unsigned long) self->libstats[i].opened,
+			"time", self->libstats[i].time,
+			"memory", (Py_ssize_t) self->libstats[i].memory);
+		if (! stats || -1 == PyDict_SetItemString(rval, luabox_libraries[i].name, stats)) {
+			Py_XDECREF(stats);
+			Py_DECREF(rval);
+			return NULL;
+		}
+		Py_DECREF(stats);
+	}
+
+	return rval;
+}
@@ -0,0 +1,243 @@
+/**
+ * Streaming chunk loader.
+ *
+ * Sandbox.load() passes source code to lua_load piece by piece through a
+ * reader callback, so a script never has to exist as one Python string.
+ * Sources are read from
+ *  - buffers supporting the new buffer protocol (str, bytearray, ...),
+ *    passed to lua in place while the buffer is held,
+ *  - other buffers (mmap, array.array, ...), copied LOADER_CHUNK_SIZE
+ *    bytes at a time, as nothing keeps them from being resized or closed,
+ *  - file-like objects, read LOADER_CHUNK_SIZE bytes at a time,
+ *  - iterables of strings, e.g. a streamed request body.
+ *
+ * lua_load runs without the GIL. The reader takes the GIL only while it
+ * fetches the next piece from an old-style buffer, a file or an iterable.
+ * Every piece is a str, copied if necessary, and the reader keeps a
+ * reference to it until lua asks for the next one. Python exceptions
+ * raised by the source end the chunk early; lua_load's result is then
+ * discarded and the exception is passed on. The parser allocates through
+ * the sandbox allocator, so the memory limit applies while loading.
+ */
+#include "luaboxmodule.h"
+
+/* bytes requested per read() call, or copied from an old-style buffer */
+#define LOADER_CHUNK_SIZE 65536
+
+/* maximum length of an escaped chunk name, including the prefix */
+#define LOADER_NAME_SIZE 256
+
+typedef struct {
+	PyObject *buffer;    /* old-style buffer source */
+	Py_ssize_t offset;   /* bytes of it handed out so far */
+	PyObject *read;      /* read method of a file-like source */
+	PyObject *iter;      /* iterator of an iterable source */
+	PyObject *piece;     /* last piece handed to lua */
+	const char *data;    /* remaining data of a buffer source */
+	size_t len;
+	int started;
+	int failed;          /* a Python exception is pending */
+	int binary;          /* source is a precompiled chunk */
+} LoadReader;
+
+/**
+ * Copies the next piece of an old-style buffer source. Its pointer is only
+ * valid while the GIL is held, so it is fetched again every time.
+ */
+static PyObject *loader_buffer_piece(LoadReader *r) {
+	const void *data;
+	Py_ssize_t len;
+
+	if (-1 == PyObject_AsReadBuffer(r->buffer, &data, &len)) return NULL;
+	if (r->offset >= len) return PyString_FromStringAndSize(NULL, 0);
+
+	len -= r->offset;
+	if (len > LOADER_CHUNK_SIZE) len = LOADER_CHUNK_SIZE;
+	r->offset += len;
+	return PyString_FromStringAndSize((const char*) data + r->offset - len, len);
+}
+
+/**
+ * Fetches the next non-empty piece of an old-style buffer, a file or an
+ * iterable. Must be called with the GIL held. Returns NULL at the end or on
+ * errors.
+ */
+static const char *loader_next_piece(LoadReader *r, size_t *size) {
+	const void *data;
+	Py_ssize_t len;
+	PyObject *copy;
+
+	Py_CLEAR(r->piece);
+
+	for (;;) {
+		if (r->buffer) r->piece = loader_buffer_piece(r);
+		else if (r->read) r->piece = PyObject_CallFunction(r->read, "n", (Py_ssize_t) LOADER_CHUNK_SIZE);
+		else r->piece = PyIter_Next(r->iter);
+
+		if (! r->piece) {
+			if (PyErr_Occurred()) r->failed = 1;
+			return NULL;
+		}
+
+		if (PyUnicode_Check(r->piece)) {
+			PyErr_SetString(PyExc_TypeError, "Source must be read as str, not unicode.");
+			r->failed = 1;
+			return NULL;
+		}
+		if (-1 == PyObject_AsReadBuffer(r->piece, &data, &len)) {
+			r->failed = 1;
+			return NULL;
+		}
+
+		/* only a str stays unchanged once the GIL is released */
+		if (len && ! PyString_Check(r->piece)) {
+			if (! (copy = PyString_FromStringAndSize((const char*) data, len))) {
+				r->failed = 1;
+				return NULL;
+			}
+			Py_DECREF(r->piece);
+			r->piece = copy;
+			data = PyString_AS_STRING(copy);
+		}
+
+		if (len) {
+			*size = (size_t) len;
+			return (const char*) data;
+		}
+
+		/* an empty read is the end of a buffer or file, iterables may skip */
+		if (r->buffer || r->read) return NULL;
+		Py_CLEAR(r->piece);
+	}
+}
+
+/**
+ * lua_Reader handing out the pieces of a source.
+ */
+static const char *loader_read(lua_State *L, void *ud, size_t *size) {
+	LoadReader *r = (LoadReader*) ud;
+	PyGILState_STATE gil;
+	const char *data;
+
+	*size = 0;
+	if (r->failed || r->binary) return NULL;
+
+	if (r->buffer || r->read || r->iter) {
+		gil = PyGILState_Ensure();
+		data = loader_next_piece(r, size);
+		PyGILState_Release(gil);
+	} else {
+		data = r->data;
+		*size = r->len;
+		r->data = NULL;
+		r->len = 0;
+	}
+
+	if (! data || ! *size) return NULL;
+
+	/* lua does not verify bytecode */
+	if (! r->started) {
+		r->started = 1;
+		if (LUA_SIGNATURE[0] == data[0]) {
+			r->binary = 1;
+			*size = 0;
+			return NULL;
+		}
+	}
+
+	return data;
+}
+
+/**
+ * Writes the chunk name for `name` to `out`, prefixed with '=' so lua
+ * shows it as is. Bytes that are not printable, including NULs, are
+ * escaped as \ddd, so any string can be used as a name.
+ */
+static void loader_chunkname(const char *name, Py_ssize_t len, char *out) {
+	Py_ssize_t i;
+	size_t n = 0;
+	unsigned char c;
+
+	out[n++] = '=';
+	for (i = 0; i < len; ++i) {
+		c = (unsigned char) name[i];
+		if (c >= 0x20 && c < 0x7f && '\\' != c) {
+			if (n + 1 >= LOADER_NAME_SIZE) break;
+			out[n++] = (char) c;
+		} else {
+			if (n + 4 >= LOADER_NAME_SIZE) break;
+			PyOS_snprintf(out + n, 5, "\\%03d", c);
+			n += 4;
+		}
+	}
+	out[n] = '\0';
+}
+
+/**
+ * Load a chunk from `source` and push it as a function. The caller must
+ * hold the sandbox lock. The reader must not use the sandbox.
+ *
+ * \param name Name of the chunk in error messages, may contain any bytes.
+ *
+ * Returns the lua error status with the error message on the stack, 0 on
+ * success, or -1 with a Python exception set.
+ */
+int luabox_load(Sandbox *self, PyObject *source, const char *name, Py_ssize_t namelen) {
+	char chunkname[LOADER_NAME_SIZE];
+	LoadReader r;
+	Py_buffer view;
+	int have_view = 0, status;
+
+	r.buffer = NULL;
+	r.offset = 0;
+	r.read = NULL;
+	r.iter = NULL;
+	r.piece = NULL;
+	r.data = NULL;
+	r.len = 0;
+	r.started = 0;
+	r.failed = 0;
+	r.binary = 0;
+
+	if (PyUnicode_Check(source)) {
+		PyErr_SetString(PyExc_TypeError, "Source must be str, not unicode.");
+		return -1;
+	}
+
+	/* buffers first, mmap also has a read method */
+	if (PyObject_CheckBuffer(source)) {
+		if (-1 == PyObject_GetBuffer(source, &view, PyBUF_SIMPLE)) return -1;
+		have_view = 1;
+		r.data = (const char*) view.buf;
+		r.len = (size_t) view.len;
+	} else if (PyObject_CheckReadBuffer(source)) {
+		Py_INCREF(source);
+		r.buffer = source;
+	} else if (PyObject_HasAttrString(source, "read")) {
+		if (! (r.read = PyObject_GetAttrString(source, "read"))) return -1;
+	} else if (! (r.iter = PyObject_GetIter(source))) {
+		PyErr_SetString(PyExc_TypeError, "Source must be a buffer, a file-like object or an iterable of strings.");
+		return -1;
+	}
+
+	loader_chunkname(name, namelen, chunkname);
+
+	Py_BEGIN_ALLOW_THREADS
+	status = lua_load(self->L, loader_read, &r, chunkname);
+	Py_END_ALLOW_THREADS
+
+	Py_XDECREF(r.piece);
+	Py_XDECREF(r.buffer);
+	Py_XDECREF(r.read);
+	Py_XDECREF(r.iter);
+	if (have_view) PyBuffer_Release(&view);
+
+	if (r.failed || r.binary) {
+		/* the function or error lua_load pushed is meaningless */
+		lua_pop(self->L, 1);
+		if (r.binary) PyErr_SetString(Exc_SyntaxError, "Loading precompiled chunks is not allowed.");
+		return -1;
+	}
+
+	return status;
+}
@@ -1,18 +1,42 @@
 #include "luaboxmodule.h"
 
+#include <time.h>
+
 PyObject *Exc_LuaBoxException;
 PyObject *Exc_OutOfMemory;
 PyObject *Exc_SyntaxError;
 PyObject *Exc_RuntimeError;
 PyObject *Exc_ErrorError;
+PyObject *Exc_CPULimitExceeded;
+PyObject *Exc_Timeout;
+PyObject *Exc_WorkerDied;
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+double luabox_monotonic(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* module-level functions */
+static PyMethodDef luabox_methods[] = {
+	{"bytecode_cache_stats", SUPPRESS_PYMCFUNCTION_WARNINGS bytecache_stats, METH_NOARGS, "return hit/miss/eviction counters of the bytecode cache"},
+	{"set_bytecode_cache_size", SUPPRESS_PYMCFUNCTION_WARNINGS bytecache_set_size, METH_KEYWORDS, "set maximum bytecode cache size in bytes, 0 disables the cache"},
+	{NULL}
+};
 
 /* module initialization */
 PyMODINIT_FUNC initluabox(void) {
 	PyObject *m;
 
-	m = Py_InitModule("luabox", NULL);
+	m = Py_InitModule("luabox", luabox_methods);
 	if (m == NULL) return;
 
+	/* sandboxes release the GIL while running lua code */
+	PyEval_InitThreads();
+
 	/* set up exception types */
 	Exc_LuaBoxException = PyErr_NewException("luabox.LuaBoxException", NULL, NULL);
 	Py_XINCREF(Exc_LuaBoxException);
@@ -34,13 +58,44 @@ PyMODINIT_FUNC initluabox(void) {
 	Py_XINCREF(Exc_ErrorError);
 	PyModule_AddObject(m, "ErrorError", Exc_ErrorError);
 
+	Exc_CPULimitExceeded = PyErr_NewException("luabox.CPULimitExceeded", Exc_LuaBoxException, NULL);
+	Py_XINCREF(Exc_CPULimitExceeded);
+	PyModule_AddObject(m, "CPULimitExceeded", Exc_CPULimitExceeded);
+
+	Exc_Timeout = PyErr_NewException("luabox.Timeout", Exc_LuaBoxException, NULL);
+	Py_XINCREF(Exc_Timeout);
+	PyModule_AddObject(m, "Timeout", Exc_Timeout);
+
+	Exc_WorkerDied = PyErr_NewException("luabox.WorkerDied", Exc_LuaBoxException, NULL);
+	Py_XINCREF(Exc_WorkerDied);
+	PyModule_AddObject(m, "WorkerDied", Exc_WorkerDied);
+
 	SandboxType_INIT(&SandboxType);
 	LuaTableRefType_INIT(&LuaTableRefType);
+	LuaTableIterType_INIT(&LuaTableIterType);
+	LuaStringType_INIT(&LuaStringType);
+	NumberBufferType_INIT(&NumberBufferType);
+	SandboxPoolType_INIT(&SandboxPoolType);
+	ProcessPoolType_INIT(&ProcessPoolType);
+	CoroutineType_INIT(&CoroutineType);
+	SchedulerType_INIT(&SchedulerType);
 
 	Py_XINCREF(&SandboxType);
 	Py_XINCREF(&LuaTableRefType);
+	Py_XINCREF(&SandboxPoolType);
+	Py_XINCREF(&LuaStringType);
+	Py_XINCREF(&NumberBufferType);
+	Py_XINCREF(&ProcessPoolType);
+	Py_XINCREF(&CoroutineType);
+	Py_XINCREF(&SchedulerType);
 	PyModule_AddObject(m, "Sandbox", (PyObject*) &SandboxType);
 	PyModule_AddObject(m, "LuaTableRef", (PyObject*) &LuaTableRefType);
+	PyModule_AddObject(m, "SandboxPool", (PyObject*) &SandboxPoolType);
+	PyModule_AddObject(m, "LuaString", (PyObject*) &LuaStringType);
+	PyModule_AddObject(m, "NumberBuffer", (PyObject*) &NumberBufferType);
+	PyModule_AddObject(m, "ProcessPool", (PyObject*) &ProcessPoolType);
+	PyModule_AddObject(m, "Coroutine", (PyObject*) &CoroutineType);
+	PyModule_AddObject(m, "Scheduler", (PyObject*) &SchedulerType);
 
 	/* add some constants */
 	PyModule_AddIntConstant(m, "LUA_MULTRET", LUA_MULTRET);
@@ -3,6 +3,7 @@
 
 #include <Python.h>
 #include <structmember.h>
+#include <pythread.h>
 
 /* lua headers */
 #include <lua.h>
@@ -22,35 +23,309 @@ extern PyObject *Exc_OutOfMemory;
 extern PyObject *Exc_SyntaxError;
 extern PyObject *Exc_RuntimeError;
 extern PyObject *Exc_ErrorError;
+extern PyObject *Exc_CPULimitExceeded;
+extern PyObject *Exc_Timeout;
+extern PyObject *Exc_WorkerDied;
+
+/* from mempool.c */
+#define MEMPOOL_NUM_CLASSES 12
+#define MEMPOOL_MAX_SMALL 256
+#define MEMPOOL_SLAB_SIZE 16384
+
+typedef struct {
+	void *free[MEMPOOL_NUM_CLASSES];
+	void *slabs;
+	void *large;
+} MemPool;
 
 /* from sandbox.c */
+
+/* Allocation sizes are counted in power-of-two buckets, starting at
+ * <= 16 bytes. The last bucket holds everything larger. */
+#define MEMSTATS_BUCKETS 16
+
+typedef struct {
+	size_t peak;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long reallocs;
+	unsigned long denied;
+	unsigned long gc_cycles;
+	unsigned long emergency_gcs;
+	unsigned long histogram[MEMSTATS_BUCKETS];
+} MemStats;
+
+/* from library.c */
+#define LUABOX_NUM_LIBRARIES 6
+
+typedef struct {
+	unsigned long opened;
+	double time;
+	size_t memory;
+} LibraryStats;
+
+/* from profiler.c */
+typedef struct Profiler Profiler;
+
 typedef struct {
 	PyObject_HEAD
 	size_t lua_max_mem;
 	size_t lua_current_mem;
 	lua_State *L;
 	char *lua_error_msg;
+	MemPool *pool;
+	int closing;
+	unsigned long cpu_limit;
+	int cpu_granularity;
+	unsigned long instructions;
+	int cpu_exceeded;
+	int hook_count;
+	double deadline;
+	double last_check;
+	size_t alloc_since_check;
+	int timed_out;
+	int pcall_depth;
+	PyObject *callbacks;
+	unsigned long callback_cost;
+	PyObject *coroutine;
+	PyObject *template;
+	int frozen;
+	PyThread_type_lock lock;
+	long lock_owner;
+	int lock_depth;
+	int snapshot_ref;
+	int nrefs;
+	Py_ssize_t string_buffer_threshold;
+	int lossy_integers;
+	unsigned int libraries;
+	LibraryStats libstats[LUABOX_NUM_LIBRARIES];
+	Profiler *profiler;
+	int profiling;
+	int gcpause;
+	int gcstepmul;
+	int emergency_gc;
+	int gc_pending;
+	size_t gc_threshold;
+	PyObject *tablerefs;
+	MemStats memstats;
 } Sandbox;
 
 typedef struct {
 	PyObject_HEAD
 	Sandbox *sandbox;
 	int ref;
+	PyObject *cache_key;
 } LuaTableRef;
 
+typedef struct {
+	PyObject_HEAD
+	Sandbox *sandbox;
+	int ref;
+	const char *data;
+	size_t len;
+} LuaString;
+
+typedef struct {
+	PyObject_HEAD
+	char *data;
+	Py_ssize_t n;
+	Py_ssize_t itemsize;
+	char format[2];
+} NumberBuffer;
+
+#define LUATABLEITER_KEYS 0
+#define LUATABLEITER_VALUES 1
+#define LUATABLEITER_ITEMS 2
+
+typedef struct {
+	PyObject_HEAD
+	LuaTableRef *table;
+	lua_State *T;
+	int thread_ref;
+	int mode;
+} LuaTableIter;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *idle;
+	PyObject *sandbox_kwds;
+	Py_ssize_t size;
+	unsigned long created;
+	unsigned long acquired;
+	unsigned long reused;
+	unsigned long discarded;
+	unsigned long resets;
+	double reset_time;
+} SandboxPool;
+
+#define COROUTINE_SUSPENDED 0
+#define COROUTINE_PREEMPTED 1
+#define COROUTINE_DEAD 2
+
+typedef struct {
+	PyObject_HEAD
+	Sandbox *sandbox;
+	lua_State *T;
+	int ref;
+	int status;
+	int hook_count;
+	unsigned long slice;
+	unsigned long used;
+	unsigned long instructions;
+} Coroutine;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *ready;
+	PyObject *on_yield;
+	PyObject *on_done;
+	unsigned long slice;
+} Scheduler;
+
+typedef struct {
+	pid_t pid;
+	int rfd;
+	int wfd;
+	PyThread_type_lock lock;
+} PoolWorker;
+
+typedef struct {
+	PyObject_HEAD
+	Sandbox *sandbox;
+	PoolWorker *workers;
+	int nworkers;
+	unsigned int next;
+	unsigned long spawned;
+	unsigned long requests;
+	unsigned long deaths;
+} ProcessPool;
+
 extern PyTypeObject SandboxType;
 extern PyTypeObject LuaTableRefType;
+extern PyTypeObject LuaTableIterType;
+extern PyTypeObject LuaStringType;
+extern PyTypeObject NumberBufferType;
+extern PyTypeObject SandboxPoolType;
+extern PyTypeObject ProcessPoolType;
+extern PyTypeObject CoroutineType;
+extern PyTypeObject SchedulerType;
+
+/* from luaboxmodule.c */
+double luabox_monotonic(void);
 
 /* from sandbox.c */
 void SandboxType_INIT(PyTypeObject *t);
-PyObject* Sandbox_pop(Sandbox *self, PyObject *args);
+void lua_sandbox_hook(lua_State *L, lua_Debug *ar);
+void lua_sandbox_limit_error(lua_State *L, Sandbox *box);
+int luabox_pcall(Sandbox *self, int nargs, int nresults, int errfunc, double timeout);
+void Sandbox_lock(Sandbox *self);
+void Sandbox_unlock(Sandbox *self);
+PyObject *luabox_pop_from(Sandbox *self, lua_State *L);
+PyObject *luabox_pop(Sandbox *self);
+
+/* from mempool.c */
+void mempool_init(MemPool *pool);
+void *mempool_realloc(MemPool *pool, void *ptr, size_t osize, size_t nsize);
+void mempool_destroy(MemPool *pool);
+
+/* from bytecache.c */
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t alloc;
+} ByteCode;
+
+int bytecache_enabled(void);
+int bytecode_writer(lua_State *L, const void *p, size_t sz, void *ud);
+void *bytecache_lookup(const char *source, size_t len, const ByteCode **code);
+void bytecache_release(void *handle);
+void bytecache_insert(const char *source, size_t len, ByteCode *code);
+PyObject *bytecache_stats(PyObject *self, PyObject *args);
+PyObject *bytecache_set_size(PyObject *self, PyObject *args, PyObject *kwds);
+
+/* from pack.c */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t alloc;
+} PackBuffer;
+
+int pack_reserve(PackBuffer *b, size_t n);
+void pack_free(PackBuffer *b);
+int pack_int(PackBuffer *b, long long v);
+int pack_double(PackBuffer *b, double d);
+int pack_bin(PackBuffer *b, const char *data, size_t n);
+int pack_array_header(PackBuffer *b, size_t n);
+int pack_map_header(PackBuffer *b, size_t n);
+int pack_value(PackBuffer *b, PyObject *obj);
+PyObject *unpack_value(const char *data, size_t len);
+int pack_lua_value(PackBuffer *b, lua_State *L, int index, int max_depth, size_t max_size);
+int luabox_unpack_value(Sandbox *self, const char *data, size_t len);
+
+/* from processpool.c */
+void ProcessPoolType_INIT(PyTypeObject *t);
+
+/* from coroutine.c */
+PyObject *Coroutine_from_stack(Sandbox *sandbox);
+int luabox_register_async(Sandbox *self, const char *name);
+void CoroutineType_INIT(PyTypeObject *t);
+void SchedulerType_INIT(PyTypeObject *t);
+
+/* from library.c */
+int luabox_open_libraries(Sandbox *self, PyObject *names);
+PyObject *luabox_library_stats(Sandbox *self);
+
+/* from profiler.c */
+void profiler_sample(Profiler *p, lua_State *L, int weight);
+int profiler_begin(Profiler *p);
+int profiler_interval(Profiler *p);
+void profiler_free(Profiler *p);
+int luabox_profiler_start(Sandbox *self, int interval, double rate, int max_depth);
+void luabox_profiler_stop(Sandbox *self);
+PyObject *luabox_profiler_stats(Sandbox *self);
+PyObject *luabox_profiler_folded(Sandbox *self);
+
+/* from loader.c */
+int luabox_load(Sandbox *self, PyObject *source, const char *name, Py_ssize_t namelen);
+
+/* from callback.c */
+int luabox_register(Sandbox *self, const char *name, PyObject *callable);
+
+/* from template.c */
+int luabox_template_attach(Sandbox *child, Sandbox *template);
+
+/* from snapshot.c */
+int luabox_snapshot(Sandbox *self);
+int luabox_restore(Sandbox *self);
+
+/* from sandboxpool.c */
+void SandboxPoolType_INIT(PyTypeObject *t);
 
 /* from types.c */
+#define LUABOX_MAX_DEPTH 100
+
 PyObject *lua_to_python(lua_State *L);
+PyObject *lua_to_python_deep(lua_State *L, int max_depth);
 int python_to_lua(lua_State *L, PyObject *obj);
+int python_to_lua_unprotected(lua_State *L, PyObject *obj, PyObject *seen);
 
 /* from luatableref.c */
-PyObject *LuaTableRef_from_stack(Sandbox *sandbox);
+PyObject *LuaTableRef_from_stack(Sandbox *sandbox, lua_State *L);
 void LuaTableRefType_INIT(PyTypeObject *t);
 
+/* from luastring.c */
+PyObject *LuaString_from_stack(Sandbox *sandbox, lua_State *L);
+void LuaStringType_INIT(PyTypeObject *t);
+
+/* from numberbuffer.c */
+Py_ssize_t numberbuffer_itemsize(char format);
+char numberbuffer_format(const char *format);
+PyObject *NumberBuffer_from_table(lua_State *L, int index, char format);
+int luabox_push_array(Sandbox *self, const char *data, Py_ssize_t n, char format);
+void NumberBufferType_INIT(PyTypeObject *t);
+
+/* from luatableiter.c */
+PyObject *LuaTableIter_new(LuaTableRef *table, int mode);
+void LuaTableIterType_INIT(PyTypeObject *t);
+
 #endif /* LUABOXMODULE_H */
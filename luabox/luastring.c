@@ -0,0 +1,133 @@
+/**
+ * Read-only buffer exposing a lua string without copying it.
+ *
+ * The string is kept alive by a registry reference. Lua does not move
+ * objects in memory, so the data pointer stays valid for the lifetime of
+ * the LuaString. Both the old and the new buffer protocol are supported,
+ * so LuaStrings can be passed to buffer(), memoryview() and anything else
+ * that accepts a read-only buffer.
+ */
+#include "luaboxmodule.h"
+
+static PyBufferProcs LuaString_as_buffer;
+static PySequenceMethods LuaString_sequence;
+
+PyTypeObject LuaStringType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.LuaString",                 /*tp_name*/
+	sizeof(LuaString)                   /*tp_basicsize*/
+};
+
+static void LuaString_dealloc(LuaString *self) {
+	if (LUA_NOREF != self->ref) {
+		Sandbox_lock(self->sandbox);
+		luaL_unref(self->sandbox->L, LUA_REGISTRYINDEX, self->ref);
+		--self->sandbox->nrefs;
+		Sandbox_unlock(self->sandbox);
+	}
+	Py_DECREF(self->sandbox);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/**
+ * Returns a copy of the string.
+ */
+static PyObject* LuaString_str(PyObject *self) {
+	LuaString *ls = (LuaString*) self;
+	return PyString_FromStringAndSize(ls->data, ls->len);
+}
+
+static Py_ssize_t LuaString_length(PyObject *self) {
+	return ((LuaString*) self)->len;
+}
+
+static Py_ssize_t LuaString_getreadbuffer(PyObject *self, Py_ssize_t segment, void **ptr) {
+	LuaString *ls = (LuaString*) self;
+
+	if (0 != segment) {
+		PyErr_SetString(PyExc_SystemError, "Accessing non-existent LuaString segment.");
+		return -1;
+	}
+
+	*ptr = (void*) ls->data;
+	return ls->len;
+}
+
+static Py_ssize_t LuaString_getsegcount(PyObject *self, Py_ssize_t *lenp) {
+	if (lenp) *lenp = ((LuaString*) self)->len;
+	return 1;
+}
+
+static int LuaString_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+	LuaString *ls = (LuaString*) self;
+	return PyBuffer_FillInfo(view, self, (void*) ls->data, ls->len, 1, flags);
+}
+
+void LuaStringType_INIT(PyTypeObject *t) {
+	t->tp_new = 0; // created from the lua stack only
+	t->tp_dealloc = (destructor)LuaString_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+	t->tp_doc = "Read-only buffer referencing a string inside a lua sandbox.";
+	t->tp_str = LuaString_str;
+
+	t->tp_as_sequence = &LuaString_sequence;
+	LuaString_sequence.sq_length = LuaString_length;
+
+	t->tp_as_buffer = &LuaString_as_buffer;
+	LuaString_as_buffer.bf_getreadbuffer = LuaString_getreadbuffer;
+	LuaString_as_buffer.bf_getsegcount = LuaString_getsegcount;
+	LuaString_as_buffer.bf_getcharbuffer = (charbufferproc) LuaString_getreadbuffer;
+	LuaString_as_buffer.bf_getbuffer = LuaString_getbuffer;
+
+	if(PyType_Ready(t) < 0) return;
+}
+
+/**
+ * lua_CFunction reserving a registry reference, holding a placeholder, and
+ * storing it in the int passed as a light userdata.
+ */
+static int luastring_reserve_ref(lua_State *L) {
+	int *ref = (int*) lua_touserdata(L, 1);
+
+	lua_pushboolean(L, 1);
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+/**
+ * Creates a LuaString from the string on top of the stack of `L` (a thread
+ * of the sandbox), which is popped. The caller must hold the sandbox lock.
+ *
+ * luaL_ref may allocate, so the reference is reserved in protected mode,
+ * and the string then stored in its slot, which does not allocate. On
+ * errors, the string stays on the stack.
+ */
+PyObject *LuaString_from_stack(Sandbox *sandbox, lua_State *L) {
+	LuaString *ls;
+	int ref, status;
+
+	if ((status = lua_cpcall(sandbox->L, luastring_reserve_ref, &ref))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(sandbox->L, -1));
+		lua_pop(sandbox->L, 1);
+		return NULL;
+	}
+
+	if (! (ls = PyObject_New(LuaString, &LuaStringType))) {
+		luaL_unref(sandbox->L, LUA_REGISTRYINDEX, ref);
+		return NULL;
+	}
+
+	/* hold a reference to the sandbox */
+	Py_INCREF(sandbox);
+	ls->sandbox = sandbox;
+
+	ls->data = lua_tolstring(L, -1, &ls->len);
+	ls->ref = ref;
+	lua_rawseti(L, LUA_REGISTRYINDEX, ref);
+
+	/* keep track of refs, so the sandbox is not reset while in use */
+	++sandbox->nrefs;
+
+	return (PyObject*) ls;
+}
@@ -0,0 +1,176 @@
+/**
+ * Iterator over the contents of a lua table.
+ *
+ * Every iterator owns a lua thread whose stack holds the state of the
+ * traversal: a step function, the table and the last key returned. Each
+ * step calls lua_next in protected mode on that stack, so neither the
+ * table nor the key have to be fetched from the registry again, and a
+ * table that is modified during iteration results in an exception
+ * instead of a lua panic.
+ *
+ * Keys and values are converted lazily, one pair per step.
+ */
+#include "luaboxmodule.h"
+
+/* slots on the iterator thread's stack */
+#define ITER_STEP 1
+#define ITER_TABLE 2
+#define ITER_KEY 3
+
+PyTypeObject LuaTableIterType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.LuaTableIter",              /*tp_name*/
+	sizeof(LuaTableIter)                /*tp_basicsize*/
+};
+
+/**
+ * lua_CFunction advancing the traversal. Returns the next key and value,
+ * or nothing once the table is exhausted.
+ */
+static int LuaTableIter_step(lua_State *L) {
+	if (lua_next(L, 1)) return 2;
+	return 0;
+}
+
+static void LuaTableIter_dealloc(LuaTableIter *self) {
+	if (LUA_NOREF != self->thread_ref) {
+		Sandbox_lock(self->table->sandbox);
+		luaL_unref(self->table->sandbox->L, LUA_REGISTRYINDEX, self->thread_ref);
+		Sandbox_unlock(self->table->sandbox);
+	}
+	Py_DECREF(self->table);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/**
+ * Converts the value on top of the iterator stack and pops it.
+ */
+static PyObject *LuaTableIter_pop(LuaTableIter *self) {
+	return luabox_pop_from(self->table->sandbox, self->T);
+}
+
+static PyObject *LuaTableIter_next(LuaTableIter *self) {
+	lua_State *T = self->T;
+	PyObject *k = NULL, *v = NULL, *rval = NULL;
+	int status;
+
+	if (! T) return NULL;
+
+	Sandbox_lock(self->table->sandbox);
+
+	lua_pushvalue(T, ITER_STEP);
+	lua_pushvalue(T, ITER_TABLE);
+	lua_pushvalue(T, ITER_KEY);
+	if ((status = lua_pcall(T, 2, 2, 0))) {
+		PyErr_Format(Exc_RuntimeError, "Lua table changed during iteration: %s", lua_tostring(T, -1));
+		lua_pop(T, 1);
+		self->T = NULL;
+		goto out;
+	}
+
+	if (lua_isnil(T, -2)) {
+		/* exhausted, StopIteration */
+		lua_pop(T, 2);
+		self->T = NULL;
+		goto out;
+	}
+
+	/* remember key for next step */
+	lua_pushvalue(T, -2);
+	lua_replace(T, ITER_KEY);
+
+	switch (self->mode) {
+		case LUATABLEITER_KEYS:
+			lua_pop(T, 1);
+			rval = LuaTableIter_pop(self);
+			break;
+
+		case LUATABLEITER_VALUES:
+			rval = LuaTableIter_pop(self);
+			lua_pop(T, 1);
+			break;
+
+		default:
+			v = LuaTableIter_pop(self);
+			if (! v) {
+				lua_pop(T, 1);
+				break;
+			}
+			if ((k = LuaTableIter_pop(self))) rval = PyTuple_Pack(2, k, v);
+			Py_XDECREF(k);
+			Py_DECREF(v);
+	}
+
+out:
+	/* conversions that failed leave their value behind */
+	lua_settop(T, ITER_KEY);
+	Sandbox_unlock(self->table->sandbox);
+	return rval;
+}
+
+void LuaTableIterType_INIT(PyTypeObject *t) {
+	t->tp_new = 0; // created by LuaTableRef only
+	t->tp_dealloc = (destructor)LuaTableIter_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT;
+	t->tp_doc = "Iterator over a lua table.";
+	t->tp_iter = PyObject_SelfIter;
+	t->tp_iternext = (iternextfunc)LuaTableIter_next;
+
+	if(PyType_Ready(t) < 0) return;
+}
+
+/**
+ * lua_CFunction creating the thread of the iterator passed as a light
+ * userdata, with the initial state of the traversal. The values are
+ * pushed onto L and moved, as an allocation failing in T would not be
+ * caught.
+ */
+static int LuaTableIter_init(lua_State *L) {
+	LuaTableIter *self = (LuaTableIter*) lua_touserdata(L, 1);
+	lua_State *T = lua_newthread(L);
+
+	/* the step function runs no lua code, it needs no hook */
+	lua_sethook(T, NULL, 0, 0);
+	lua_pushcfunction(L, LuaTableIter_step);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->table->ref);
+	lua_pushnil(L);
+	lua_xmove(L, T, 3);
+
+	self->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	self->T = T;
+	return 0;
+}
+
+/**
+ * Create a new iterator over a table.
+ *
+ * \param mode One of LUATABLEITER_KEYS, LUATABLEITER_VALUES or
+ *             LUATABLEITER_ITEMS.
+ */
+PyObject *LuaTableIter_new(LuaTableRef *table, int mode) {
+	LuaTableIter *self = PyObject_New(LuaTableIter, &LuaTableIterType);
+	lua_State *L = table->sandbox->L;
+	int status;
+
+	if (! self) return NULL;
+
+	Py_INCREF(table);
+	self->table = table;
+	self->mode = mode;
+	self->T = NULL;
+	self->thread_ref = LUA_NOREF;
+
+	Sandbox_lock(table->sandbox);
+	if ((status = lua_cpcall(L, LuaTableIter_init, self))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	Sandbox_unlock(table->sandbox);
+
+	if (status) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject*) self;
+}
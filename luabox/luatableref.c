@@ -8,6 +8,12 @@ PyMappingMethods LuaTableRef_mapping = {
 	/* methods assigned in LuaTableRefType_INIT */
 };
 
+PySequenceMethods LuaTableRef_sequence = {
+	0                                   /* sq_length */
+
+	/* sq_contains assigned in LuaTableRefType_INIT */
+};
+
 PyTypeObject LuaTableRefType = {
 	PyObject_HEAD_INIT(NULL)
 	0,                                  /*ob_size*/
@@ -15,10 +21,40 @@ PyTypeObject LuaTableRefType = {
 	sizeof(LuaTableRef)                    /*tp_basicsize*/
 };
 
+/* Arguments for luatableref_get_protected, passed through lua_cpcall. */
+typedef struct {
+	LuaTableRef *ltr;
+	PyObject *key;
+	PyObject *seen;
+	PyObject *result;
+} TableGetArgs;
+
+/* Arguments for luatableref_set_protected, passed through lua_cpcall. */
+typedef struct {
+	int ref;
+	PyObject *key;      /* single key to set, or NULL */
+	PyObject *value;    /* its value, NULL to delete it */
+	PyObject *items;    /* dict of items to set, if key is NULL */
+	PyObject *seen;
+	int ok;
+} TableSetArgs;
+
 static void LuaTableRef_dealloc(LuaTableRef *self) {
+	if (self->cache_key) {
+		PyObject *type, *value, *traceback;
+
+		/* may be called while an exception is set */
+		PyErr_Fetch(&type, &value, &traceback);
+		if (-1 == PyDict_DelItem(self->sandbox->tablerefs, self->cache_key)) PyErr_Clear();
+		PyErr_Restore(type, value, traceback);
+		Py_DECREF(self->cache_key);
+	}
 	if (-1 != self->ref) {
 		/* free lua ref */
+		Sandbox_lock(self->sandbox);
 		luaL_unref(self->sandbox->L, LUA_REGISTRYINDEX, self->ref);
+		--self->sandbox->nrefs;
+		Sandbox_unlock(self->sandbox);
 	}
 	Py_DECREF(self->sandbox);
 	self->ob_type->tp_free((PyObject*)self);
@@ -27,6 +63,8 @@ static void LuaTableRef_dealloc(LuaTableRef *self) {
 static Py_ssize_t LuaTableRef_length(PyObject *self) {
 	LuaTableRef *ltr = (LuaTableRef*) self;
 
+	Sandbox_lock(ltr->sandbox);
+
 	/* push table onto stack */
 	lua_rawgeti(ltr->sandbox->L, LUA_REGISTRYINDEX, ltr->ref);
 
@@ -36,6 +74,8 @@ static Py_ssize_t LuaTableRef_length(PyObject *self) {
 	/* pop table from stack */
 	lua_pop(ltr->sandbox->L, 1);
 
+	Sandbox_unlock(ltr->sandbox);
+
 	return (Py_ssize_t) len;
 }
 
@@ -44,32 +84,324 @@ static PyObject* LuaTableRef_str(PyObject *self) {
 	return PyString_FromFormat("<LuaTableRef ref:%d>", ltr->ref);
 }
 
+/**
+ * lua_CFunction indexing the table with the key, invoking __index.
+ */
+static int luatableref_index(lua_State *L) {
+	lua_gettable(L, 1);
+	return 1;
+}
+
+/**
+ * lua_CFunction reading the key of a TableGetArgs. An __index metamethod
+ * is lua code, so the lookup runs like pcall(), under the sandbox's cpu
+ * limit. Sets `result`, or leaves it NULL with a Python exception set.
+ */
+static int luatableref_get_protected(lua_State *L) {
+	TableGetArgs *args = (TableGetArgs*) lua_touserdata(L, 1);
+	Sandbox *box = args->ltr->sandbox;
+
+	lua_pushcfunction(L, luatableref_index);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, args->ltr->ref);
+	if (! python_to_lua_unprotected(L, args->key, args->seen)) return 0;
+
+	if (box->frozen) {
+		/* frozen sandboxes run no lua code */
+		lua_rawget(L, -2);
+	} else if (luabox_pcall(box, 2, 1, 0, 0)) {
+		return 0;
+	}
+
+	args->result = luabox_pop(box);
+	return 0;
+}
+
+/**
+ * Look up a key. Invokes __index, which is run like pcall() does; in a
+ * frozen sandbox, metamethods are not invoked.
+ *
+ * Python signature: tbl[key]
+ */
 static PyObject* LuaTableRef_subscript(PyObject *self, PyObject *key) {
 	LuaTableRef* ltr = (LuaTableRef*) self;
+	lua_State *L = ltr->sandbox->L;
+	TableGetArgs args;
+	int status;
+
+	args.ltr = ltr;
+	args.key = key;
+	args.result = NULL;
+	if (! (args.seen = PySet_New(NULL))) return NULL;
+
+	Sandbox_lock(ltr->sandbox);
+	if ((status = lua_cpcall(L, luatableref_get_protected, &args))) {
+		Py_CLEAR(args.result);
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	Sandbox_unlock(ltr->sandbox);
+
+	Py_DECREF(args.seen);
+	return args.result;
+}
+
+/**
+ * Sets t[key] = value on the table at `t`. A NULL value deletes the key.
+ * Lua errors are not caught, so this must run in protected mode.
+ *
+ * Returns 1 on success, 0 with a Python exception set.
+ */
+static int luatableref_rawset(lua_State *L, int t, PyObject *key, PyObject *value, PyObject *seen) {
+	lua_Number k;
+
+	if (! python_to_lua_unprotected(L, key, seen)) return 0;
+
+	k = LUA_TNUMBER == lua_type(L, -1) ? lua_tonumber(L, -1) : 0;
+	if (lua_isnil(L, -1) || k != k) {
+		lua_pop(L, 1);
+		PyErr_SetString(PyExc_ValueError, "None and NaN cannot be used as lua table keys.");
+		return 0;
+	}
+
+	if (! value) lua_pushnil(L);
+	else if (! python_to_lua_unprotected(L, value, seen)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	lua_rawset(L, t);
+	return 1;
+}
+
+/**
+ * lua_CFunction setting the key or items of a TableSetArgs.
+ */
+static int luatableref_set_protected(lua_State *L) {
+	TableSetArgs *args = (TableSetArgs*) lua_touserdata(L, 1);
+	PyObject *key, *value;
+	Py_ssize_t i = 0;
+	int t;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, args->ref);
+	t = lua_gettop(L);
+
+	if (args->key) {
+		args->ok = luatableref_rawset(L, t, args->key, args->value, args->seen);
+		return 0;
+	}
+
+	while (PyDict_Next(args->items, &i, &key, &value)) {
+		if (! luatableref_rawset(L, t, key, value, args->seen)) return 0;
+	}
+	args->ok = 1;
+
+	return 0;
+}
+
+/**
+ * Sets `key` to `value` (deleting it if NULL), or all `items` of a dict,
+ * in one protected call. Tables are allocated by lua, so the memory limit
+ * applies. Does not invoke metamethods.
+ *
+ * Returns 0 on success, -1 with a Python exception set.
+ */
+static int luatableref_set(LuaTableRef *ltr, PyObject *key, PyObject *value, PyObject *items) {
+	lua_State *L = ltr->sandbox->L;
+	TableSetArgs args;
+	int status;
+
+	if (ltr->sandbox->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot modify tables of a frozen sandbox.");
+		return -1;
+	}
+
+	args.ref = ltr->ref;
+	args.key = key;
+	args.value = value;
+	args.items = items;
+	args.ok = 0;
+	if (! (args.seen = PySet_New(NULL))) return -1;
+
+	Sandbox_lock(ltr->sandbox);
+	if ((status = lua_cpcall(L, luatableref_set_protected, &args))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	Sandbox_unlock(ltr->sandbox);
+
+	Py_DECREF(args.seen);
+	return status || ! args.ok ? -1 : 0;
+}
+
+/**
+ * Set or delete (i.e. set to nil) a key.
+ *
+ * Unlike reads, writes do not invoke metamethods, so no lua code runs.
+ *
+ * Python signature: tbl[key] = value, del tbl[key]
+ */
+static int LuaTableRef_ass_subscript(PyObject *self, PyObject *key, PyObject *value) {
+	return luatableref_set((LuaTableRef*) self, key, value, NULL);
+}
+
+/**
+ * Set many keys in one call, like dict.update(). `other` is a mapping or
+ * an iterable of key/value pairs. If a value cannot be converted, the
+ * keys before it are set nevertheless.
+ *
+ * Python signature: update(other)
+ */
+static PyObject* LuaTableRef_update(PyObject *self, PyObject *other) {
+	PyObject *items;
+	int rval;
+
+	if (PyDict_Check(other)) {
+		Py_INCREF(other);
+		items = other;
+	} else {
+		if (! (items = PyDict_New())) return NULL;
+		if (PyObject_HasAttrString(other, "keys")) rval = PyDict_Merge(items, other, 1);
+		else rval = PyDict_MergeFromSeq2(items, other, 1);
+		if (-1 == rval) {
+			Py_DECREF(items);
+			return NULL;
+		}
+	}
+
+	rval = luatableref_set((LuaTableRef*) self, NULL, NULL, items);
+	Py_DECREF(items);
+
+	if (-1 == rval) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Check whether the table has a non-nil value for `key`.
+ *
+ * Does not invoke metamethods.
+ */
+static int LuaTableRef_contains(PyObject *self, PyObject *key) {
+	LuaTableRef* ltr = (LuaTableRef*) self;
+	int rval;
+
+	Sandbox_lock(ltr->sandbox);
+
+	lua_rawgeti(ltr->sandbox->L, LUA_REGISTRYINDEX, ltr->ref);
+	if (! python_to_lua(ltr->sandbox->L, key)) {
+		lua_pop(ltr->sandbox->L, 1);
+		Sandbox_unlock(ltr->sandbox);
+		return -1;
+	}
+
+	lua_rawget(ltr->sandbox->L, -2);
+	rval = ! lua_isnil(ltr->sandbox->L, -1);
+	lua_pop(ltr->sandbox->L, 2);
+
+	Sandbox_unlock(ltr->sandbox);
+
+	return rval;
+}
+
+/**
+ * Iterate over the keys of the table.
+ *
+ * Python signature: iter(tbl)
+ */
+static PyObject* LuaTableRef_iter(PyObject *self) {
+	return LuaTableIter_new((LuaTableRef*) self, LUATABLEITER_KEYS);
+}
+
+/**
+ * Python signature: keys()
+ */
+static PyObject* LuaTableRef_keys(PyObject *self, PyObject *args) {
+	return LuaTableIter_new((LuaTableRef*) self, LUATABLEITER_KEYS);
+}
+
+/**
+ * Python signature: values()
+ */
+static PyObject* LuaTableRef_values(PyObject *self, PyObject *args) {
+	return LuaTableIter_new((LuaTableRef*) self, LUATABLEITER_VALUES);
+}
+
+/**
+ * Python signature: items()
+ */
+static PyObject* LuaTableRef_items(PyObject *self, PyObject *args) {
+	return LuaTableIter_new((LuaTableRef*) self, LUATABLEITER_ITEMS);
+}
+
+/**
+ * Convert the whole table to python lists and dicts in one pass.
+ *
+ * \see lua_to_python_deep
+ *
+ * Python signature: to_python(max_depth=100)
+ */
+static PyObject* LuaTableRef_to_python(PyObject *self, PyObject *args, PyObject *kwds) {
+	LuaTableRef* ltr = (LuaTableRef*) self;
+	static char *kwlist[] = {"max_depth", NULL};
+	int max_depth = LUABOX_MAX_DEPTH;
+	PyObject *rval;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &max_depth)) return NULL;
+
+	Sandbox_lock(ltr->sandbox);
 
-	/* get table, push onto stack */
 	lua_rawgeti(ltr->sandbox->L, LUA_REGISTRYINDEX, ltr->ref);
+	rval = lua_to_python_deep(ltr->sandbox->L, max_depth);
+	lua_pop(ltr->sandbox->L, 1);
 
-	/* convert key to lua value, put on top of stack */
-	if (! python_to_lua(ltr->sandbox->L, key)) return NULL;
+	Sandbox_unlock(ltr->sandbox);
 
-	/* look up key on table (this will pop the key) */
-	lua_gettable(ltr->sandbox->L, -2); // -2  table,  -1  key
+	return rval;
+}
+
+/**
+ * Copy the elements 1..#t into a contiguous buffer of numbers.
+ *
+ * \param format One of the struct module codes 'd', 'f', 'i', 'l', 'q'.
+ *
+ * \see NumberBuffer_from_table
+ *
+ * Python signature: to_buffer(format='d')
+ */
+static PyObject* LuaTableRef_to_buffer(PyObject *self, PyObject *args, PyObject *kwds) {
+	LuaTableRef* ltr = (LuaTableRef*) self;
+	static char *kwlist[] = {"format", NULL};
+	const char *format = "d";
+	PyObject *rval;
+	char code;
 
-	/* convert retrieved value on top of stack to python value */
-	PyObject *rval = Sandbox_pop(ltr->sandbox, NULL);
-	if (NULL == rval) {
-		/* no pop occured, discard value and key */
-		lua_pop(ltr->sandbox->L, 2);
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|s", kwlist, &format)) return NULL;
+
+	if (! (code = numberbuffer_format(format))) {
+		PyErr_Format(PyExc_ValueError, "Unsupported buffer format '%s'.", format);
 		return NULL;
 	}
 
-	/* pop table */
+	Sandbox_lock(ltr->sandbox);
+
+	lua_rawgeti(ltr->sandbox->L, LUA_REGISTRYINDEX, ltr->ref);
+	rval = NumberBuffer_from_table(ltr->sandbox->L, lua_gettop(ltr->sandbox->L), code);
 	lua_pop(ltr->sandbox->L, 1);
 
+	Sandbox_unlock(ltr->sandbox);
+
 	return rval;
 }
 
+static PyMethodDef LuaTableRef_methods[] = {
+	{"to_python", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_to_python, METH_KEYWORDS, "convert table to nested lists and dicts"},
+	{"to_buffer", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_to_buffer, METH_KEYWORDS, "copy the array part into a buffer of numbers"},
+	{"update", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_update, METH_O, "set the keys of a mapping or iterable of pairs"},
+	{"keys", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_keys, METH_NOARGS, "iterate over keys"},
+	{"values", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_values, METH_NOARGS, "iterate over values"},
+	{"items", SUPPRESS_PYMCFUNCTION_WARNINGS LuaTableRef_items, METH_NOARGS, "iterate over (key, value) pairs"},
+	{NULL}
+};
+
 void LuaTableRefType_INIT(PyTypeObject *t) {
 	/* add sandbox type */
 	t->tp_new = 0; // disallow constructing type instances
@@ -77,29 +409,77 @@ void LuaTableRefType_INIT(PyTypeObject *t) {
 	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
 	t->tp_doc = "Reference to lua table in lua sandbox.";
 	t->tp_str = LuaTableRef_str;
+	t->tp_methods = LuaTableRef_methods;
+	t->tp_iter = LuaTableRef_iter;
 
 	t->tp_as_mapping = &LuaTableRef_mapping;
 	LuaTableRef_mapping.mp_length = LuaTableRef_length;
 	LuaTableRef_mapping.mp_subscript = LuaTableRef_subscript;
+	LuaTableRef_mapping.mp_ass_subscript = LuaTableRef_ass_subscript;
+
+	t->tp_as_sequence = &LuaTableRef_sequence;
+	LuaTableRef_sequence.sq_contains = LuaTableRef_contains;
 
 	if(PyType_Ready(t) < 0) return;
 }
 
-PyObject *LuaTableRef_from_stack(Sandbox *sandbox) {
-	LuaTableRef *ltr = PyObject_New(LuaTableRef, &LuaTableRefType);
+/**
+ * Returns a LuaTableRef for the table on top of the stack, popping it.
+ *
+ * While a LuaTableRef for the same table is alive, that one is returned,
+ * so accessing a nested table again does not create another registry
+ * reference. The sandbox's `tablerefs` dict maps the address of each
+ * referenced table to its LuaTableRef; it does not keep them alive,
+ * entries are removed on deallocation. So a temporary, as in
+ * tbl['c']['x'] with nothing else holding tbl['c'], is not helped: it
+ * still gets a new reference, plus the dict entry.
+ */
+PyObject *LuaTableRef_from_stack(Sandbox *sandbox, lua_State *L) {
+	PyObject *key, *cached;
+	LuaTableRef *ltr;
+
+	if (! sandbox->tablerefs && ! (sandbox->tablerefs = PyDict_New())) return NULL;
+	if (! (key = PyLong_FromVoidPtr((void*) lua_topointer(L, -1)))) return NULL;
+
+	if ((cached = PyDict_GetItem(sandbox->tablerefs, key))) {
+		Py_DECREF(key);
+		ltr = (LuaTableRef*) PyLong_AsVoidPtr(cached);
+		Py_INCREF(ltr);
+		lua_pop(L, 1);
+		return (PyObject*) ltr;
+	}
+
+	if (! (ltr = PyObject_New(LuaTableRef, &LuaTableRefType))) {
+		Py_DECREF(key);
+		return NULL;
+	}
 
 	/* hold a reference to the sandbox */
 	Py_INCREF(sandbox);
 	ltr->sandbox = sandbox;
+	ltr->cache_key = NULL;
 
 	/* create a reference to table, pops it from the stack */
-	ltr->ref = luaL_ref(ltr->sandbox->L, LUA_REGISTRYINDEX);
+	ltr->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
 	if (-1 == ltr->ref) {
+		Py_DECREF(key);
 		Py_DECREF(ltr);
 		PyErr_SetString(Exc_RuntimeError, "Could not create LuaTableRef. Empty stack?");
 		return NULL;
 	}
 
+	/* keep track of refs, so the sandbox is not reset while in use */
+	++sandbox->nrefs;
+
+	if (! (cached = PyLong_FromVoidPtr(ltr)) || -1 == PyDict_SetItem(sandbox->tablerefs, key, cached)) {
+		Py_XDECREF(cached);
+		Py_DECREF(key);
+		Py_DECREF(ltr);
+		return NULL;
+	}
+	Py_DECREF(cached);
+	ltr->cache_key = key;
+
 	return (PyObject*)ltr;
 }
@@ -0,0 +1,207 @@
+/**
+ * Small-object pool allocator.
+ *
+ * Lua allocates a very large number of small, short lived objects
+ * (strings, table nodes, closures, upvalues). Instead of handing each of
+ * these to malloc(), a MemPool carves them from larger slabs, keeping a
+ * free list per size class. Blocks that are too big for any size class
+ * are allocated using malloc(), but are kept in a list as well.
+ *
+ * This means that all memory owned by a MemPool can be released in one go
+ * by mempool_destroy(), without having to free every object on its own.
+ *
+ * The pool does no accounting of its own; the caller passes in the
+ * old and new sizes exactly as lua_Alloc receives them, so the size
+ * class of a block can always be determined from its size alone.
+ */
+#include "luaboxmodule.h"
+
+/* size of a block of a given size class, in bytes */
+static const size_t mempool_class_size[MEMPOOL_NUM_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+
+/* maps (size+15)/16 to a size class */
+static const unsigned char mempool_class_index[MEMPOOL_MAX_SMALL/16+1] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11
+};
+
+/* Slab header. The union ensures that blocks following it are aligned. */
+typedef union MemPoolSlab {
+	union MemPoolSlab *next;
+	double _align_d;
+	void *_align_p[2];
+} MemPoolSlab;
+
+/* Header for blocks that are too large for the pool. */
+typedef union MemPoolLarge {
+	struct {
+		union MemPoolLarge *prev;
+		union MemPoolLarge *next;
+	} link;
+	double _align_d[2];
+} MemPoolLarge;
+
+/* Free-list entry, stored inside the free block itself. */
+typedef struct MemPoolFree {
+	struct MemPoolFree *next;
+} MemPoolFree;
+
+static inline int mempool_class(size_t size) {
+	return mempool_class_index[(size+15) >> 4];
+}
+
+/**
+ * Refill the free list of a size class by allocating a new slab.
+ *
+ * Returns 0 if no memory is available.
+ */
+static int mempool_grow(MemPool *pool, int cls) {
+	size_t bsize = mempool_class_size[cls];
+	size_t nblocks = (MEMPOOL_SLAB_SIZE - sizeof(MemPoolSlab)) / bsize;
+	MemPoolSlab *slab = malloc(MEMPOOL_SLAB_SIZE);
+	char *p;
+	size_t i;
+
+	if (! slab) return 0;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	/* thread all blocks of the new slab onto the free list */
+	p = (char*) (slab+1);
+	for (i = 0; i < nblocks; ++i, p += bsize) {
+		MemPoolFree *f = (MemPoolFree*) p;
+		f->next = pool->free[cls];
+		pool->free[cls] = f;
+	}
+
+	return 1;
+}
+
+static void *mempool_small_alloc(MemPool *pool, int cls) {
+	MemPoolFree *f;
+
+	if (! pool->free[cls] && ! mempool_grow(pool, cls)) return NULL;
+
+	f = (MemPoolFree*) pool->free[cls];
+	pool->free[cls] = f->next;
+	return f;
+}
+
+static inline void mempool_small_free(MemPool *pool, void *ptr, int cls) {
+	MemPoolFree *f = (MemPoolFree*) ptr;
+	f->next = pool->free[cls];
+	pool->free[cls] = f;
+}
+
+static void *mempool_large_realloc(MemPool *pool, void *ptr, size_t nsize) {
+	MemPoolLarge *old = ptr ? ((MemPoolLarge*) ptr)-1 : NULL;
+	MemPoolLarge *blk;
+
+	blk = realloc(old, sizeof(MemPoolLarge)+nsize);
+	if (! blk) return NULL;
+
+	if (old) {
+		/* block might have moved, fix up neighbours */
+		if (blk->link.prev) blk->link.prev->link.next = blk;
+		else pool->large = blk;
+		if (blk->link.next) blk->link.next->link.prev = blk;
+	} else {
+		/* new block, insert at head */
+		blk->link.prev = NULL;
+		blk->link.next = (MemPoolLarge*) pool->large;
+		if (pool->large) ((MemPoolLarge*) pool->large)->link.prev = blk;
+		pool->large = blk;
+	}
+
+	return blk+1;
+}
+
+static void mempool_large_free(MemPool *pool, void *ptr) {
+	MemPoolLarge *blk = ((MemPoolLarge*) ptr)-1;
+
+	if (blk->link.prev) blk->link.prev->link.next = blk->link.next;
+	else pool->large = blk->link.next;
+	if (blk->link.next) blk->link.next->link.prev = blk->link.prev;
+
+	free(blk);
+}
+
+/**
+ * Initialize an empty pool.
+ */
+void mempool_init(MemPool *pool) {
+	memset(pool, 0, sizeof(MemPool));
+}
+
+/**
+ * Allocate, resize or free a block.
+ *
+ * Semantics are those of lua_Alloc: `osize` must be the size the block
+ * was allocated with (0 if `ptr` is NULL), `nsize` of 0 frees the block.
+ * Returns NULL if memory could not be allocated, in which case the
+ * original block is left untouched.
+ */
+void *mempool_realloc(MemPool *pool, void *ptr, size_t osize, size_t nsize) {
+	int small_old = (ptr && osize <= MEMPOOL_MAX_SMALL);
+	int small_new = (nsize <= MEMPOOL_MAX_SMALL);
+	void *nptr;
+
+	if (0 == nsize) {
+		if (! ptr) return NULL;
+		if (small_old) mempool_small_free(pool, ptr, mempool_class(osize));
+		else mempool_large_free(pool, ptr);
+		return NULL;
+	}
+
+	if (! ptr) {
+		if (small_new) return mempool_small_alloc(pool, mempool_class(nsize));
+		return mempool_large_realloc(pool, NULL, nsize);
+	}
+
+	if (small_old && small_new) {
+		/* blocks of the same class can be reused as is */
+		int ocls = mempool_class(osize), ncls = mempool_class(nsize);
+		if (ocls == ncls) return ptr;
+
+		if (! (nptr = mempool_small_alloc(pool, ncls))) return NULL;
+		memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+		mempool_small_free(pool, ptr, ocls);
+		return nptr;
+	}
+
+	if (! small_old && ! small_new) return mempool_large_realloc(pool, ptr, nsize);
+
+	/* moving between pool and large blocks */
+	if (small_new) nptr = mempool_small_alloc(pool, mempool_class(nsize));
+	else nptr = mempool_large_realloc(pool, NULL, nsize);
+	if (! nptr) return NULL;
+
+	memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+	if (small_old) mempool_small_free(pool, ptr, mempool_class(osize));
+	else mempool_large_free(pool, ptr);
+
+	return nptr;
+}
+
+/**
+ * Release all memory owned by the pool at once.
+ *
+ * Any pointers previously returned by mempool_realloc become invalid.
+ */
+void mempool_destroy(MemPool *pool) {
+	while (pool->slabs) {
+		MemPoolSlab *slab = (MemPoolSlab*) pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	while (pool->large) {
+		MemPoolLarge *blk = (MemPoolLarge*) pool->large;
+		pool->large = blk->link.next;
+		free(blk);
+	}
+
+	memset(pool->free, 0, sizeof(pool->free));
+}
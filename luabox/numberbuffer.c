@@ -0,0 +1,307 @@
+/**
+ * Contiguous arrays of numbers, exchanged with lua tables in one pass.
+ *
+ * LuaTableRef.to_buffer() copies the array part of a table into a
+ * NumberBuffer, which owns its memory and exposes it through the old and
+ * the new buffer protocol, so numpy.frombuffer(), memoryview() and the
+ * like can use it without creating a Python object per element.
+ * Sandbox.push_array() goes the other way, pushing any buffer of numbers
+ * as a pre-sized lua table.
+ *
+ * Supported formats are the struct module codes 'd', 'f', 'i', 'l' and
+ * 'q', in native byte order.
+ */
+#include "luaboxmodule.h"
+
+/* 2**53, the largest magnitude up to which every integer is a double */
+#define NUMBERBUFFER_EXACT_BOUND (1LL << 53)
+
+static PyBufferProcs NumberBuffer_as_buffer;
+static PySequenceMethods NumberBuffer_sequence;
+
+PyTypeObject NumberBufferType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.NumberBuffer",              /*tp_name*/
+	sizeof(NumberBuffer)                /*tp_basicsize*/
+};
+
+/**
+ * Returns the size of an item of the given format, or 0 if the format is
+ * not supported.
+ */
+Py_ssize_t numberbuffer_itemsize(char format) {
+	switch (format) {
+		case 'd': return sizeof(double);
+		case 'f': return sizeof(float);
+		case 'i': return sizeof(int);
+		case 'l': return sizeof(long);
+		case 'q': return sizeof(long long);
+		default: return 0;
+	}
+}
+
+/**
+ * Parses a struct module format string describing a single item in
+ * native byte order. Returns the format code, or 0 if it is not supported.
+ */
+char numberbuffer_format(const char *format) {
+	const int one = 1;
+	const char native = *(const char*) &one ? '<' : '>';
+
+	if ('@' == *format || '=' == *format || native == *format) ++format;
+	if (! format[0] || format[1] || ! numberbuffer_itemsize(format[0])) return 0;
+	return format[0];
+}
+
+/**
+ * Reads item `i` of `data`. Items are copied out, as buffers of other
+ * objects need not be aligned.
+ */
+static lua_Number numberbuffer_get(const char *data, char format, Py_ssize_t i) {
+	double d;
+	float f;
+	int n;
+	long l;
+	long long q;
+
+	switch (format) {
+		case 'd': memcpy(&d, data + i * sizeof(d), sizeof(d)); return (lua_Number) d;
+		case 'f': memcpy(&f, data + i * sizeof(f), sizeof(f)); return (lua_Number) f;
+		case 'i': memcpy(&n, data + i * sizeof(n), sizeof(n)); return (lua_Number) n;
+		case 'l': memcpy(&l, data + i * sizeof(l), sizeof(l)); return (lua_Number) l;
+		default: memcpy(&q, data + i * sizeof(q), sizeof(q)); return (lua_Number) q;
+	}
+}
+
+/**
+ * Stores `v` as item `i` of `data`. Returns 0 if it cannot be represented
+ * in an integer format.
+ */
+static int numberbuffer_set(char *data, char format, Py_ssize_t i, lua_Number v) {
+	switch (format) {
+		case 'd':
+			((double*) data)[i] = (double) v;
+			return 1;
+
+		case 'f':
+			((float*) data)[i] = (float) v;
+			return 1;
+
+		case 'i':
+			if (! (v >= INT_MIN && v <= INT_MAX) || (lua_Number)(int) v != v) return 0;
+			((int*) data)[i] = (int) v;
+			return 1;
+
+		case 'l':
+			/* -LONG_MIN is exact as a double, LONG_MAX may not be */
+			if (! (v >= LONG_MIN && v < -(lua_Number) LONG_MIN) || (lua_Number)(long) v != v) return 0;
+			((long*) data)[i] = (long) v;
+			return 1;
+
+		default:
+			if (! (v >= LLONG_MIN && v < -(lua_Number) LLONG_MIN) || (lua_Number)(long long) v != v) return 0;
+			((long long*) data)[i] = (long long) v;
+			return 1;
+	}
+}
+
+static void NumberBuffer_dealloc(NumberBuffer *self) {
+	PyMem_Free(self->data);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t NumberBuffer_length(PyObject *self) {
+	return ((NumberBuffer*) self)->n;
+}
+
+static Py_ssize_t NumberBuffer_getreadbuffer(PyObject *self, Py_ssize_t segment, void **ptr) {
+	NumberBuffer *nb = (NumberBuffer*) self;
+
+	if (0 != segment) {
+		PyErr_SetString(PyExc_SystemError, "Accessing non-existent NumberBuffer segment.");
+		return -1;
+	}
+
+	*ptr = (void*) nb->data;
+	return nb->n * nb->itemsize;
+}
+
+static Py_ssize_t NumberBuffer_getsegcount(PyObject *self, Py_ssize_t *lenp) {
+	NumberBuffer *nb = (NumberBuffer*) self;
+	if (lenp) *lenp = nb->n * nb->itemsize;
+	return 1;
+}
+
+/**
+ * Exports the buffer as a one-dimensional array of `format` items.
+ */
+static int NumberBuffer_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+	NumberBuffer *nb = (NumberBuffer*) self;
+
+	Py_INCREF(self);
+	view->obj = self;
+	view->buf = nb->data;
+	view->len = nb->n * nb->itemsize;
+	view->readonly = 0;
+	view->itemsize = nb->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? nb->format : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &nb->n : NULL;
+	view->strides = (PyBUF_STRIDES == (flags & PyBUF_STRIDES)) ? &view->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+
+	return 0;
+}
+
+static PyObject *NumberBuffer_getformat(NumberBuffer *self, void *closure) {
+	return PyString_FromString(self->format);
+}
+
+static PyObject *NumberBuffer_getitemsize(NumberBuffer *self, void *closure) {
+	return PyInt_FromSsize_t(self->itemsize);
+}
+
+static PyGetSetDef NumberBuffer_getseters[] = {
+	{"format", (getter)NumberBuffer_getformat, NULL, "struct module format of the items", NULL},
+	{"itemsize", (getter)NumberBuffer_getitemsize, NULL, "size of an item in bytes", NULL},
+	{NULL}
+};
+
+void NumberBufferType_INIT(PyTypeObject *t) {
+	t->tp_new = 0; // created from lua tables only
+	t->tp_dealloc = (destructor)NumberBuffer_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+	t->tp_doc = "Contiguous array of numbers copied from a lua table.";
+	t->tp_getset = NumberBuffer_getseters;
+
+	t->tp_as_sequence = &NumberBuffer_sequence;
+	NumberBuffer_sequence.sq_length = NumberBuffer_length;
+
+	t->tp_as_buffer = &NumberBuffer_as_buffer;
+	NumberBuffer_as_buffer.bf_getreadbuffer = NumberBuffer_getreadbuffer;
+	NumberBuffer_as_buffer.bf_getwritebuffer = NumberBuffer_getreadbuffer;
+	NumberBuffer_as_buffer.bf_getsegcount = NumberBuffer_getsegcount;
+	NumberBuffer_as_buffer.bf_getbuffer = NumberBuffer_getbuffer;
+
+	if(PyType_Ready(t) < 0) return;
+}
+
+/**
+ * Copies the elements 1..#t of the table at `index` into a new
+ * NumberBuffer of the given format. Elements must be numbers; for integer
+ * formats they must be integral and in range. Does not allocate lua
+ * memory.
+ */
+PyObject *NumberBuffer_from_table(lua_State *L, int index, char format) {
+	Py_ssize_t i, n, itemsize = numberbuffer_itemsize(format);
+	NumberBuffer *nb;
+	size_t len;
+
+	len = lua_objlen(L, index);
+	if (len > (size_t) (PY_SSIZE_T_MAX / itemsize)) return PyErr_NoMemory();
+	n = (Py_ssize_t) len;
+
+	if (! (nb = PyObject_New(NumberBuffer, &NumberBufferType))) return NULL;
+	nb->n = n;
+	nb->itemsize = itemsize;
+	nb->format[0] = format;
+	nb->format[1] = '\0';
+	if (! (nb->data = PyMem_Malloc(n ? n * itemsize : 1))) {
+		nb->n = 0;
+		Py_DECREF(nb);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < n; ++i) {
+		lua_rawgeti(L, index, (int) (i + 1));
+		if (LUA_TNUMBER != lua_type(L, -1)) {
+			lua_pop(L, 1);
+			Py_DECREF(nb);
+			return PyErr_Format(PyExc_TypeError, "Table element %zd is not a number.", i + 1);
+		}
+		if (! numberbuffer_set(nb->data, format, i, lua_tonumber(L, -1))) {
+			lua_pop(L, 1);
+			Py_DECREF(nb);
+			return PyErr_Format(PyExc_ValueError, "Table element %zd cannot be stored as '%c'.", i + 1, format);
+		}
+		lua_pop(L, 1);
+	}
+
+	return (PyObject*) nb;
+}
+
+typedef struct {
+	const char *data;
+	Py_ssize_t n;
+	char format;
+	int ref;
+} PushArrayArgs;
+
+/**
+ * lua_CFunction creating the table for luabox_push_array, storing it in
+ * the registry.
+ */
+static int numberbuffer_push_protected(lua_State *L) {
+	PushArrayArgs *args = (PushArrayArgs*) lua_touserdata(L, 1);
+	Py_ssize_t i;
+
+	lua_createtable(L, (int) args->n, 0);
+	for (i = 0; i < args->n; ++i) {
+		lua_pushnumber(L, numberbuffer_get(args->data, args->format, i));
+		lua_rawseti(L, -2, (int) (i + 1));
+	}
+	args->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
+/**
+ * Pushes a table holding the `n` items of `data`, which are of the given
+ * (supported) format. The table is allocated with its final size up
+ * front. The caller must hold the sandbox lock.
+ *
+ * 64-bit integers beyond 2**53 are rounded by lua_Number, which is an
+ * error unless the sandbox's `lossy_integers` is set.
+ *
+ * Returns 1 on success, 0 with a Python exception set.
+ */
+int luabox_push_array(Sandbox *self, const char *data, Py_ssize_t n, char format) {
+	PushArrayArgs args;
+	Py_ssize_t i;
+	long long v;
+	int status;
+
+	if (n > INT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "Too many items for a lua table.");
+		return 0;
+	}
+
+	/* check precision before creating anything */
+	if (! self->lossy_integers && 8 == numberbuffer_itemsize(format) && 'd' != format) {
+		for (i = 0; i < n; ++i) {
+			memcpy(&v, data + i * sizeof(v), sizeof(v));
+			if (v > NUMBERBUFFER_EXACT_BOUND || v < -NUMBERBUFFER_EXACT_BOUND) {
+				PyErr_Format(PyExc_OverflowError, "Item %zd cannot be represented exactly as a lua number.", i);
+				return 0;
+			}
+		}
+	}
+
+	args.data = data;
+	args.n = n;
+	args.format = format;
+	args.ref = LUA_NOREF;
+
+	if ((status = lua_cpcall(self->L, numberbuffer_push_protected, &args))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(self->L, -1));
+		lua_pop(self->L, 1);
+		return 0;
+	}
+
+	lua_rawgeti(self->L, LUA_REGISTRYINDEX, args.ref);
+	luaL_unref(self->L, LUA_REGISTRYINDEX, args.ref);
+
+	return 1;
+}
@@ -0,0 +1,770 @@
+/**
+ * Compact binary encoding of the values the sandbox can exchange with
+ * Python.
+ *
+ * The format is a subset of MessagePack: nil, booleans, integers, doubles,
+ * byte strings (bin), arrays and maps. Any MessagePack str is decoded as a
+ * byte string too. It is used by ProcessPool to pass scripts, arguments
+ * and results between processes.
+ *
+ * Python types are those handled by types.c: None, bool, int, long, float,
+ * str and read buffers, lists, tuples and dicts. LuaTableRefs are encoded
+ * as their to_python() conversion. Arrays are decoded as lists.
+ *
+ * Lua values (nil, booleans, numbers, strings and tables of them) are
+ * encoded straight from the lua stack and decoded straight into lua
+ * tables, for Sandbox.dump_value() and load_value(). Tables with the keys
+ * 1..n become arrays, all others maps. Integral numbers are encoded as
+ * integers. A table may only be reached once, as MessagePack cannot
+ * express cycles or shared references.
+ */
+#include "luaboxmodule.h"
+
+/* 2**53, the largest magnitude up to which every integer is a double */
+#define PACK_EXACT_BOUND (1ULL << 53)
+
+/* type bytes */
+#define PACK_NIL 0xc0
+#define PACK_FALSE 0xc2
+#define PACK_TRUE 0xc3
+#define PACK_BIN8 0xc4
+#define PACK_BIN16 0xc5
+#define PACK_BIN32 0xc6
+#define PACK_FLOAT32 0xca
+#define PACK_FLOAT64 0xcb
+#define PACK_UINT8 0xcc
+#define PACK_UINT16 0xcd
+#define PACK_UINT32 0xce
+#define PACK_UINT64 0xcf
+#define PACK_INT8 0xd0
+#define PACK_INT16 0xd1
+#define PACK_INT32 0xd2
+#define PACK_INT64 0xd3
+#define PACK_STR8 0xd9
+#define PACK_STR16 0xda
+#define PACK_STR32 0xdb
+#define PACK_ARRAY16 0xdc
+#define PACK_ARRAY32 0xdd
+#define PACK_MAP16 0xde
+#define PACK_MAP32 0xdf
+
+/**
+ * Makes room for `n` more bytes.
+ *
+ * Returns 0 on success, -1 with MemoryError set.
+ */
+int pack_reserve(PackBuffer *b, size_t n) {
+	size_t alloc;
+	char *data;
+
+	if (b->len + n <= b->alloc) return 0;
+
+	alloc = b->alloc ? b->alloc : 256;
+	while (alloc < b->len + n) alloc *= 2;
+	if (! (data = realloc(b->data, alloc))) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	b->data = data;
+	b->alloc = alloc;
+	return 0;
+}
+
+void pack_free(PackBuffer *b) {
+	free(b->data);
+	b->data = NULL;
+	b->len = b->alloc = 0;
+}
+
+static int pack_bytes(PackBuffer *b, const void *data, size_t n) {
+	if (-1 == pack_reserve(b, n)) return -1;
+	memcpy(b->data + b->len, data, n);
+	b->len += n;
+	return 0;
+}
+
+static int pack_byte(PackBuffer *b, unsigned char c) {
+	return pack_bytes(b, &c, 1);
+}
+
+/**
+ * Appends a type byte followed by `n` bytes of `v` in big-endian order.
+ */
+static int pack_be(PackBuffer *b, unsigned char type, unsigned long long v, int n) {
+	unsigned char buf[9];
+	int i;
+
+	buf[0] = type;
+	for (i = n; i > 0; --i, v >>= 8) buf[i] = (unsigned char) (v & 0xff);
+	return pack_bytes(b, buf, n + 1);
+}
+
+/**
+ * Appends a header for a container or string of size `n`, choosing the
+ * smallest representation. `fix` is the type byte of the fixed-size form
+ * (or 0 if there is none) holding up to `fixmax` elements.
+ */
+static int pack_header(PackBuffer *b, size_t n, unsigned char fix, size_t fixmax, unsigned char t8, unsigned char t16, unsigned char t32) {
+	if (fix && n <= fixmax) return pack_byte(b, (unsigned char) (fix | n));
+	if (t8 && n <= 0xff) return pack_be(b, t8, n, 1);
+	if (n <= 0xffff) return pack_be(b, t16, n, 2);
+	if (n <= 0xffffffffUL) return pack_be(b, t32, n, 4);
+
+	PyErr_SetString(PyExc_ValueError, "Value too large to encode.");
+	return -1;
+}
+
+int pack_int(PackBuffer *b, long long v) {
+	if (0 <= v && v < 128) return pack_byte(b, (unsigned char) v);
+	if (-32 <= v && v < 0) return pack_byte(b, (unsigned char) (v & 0xff));
+	if (-128 <= v && v < 128) return pack_be(b, PACK_INT8, (unsigned long long) v, 1);
+	if (-32768 <= v && v < 32768) return pack_be(b, PACK_INT16, (unsigned long long) v, 2);
+	if (-2147483648LL <= v && v < 2147483648LL) return pack_be(b, PACK_INT32, (unsigned long long) v, 4);
+	return pack_be(b, PACK_INT64, (unsigned long long) v, 8);
+}
+
+int pack_double(PackBuffer *b, double d) {
+	unsigned long long v;
+	memcpy(&v, &d, sizeof(v));
+	return pack_be(b, PACK_FLOAT64, v, 8);
+}
+
+int pack_bin(PackBuffer *b, const char *data, size_t n) {
+	if (-1 == pack_header(b, n, 0, 0, PACK_BIN8, PACK_BIN16, PACK_BIN32)) return -1;
+	return pack_bytes(b, data, n);
+}
+
+int pack_array_header(PackBuffer *b, size_t n) {
+	return pack_header(b, n, 0x90, 15, 0, PACK_ARRAY16, PACK_ARRAY32);
+}
+
+int pack_map_header(PackBuffer *b, size_t n) {
+	return pack_header(b, n, 0x80, 15, 0, PACK_MAP16, PACK_MAP32);
+}
+
+static int pack_object(PackBuffer *b, PyObject *obj, int depth) {
+	Py_ssize_t i, n;
+	PyObject *key, *value;
+	int rval;
+
+	if (depth > LUABOX_MAX_DEPTH) {
+		PyErr_SetString(PyExc_ValueError, "Value is nested too deeply (or recursive).");
+		return -1;
+	}
+
+	/* PyBool is a subtype of Int, check first */
+	if (PyBool_Check(obj)) return pack_byte(b, Py_True == obj ? PACK_TRUE : PACK_FALSE);
+	if (Py_None == obj) return pack_byte(b, PACK_NIL);
+	if (PyInt_Check(obj)) return pack_int(b, PyInt_AS_LONG(obj));
+
+	if (PyLong_Check(obj)) {
+		int overflow;
+		long long v = PyLong_AsLongLongAndOverflow(obj, &overflow);
+
+		if (-1 == v && PyErr_Occurred()) return -1;
+		if (! overflow) return pack_int(b, v);
+		if (0 < overflow) {
+			unsigned long long u = PyLong_AsUnsignedLongLong(obj);
+			if ((unsigned long long) -1 != u || ! PyErr_Occurred()) return pack_be(b, PACK_UINT64, u, 8);
+			PyErr_Clear();
+		}
+		/* out of range either way, lua would only see a double */
+		{
+			double d = PyLong_AsDouble(obj);
+			if (-1.0 == d && PyErr_Occurred()) return -1;
+			return pack_double(b, d);
+		}
+	}
+
+	if (PyFloat_Check(obj)) return pack_double(b, PyFloat_AS_DOUBLE(obj));
+	if (PyString_Check(obj)) return pack_bin(b, PyString_AS_STRING(obj), PyString_GET_SIZE(obj));
+
+	if (PyList_Check(obj) || PyTuple_Check(obj)) {
+		n = PySequence_Fast_GET_SIZE(obj);
+		if (-1 == pack_array_header(b, n)) return -1;
+		for (i = 0; i < n; ++i) {
+			if (-1 == pack_object(b, PySequence_Fast_GET_ITEM(obj, i), depth + 1)) return -1;
+		}
+		return 0;
+	}
+
+	if (PyDict_Check(obj)) {
+		if (-1 == pack_map_header(b, PyDict_Size(obj))) return -1;
+		i = 0;
+		while (PyDict_Next(obj, &i, &key, &value)) {
+			if (-1 == pack_object(b, key, depth + 1)) return -1;
+			if (-1 == pack_object(b, value, depth + 1)) return -1;
+		}
+		return 0;
+	}
+
+	if (PyObject_TypeCheck(obj, &LuaTableRefType)) {
+		if (! (value = PyObject_CallMethod(obj, "to_python", NULL))) return -1;
+		rval = pack_object(b, value, depth + 1);
+		Py_DECREF(value);
+		return rval;
+	}
+
+	if (! PyUnicode_Check(obj) && PyObject_CheckReadBuffer(obj)) {
+		const void *buf;
+		Py_ssize_t len;
+
+		if (-1 == PyObject_AsReadBuffer(obj, &buf, &len)) return -1;
+		return pack_bin(b, (const char*) buf, len);
+	}
+
+	PyErr_Format(PyExc_TypeError, "Don't know how to encode type '%s'.", obj->ob_type->tp_name);
+	return -1;
+}
+
+/**
+ * Appends the encoding of `obj` to the buffer.
+ *
+ * Returns 0 on success, -1 with a Python exception set.
+ */
+int pack_value(PackBuffer *b, PyObject *obj) {
+	return pack_object(b, obj, 0);
+}
+
+/* encoding lua values */
+
+/**
+ * State of encoding a lua value: the tables visited so far, by address,
+ * and the length the buffer may grow to.
+ */
+typedef struct {
+	PackBuffer *b;
+	lua_State *L;
+	PyObject *seen;
+	size_t max_size;
+} LuaPacker;
+
+static int pack_lua_object(LuaPacker *lp, int index, int depth);
+
+static int pack_lua_number(PackBuffer *b, lua_Number v) {
+	/* integral and in range, but not -0 */
+	if (v >= -9223372036854775808.0 && v < 9223372036854775808.0 && (lua_Number) (long long) v == v && copysign(1.0, v) > 0) {
+		return pack_int(b, (long long) v);
+	}
+	return pack_double(b, (double) v);
+}
+
+/**
+ * Fails unless `n` more bytes fit into the output.
+ */
+static int pack_lua_room(LuaPacker *lp, size_t n) {
+	if (lp->b->len <= lp->max_size && n <= lp->max_size - lp->b->len) return 0;
+	PyErr_SetString(PyExc_ValueError, "Encoded lua value exceeds max_size.");
+	return -1;
+}
+
+/**
+ * Records the table at `index` as visited. MessagePack has no references,
+ * so a table reached twice, by a cycle or a shared reference, cannot be
+ * encoded; copying it instead could take exponential space.
+ */
+static int pack_lua_visit(LuaPacker *lp, int index) {
+	PyObject *id;
+	int rval;
+
+	if (! (id = PyLong_FromVoidPtr((void*) lua_topointer(lp->L, index)))) return -1;
+	if (PyDict_GetItem(lp->seen, id)) {
+		Py_DECREF(id);
+		PyErr_SetString(PyExc_ValueError, "Lua table is referenced more than once (or recursive).");
+		return -1;
+	}
+	rval = PyDict_SetItem(lp->seen, id, Py_None);
+	Py_DECREF(id);
+	return rval;
+}
+
+static int pack_lua_table(LuaPacker *lp, int index, int depth) {
+	PackBuffer *b = lp->b;
+	lua_State *L = lp->L;
+	size_t n, count = 0, i;
+	lua_Number k;
+	int is_array;
+
+	if (depth <= 0) {
+		PyErr_SetString(PyExc_ValueError, "Lua table nesting exceeds max_depth.");
+		return -1;
+	}
+
+	if (-1 == pack_lua_visit(lp, index)) return -1;
+
+	if (! lua_checkstack(L, 3)) {
+		PyErr_SetString(PyExc_MemoryError, "Lua stack overflow while encoding table.");
+		return -1;
+	}
+
+	/* count the keys, and check whether they are exactly 1..n */
+	n = lua_objlen(L, index);
+	is_array = (n > 0);
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		lua_pop(L, 1);
+		++count;
+
+		if (is_array) {
+			k = lua_tonumber(L, -1);
+			if (LUA_TNUMBER != lua_type(L, -1) || k < 1 || k > n || k != (lua_Number)(size_t) k) is_array = 0;
+		}
+	}
+	if (count != n) is_array = 0;
+
+	if (is_array) {
+		if (-1 == pack_array_header(b, n)) return -1;
+		for (i = 1; i <= n; ++i) {
+			lua_rawgeti(L, index, (int) i);
+			if (-1 == pack_lua_object(lp, lua_gettop(L), depth - 1)) {
+				lua_pop(L, 1);
+				return -1;
+			}
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+
+	if (-1 == pack_map_header(b, count)) return -1;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (-1 == pack_lua_object(lp, lua_gettop(L) - 1, depth - 1) || -1 == pack_lua_object(lp, lua_gettop(L), depth - 1)) {
+			lua_pop(L, 2);
+			return -1;
+		}
+		lua_pop(L, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * Appends the encoding of the value at the (absolute) `index`. Does not
+ * convert values in place, so it is safe for keys during lua_next.
+ */
+static int pack_lua_object(LuaPacker *lp, int index, int depth) {
+	lua_State *L = lp->L;
+	const char *s;
+	size_t len;
+
+	/* room for any number or header, strings are checked before copying */
+	if (-1 == pack_lua_room(lp, 9)) return -1;
+
+	switch (lua_type(L, index)) {
+		case LUA_TNIL: return pack_byte(lp->b, PACK_NIL);
+		case LUA_TBOOLEAN: return pack_byte(lp->b, lua_toboolean(L, index) ? PACK_TRUE : PACK_FALSE);
+		case LUA_TNUMBER: return pack_lua_number(lp->b, lua_tonumber(L, index));
+
+		case LUA_TSTRING:
+			s = lua_tolstring(L, index, &len);
+			if (-1 == pack_lua_room(lp, len + 5)) return -1;
+			return pack_bin(lp->b, s, len);
+
+		case LUA_TTABLE: return pack_lua_table(lp, index, depth);
+
+		default:
+			PyErr_Format(PyExc_TypeError, "Cannot encode lua type '%s'.", luaL_typename(L, index));
+			return -1;
+	}
+}
+
+/**
+ * Appends the encoding of the lua value at `index`. Tables may be nested
+ * up to `max_depth` levels, at most LUABOX_MAX_DEPTH, and must not be
+ * reached twice. The encoding may take up to `max_size` bytes. Does not
+ * allocate lua memory.
+ *
+ * Returns 0 on success, -1 with a Python exception set.
+ */
+int pack_lua_value(PackBuffer *b, lua_State *L, int index, int max_depth, size_t max_size) {
+	LuaPacker lp;
+	int rval;
+
+	if (index < 0 && index > LUA_REGISTRYINDEX) index += lua_gettop(L) + 1;
+	if (max_depth > LUABOX_MAX_DEPTH) max_depth = LUABOX_MAX_DEPTH;
+
+	lp.b = b;
+	lp.L = L;
+	lp.max_size = b->len + max_size < b->len ? (size_t) -1 : b->len + max_size;
+	if (! (lp.seen = PyDict_New())) return -1;
+
+	rval = pack_lua_object(&lp, index, max_depth);
+	Py_DECREF(lp.seen);
+	return rval;
+}
+
+/* decoding */
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+} Unpacker;
+
+static PyObject *unpack_malformed(void) {
+	PyErr_SetString(PyExc_ValueError, "Malformed or truncated data.");
+	return NULL;
+}
+
+/**
+ * Reads an `n` byte big-endian unsigned integer.
+ */
+static int unpack_be(Unpacker *u, int n, unsigned long long *v) {
+	if (u->end - u->p < n) return -1;
+	for (*v = 0; n; --n) *v = (*v << 8) | *u->p++;
+	return 0;
+}
+
+static PyObject *unpack_object(Unpacker *u, int depth);
+
+static PyObject *unpack_string(Unpacker *u, unsigned long long n) {
+	PyObject *rval;
+
+	if ((unsigned long long) (u->end - u->p) < n) return unpack_malformed();
+	rval = PyString_FromStringAndSize((const char*) u->p, (Py_ssize_t) n);
+	u->p += n;
+	return rval;
+}
+
+static PyObject *unpack_array(Unpacker *u, unsigned long long n, int depth) {
+	PyObject *rval, *item;
+	unsigned long long i;
+
+	/* every element takes at least one byte */
+	if ((unsigned long long) (u->end - u->p) < n) return unpack_malformed();
+	if (! (rval = PyList_New((Py_ssize_t) n))) return NULL;
+
+	for (i = 0; i < n; ++i) {
+		if (! (item = unpack_object(u, depth + 1))) {
+			Py_DECREF(rval);
+			return NULL;
+		}
+		PyList_SET_ITEM(rval, (Py_ssize_t) i, item);
+	}
+
+	return rval;
+}
+
+static PyObject *unpack_map(Unpacker *u, unsigned long long n, int depth) {
+	PyObject *rval, *key, *value;
+	unsigned long long i;
+
+	if ((unsigned long long) (u->end - u->p) / 2 < n) return unpack_malformed();
+	if (! (rval = PyDict_New())) return NULL;
+
+	for (i = 0; i < n; ++i) {
+		if (! (key = unpack_object(u, depth + 1))) goto error;
+		if (! (value = unpack_object(u, depth + 1))) {
+			Py_DECREF(key);
+			goto error;
+		}
+		if (-1 == PyDict_SetItem(rval, key, value)) {
+			Py_DECREF(key);
+			Py_DECREF(value);
+			goto error;
+		}
+		Py_DECREF(key);
+		Py_DECREF(value);
+	}
+
+	return rval;
+
+error:
+	Py_DECREF(rval);
+	return NULL;
+}
+
+static PyObject *unpack_object(Unpacker *u, int depth) {
+	unsigned long long v;
+	unsigned char t;
+
+	if (depth > LUABOX_MAX_DEPTH) {
+		PyErr_SetString(PyExc_ValueError, "Data is nested too deeply.");
+		return NULL;
+	}
+	if (u->p >= u->end) return unpack_malformed();
+	t = *u->p++;
+
+	if (t < 0x80) return PyInt_FromLong(t);
+	if (t >= 0xe0) return PyInt_FromLong((long) t - 256);
+	if (t < 0x90) return unpack_map(u, t & 0x0f, depth);
+	if (t < 0xa0) return unpack_array(u, t & 0x0f, depth);
+	if (t < 0xc0) return unpack_string(u, t & 0x1f);
+
+	switch (t) {
+		case PACK_NIL: Py_RETURN_NONE;
+		case PACK_FALSE: Py_RETURN_FALSE;
+		case PACK_TRUE: Py_RETURN_TRUE;
+
+		case PACK_BIN8: case PACK_STR8:
+			if (-1 == unpack_be(u, 1, &v)) break;
+			return unpack_string(u, v);
+		case PACK_BIN16: case PACK_STR16:
+			if (-1 == unpack_be(u, 2, &v)) break;
+			return unpack_string(u, v);
+		case PACK_BIN32: case PACK_STR32:
+			if (-1 == unpack_be(u, 4, &v)) break;
+			return unpack_string(u, v);
+
+		case PACK_FLOAT32: {
+			unsigned int bits;
+			float f;
+			if (-1 == unpack_be(u, 4, &v)) break;
+			bits = (unsigned int) v;
+			memcpy(&f, &bits, sizeof(f));
+			return PyFloat_FromDouble(f);
+		}
+		case PACK_FLOAT64: {
+			double d;
+			if (-1 == unpack_be(u, 8, &v)) break;
+			memcpy(&d, &v, sizeof(d));
+			return PyFloat_FromDouble(d);
+		}
+
+		case PACK_UINT8: if (-1 == unpack_be(u, 1, &v)) break; return PyInt_FromLong((long) v);
+		case PACK_UINT16: if (-1 == unpack_be(u, 2, &v)) break; return PyInt_FromLong((long) v);
+		case PACK_UINT32: if (-1 == unpack_be(u, 4, &v)) break; return PyLong_FromUnsignedLongLong(v);
+		case PACK_UINT64: if (-1 == unpack_be(u, 8, &v)) break; return PyLong_FromUnsignedLongLong(v);
+		case PACK_INT8: if (-1 == unpack_be(u, 1, &v)) break; return PyInt_FromLong((signed char) v);
+		case PACK_INT16: if (-1 == unpack_be(u, 2, &v)) break; return PyInt_FromLong((short) v);
+		case PACK_INT32: if (-1 == unpack_be(u, 4, &v)) break; return PyInt_FromLong((int) v);
+		case PACK_INT64: if (-1 == unpack_be(u, 8, &v)) break; return PyLong_FromLongLong((long long) v);
+
+		case PACK_ARRAY16: if (-1 == unpack_be(u, 2, &v)) break; return unpack_array(u, v, depth);
+		case PACK_ARRAY32: if (-1 == unpack_be(u, 4, &v)) break; return unpack_array(u, v, depth);
+		case PACK_MAP16: if (-1 == unpack_be(u, 2, &v)) break; return unpack_map(u, v, depth);
+		case PACK_MAP32: if (-1 == unpack_be(u, 4, &v)) break; return unpack_map(u, v, depth);
+
+		default:
+			return PyErr_Format(PyExc_ValueError, "Unsupported type byte 0x%02x.", t);
+	}
+
+	return unpack_malformed();
+}
+
+/**
+ * Decodes a single value from `len` bytes at `data`, which must be used
+ * up completely.
+ *
+ * Returns a new reference, or NULL with a Python exception set.
+ */
+PyObject *unpack_value(const char *data, size_t len) {
+	Unpacker u;
+	PyObject *rval;
+
+	u.p = (const unsigned char*) data;
+	u.end = u.p + len;
+
+	if (! (rval = unpack_object(&u, 0))) return NULL;
+	if (u.p != u.end) {
+		Py_DECREF(rval);
+		return unpack_malformed();
+	}
+
+	return rval;
+}
+
+/* decoding into lua */
+
+typedef struct {
+	Unpacker u;
+	int lossy_integers;
+	PyObject *exc;      /* exception type for errors in the data */
+	int ref;
+} LuaUnpacker;
+
+/**
+ * Raises a lua error for a problem with the data, to be turned into a
+ * Python exception of type `exc`.
+ */
+static void unpack_lua_error(lua_State *L, LuaUnpacker *lu, PyObject *exc, const char *msg) {
+	lu->exc = exc;
+	lua_pushstring(L, msg);
+	lua_error(L);
+}
+
+static void unpack_lua_malformed(lua_State *L, LuaUnpacker *lu) {
+	unpack_lua_error(L, lu, PyExc_ValueError, "Malformed or truncated data.");
+}
+
+static void unpack_lua_be(lua_State *L, LuaUnpacker *lu, int n, unsigned long long *v) {
+	if (-1 == unpack_be(&lu->u, n, v)) unpack_lua_malformed(L, lu);
+}
+
+static void unpack_lua_object(lua_State *L, LuaUnpacker *lu, int depth);
+
+static void unpack_lua_string(lua_State *L, LuaUnpacker *lu, unsigned long long n) {
+	Unpacker *u = &lu->u;
+
+	if ((unsigned long long) (u->end - u->p) < n) unpack_lua_malformed(L, lu);
+	lua_pushlstring(L, (const char*) u->p, (size_t) n);
+	u->p += n;
+}
+
+static void unpack_lua_array(lua_State *L, LuaUnpacker *lu, unsigned long long n, int depth) {
+	unsigned long long i;
+
+	/* every element takes at least one byte */
+	if ((unsigned long long) (lu->u.end - lu->u.p) < n || n > INT_MAX) unpack_lua_malformed(L, lu);
+
+	lua_createtable(L, (int) n, 0);
+	for (i = 0; i < n; ++i) {
+		unpack_lua_object(L, lu, depth + 1);
+		lua_rawseti(L, -2, (int) (i + 1));
+	}
+}
+
+static void unpack_lua_map(lua_State *L, LuaUnpacker *lu, unsigned long long n, int depth) {
+	unsigned long long i;
+	lua_Number k;
+
+	if ((unsigned long long) (lu->u.end - lu->u.p) / 2 < n || n > INT_MAX) unpack_lua_malformed(L, lu);
+
+	lua_createtable(L, 0, (int) n);
+	for (i = 0; i < n; ++i) {
+		unpack_lua_object(L, lu, depth + 1);
+		k = LUA_TNUMBER == lua_type(L, -1) ? lua_tonumber(L, -1) : 0;
+		if (lua_isnil(L, -1) || k != k) {
+			unpack_lua_error(L, lu, PyExc_ValueError, "Map keys cannot be nil or NaN in lua.");
+		}
+		unpack_lua_object(L, lu, depth + 1);
+		lua_rawset(L, -3);
+	}
+}
+
+/**
+ * Pushes an integer, which is rounded by lua_Number beyond 2**53 unless
+ * that is not allowed.
+ */
+static void unpack_lua_integer(lua_State *L, LuaUnpacker *lu, unsigned long long magnitude, int negative) {
+	if (magnitude > PACK_EXACT_BOUND && ! lu->lossy_integers) {
+		unpack_lua_error(L, lu, PyExc_OverflowError, "Integer cannot be represented exactly as a lua number.");
+	}
+	lua_pushnumber(L, negative ? -(lua_Number) magnitude : (lua_Number) magnitude);
+}
+
+static void unpack_lua_object(lua_State *L, LuaUnpacker *lu, int depth) {
+	Unpacker *u = &lu->u;
+	unsigned long long v;
+	unsigned char t;
+	char msg[64];
+
+	if (depth > LUABOX_MAX_DEPTH) unpack_lua_error(L, lu, PyExc_ValueError, "Data is nested too deeply.");
+	luaL_checkstack(L, 3, "Data is nested too deeply.");
+	if (u->p >= u->end) unpack_lua_malformed(L, lu);
+	t = *u->p++;
+
+	if (t < 0x80) {
+		lua_pushinteger(L, t);
+		return;
+	}
+	if (t >= 0xe0) {
+		lua_pushinteger(L, (int) t - 256);
+		return;
+	}
+	if (t < 0x90) {
+		unpack_lua_map(L, lu, t & 0x0f, depth);
+		return;
+	}
+	if (t < 0xa0) {
+		unpack_lua_array(L, lu, t & 0x0f, depth);
+		return;
+	}
+	if (t < 0xc0) {
+		unpack_lua_string(L, lu, t & 0x1f);
+		return;
+	}
+
+	switch (t) {
+		case PACK_NIL: lua_pushnil(L); return;
+		case PACK_FALSE: lua_pushboolean(L, 0); return;
+		case PACK_TRUE: lua_pushboolean(L, 1); return;
+
+		case PACK_BIN8: case PACK_STR8: unpack_lua_be(L, lu, 1, &v); unpack_lua_string(L, lu, v); return;
+		case PACK_BIN16: case PACK_STR16: unpack_lua_be(L, lu, 2, &v); unpack_lua_string(L, lu, v); return;
+		case PACK_BIN32: case PACK_STR32: unpack_lua_be(L, lu, 4, &v); unpack_lua_string(L, lu, v); return;
+
+		case PACK_FLOAT32: {
+			unsigned int bits;
+			float f;
+			unpack_lua_be(L, lu, 4, &v);
+			bits = (unsigned int) v;
+			memcpy(&f, &bits, sizeof(f));
+			lua_pushnumber(L, f);
+			return;
+		}
+		case PACK_FLOAT64: {
+			double d;
+			unpack_lua_be(L, lu, 8, &v);
+			memcpy(&d, &v, sizeof(d));
+			lua_pushnumber(L, d);
+			return;
+		}
+
+		case PACK_UINT8: unpack_lua_be(L, lu, 1, &v); lua_pushnumber(L, (lua_Number) v); return;
+		case PACK_UINT16: unpack_lua_be(L, lu, 2, &v); lua_pushnumber(L, (lua_Number) v); return;
+		case PACK_UINT32: unpack_lua_be(L, lu, 4, &v); lua_pushnumber(L, (lua_Number) v); return;
+		case PACK_UINT64: unpack_lua_be(L, lu, 8, &v); unpack_lua_integer(L, lu, v, 0); return;
+		case PACK_INT8: unpack_lua_be(L, lu, 1, &v); lua_pushnumber(L, (signed char) v); return;
+		case PACK_INT16: unpack_lua_be(L, lu, 2, &v); lua_pushnumber(L, (short) v); return;
+		case PACK_INT32: unpack_lua_be(L, lu, 4, &v); lua_pushnumber(L, (int) v); return;
+		case PACK_INT64:
+			unpack_lua_be(L, lu, 8, &v);
+			if ((long long) v < 0) unpack_lua_integer(L, lu, 0 - v, 1);
+			else unpack_lua_integer(L, lu, v, 0);
+			return;
+
+		case PACK_ARRAY16: unpack_lua_be(L, lu, 2, &v); unpack_lua_array(L, lu, v, depth); return;
+		case PACK_ARRAY32: unpack_lua_be(L, lu, 4, &v); unpack_lua_array(L, lu, v, depth); return;
+		case PACK_MAP16: unpack_lua_be(L, lu, 2, &v); unpack_lua_map(L, lu, v, depth); return;
+		case PACK_MAP32: unpack_lua_be(L, lu, 4, &v); unpack_lua_map(L, lu, v, depth); return;
+
+		default:
+			PyOS_snprintf(msg, sizeof(msg), "Unsupported type byte 0x%02x.", t);
+			unpack_lua_error(L, lu, PyExc_ValueError, msg);
+	}
+}
+
+/**
+ * lua_CFunction decoding for luabox_unpack_value, storing the result in
+ * the registry.
+ */
+static int unpack_lua_protected(lua_State *L) {
+	LuaUnpacker *lu = (LuaUnpacker*) lua_touserdata(L, 1);
+
+	unpack_lua_object(L, lu, 0);
+	if (lu->u.p != lu->u.end) unpack_lua_malformed(L, lu);
+	lu->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
+/**
+ * Decodes a single value from `len` bytes at `data`, which must be used
+ * up completely, and pushes it. Tables are allocated through the sandbox,
+ * so the memory limit applies. The caller must hold the sandbox lock.
+ *
+ * Returns 1 on success, 0 with a Python exception set.
+ */
+int luabox_unpack_value(Sandbox *self, const char *data, size_t len) {
+	LuaUnpacker lu;
+	int status;
+
+	lu.u.p = (const unsigned char*) data;
+	lu.u.end = lu.u.p + len;
+	lu.lossy_integers = self->lossy_integers;
+	lu.exc = NULL;
+	lu.ref = LUA_NOREF;
+
+	if ((status = lua_cpcall(self->L, unpack_lua_protected, &lu))) {
+		if (LUA_ERRMEM == status) PyErr_SetString(Exc_OutOfMemory, lua_tostring(self->L, -1));
+		else PyErr_SetString(lu.exc ? lu.exc : Exc_LuaBoxException, lua_tostring(self->L, -1));
+		lua_pop(self->L, 1);
+		return 0;
+	}
+
+	lua_rawgeti(self->L, LUA_REGISTRYINDEX, lu.ref);
+	luaL_unref(self->L, LUA_REGISTRYINDEX, lu.ref);
+
+	return 1;
+}
@@ -0,0 +1,586 @@
+/**
+ * Pool of worker processes running scripts in isolated sandboxes.
+ *
+ * A ProcessPool sets up a template Sandbox once (optionally running a
+ * setup script in it), snapshots it, and forks the workers from it. Every
+ * worker inherits the initialized lua state copy-on-write and resets it
+ * to the snapshot after each request.
+ *
+ * Requests and responses are sent over a pair of pipes per worker as
+ * length-prefixed messages in the encoding of pack.c. A worker that dies,
+ * whether by a lua panic or a crash in C code, only fails the request it
+ * was running with WorkerDied; it is replaced by a fresh fork of the
+ * template.
+ *
+ * run() releases the GIL while waiting for a worker, so calls from several
+ * Python threads are processed by several workers in parallel.
+ */
+#include "luaboxmodule.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+PyTypeObject ProcessPoolType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.ProcessPool",               /*tp_name*/
+	sizeof(ProcessPool)                 /*tp_basicsize*/
+
+	/* The other members are initialized in ProcessPoolType_INIT */
+};
+
+/* Exceptions a worker can report, the response status is the index + 1.
+ * Base classes come first, the most specific match is sent. */
+static PyObject **processpool_exceptions[] = {
+	&Exc_LuaBoxException,
+	&Exc_OutOfMemory,
+	&Exc_SyntaxError,
+	&Exc_RuntimeError,
+	&Exc_ErrorError,
+	&Exc_CPULimitExceeded,
+	&Exc_Timeout,
+};
+#define PROCESSPOOL_NUM_EXCEPTIONS ((int) (sizeof(processpool_exceptions) / sizeof(processpool_exceptions[0])))
+
+/* size of the length prefix of a message */
+#define MSG_HEADER 4
+
+/**
+ * Writes all of `len` bytes. Returns 0 on success, -1 on error.
+ */
+static int processpool_write(int fd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		if (-1 == (n = write(fd, buf, len))) {
+			if (EINTR == errno) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads exactly `len` bytes. Returns 1 on success, 0 on end of file and
+ * -1 on error.
+ */
+static int processpool_read(int fd, char *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		if (-1 == (n = read(fd, buf, len))) {
+			if (EINTR == errno) continue;
+			return -1;
+		}
+		if (0 == n) return 0;
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/**
+ * Starts a message in `b`, leaving room for the length prefix.
+ */
+static int processpool_begin(PackBuffer *b) {
+	b->len = 0;
+	if (-1 == pack_reserve(b, MSG_HEADER)) return -1;
+	b->len = MSG_HEADER;
+	return 0;
+}
+
+/**
+ * Fills in the length prefix of the message in `b` and sends it.
+ * Returns 0 on success, -1 on error.
+ */
+static int processpool_send(int fd, PackBuffer *b) {
+	size_t n = b->len - MSG_HEADER;
+	unsigned char *h = (unsigned char*) b->data;
+
+	h[0] = (n >> 24) & 0xff;
+	h[1] = (n >> 16) & 0xff;
+	h[2] = (n >> 8) & 0xff;
+	h[3] = n & 0xff;
+
+	return processpool_write(fd, b->data, b->len);
+}
+
+/**
+ * Receives a message into `b`, without the length prefix. Returns 1 on
+ * success, 0 on end of file and -1 on error.
+ */
+static int processpool_recv(int fd, PackBuffer *b) {
+	unsigned char h[MSG_HEADER];
+	size_t n;
+	int status;
+
+	if (1 != (status = processpool_read(fd, (char*) h, MSG_HEADER))) return status;
+	n = ((size_t) h[0] << 24) | ((size_t) h[1] << 16) | ((size_t) h[2] << 8) | h[3];
+
+	b->len = 0;
+	if (n > b->alloc) {
+		char *data = realloc(b->data, n);
+		if (! data) return -1;
+		b->data = data;
+		b->alloc = n;
+	}
+	if (1 != (status = processpool_read(fd, b->data, n))) return status;
+	b->len = n;
+
+	return 1;
+}
+
+/**
+ * Runs a decoded request [script, args, timeout] in the worker's sandbox
+ * and encodes the response into `b`: [0, results] on success, or
+ * [status, message] for an exception.
+ */
+static void processpool_handle(ProcessPool *self, PyObject *request, PackBuffer *b) {
+	PyObject *sandbox = (PyObject*) self->sandbox;
+	PyObject *rval = NULL, *call = NULL, *args = NULL, *kwds = NULL;
+	PyObject *type, *value, *tb, *str;
+	int status = 0, i;
+
+	if (! request || ! PyList_Check(request) || 3 != PyList_GET_SIZE(request)
+	    || ! PyString_Check(PyList_GET_ITEM(request, 0))) {
+		if (! PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "Malformed request.");
+		goto error;
+	}
+
+	if (! (rval = PyObject_CallMethod(sandbox, "loadstring", "O", PyList_GET_ITEM(request, 0)))) goto error;
+	Py_DECREF(rval);
+
+	if (! (call = PyObject_GetAttrString(sandbox, "call"))) goto error;
+	if (! (args = PySequence_Tuple(PyList_GET_ITEM(request, 1)))) goto error;
+	if (! (kwds = Py_BuildValue("{s:O}", "timeout", PyList_GET_ITEM(request, 2)))) goto error;
+	if (! (rval = PyObject_Call(call, args, kwds))) goto error;
+
+	processpool_begin(b);
+	if (-1 == pack_array_header(b, 2) || -1 == pack_int(b, 0) || -1 == pack_value(b, rval)) {
+		Py_CLEAR(rval);
+		goto error;
+	}
+	Py_CLEAR(rval);
+	goto out;
+
+error:
+	PyErr_Fetch(&type, &value, &tb);
+	PyErr_NormalizeException(&type, &value, &tb);
+	for (i = PROCESSPOOL_NUM_EXCEPTIONS - 1; i >= 0; --i) {
+		if (type && PyErr_GivenExceptionMatches(type, *processpool_exceptions[i])) break;
+	}
+	status = i + 1;
+	if (! status) {
+		/* anything else is reported as LuaBoxException with its name */
+		status = 1;
+		str = PyString_FromFormat("%s: ", type ? ((PyTypeObject*) type)->tp_name : "Exception");
+	} else {
+		str = PyString_FromString("");
+	}
+	if (str && value) PyString_ConcatAndDel(&str, PyObject_Str(value));
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+
+	processpool_begin(b);
+	pack_array_header(b, 2);
+	pack_int(b, status);
+	if (! str || -1 == pack_value(b, str)) {
+		PyErr_Clear();
+		pack_value(b, Py_None);
+	}
+	Py_XDECREF(str);
+
+out:
+	Py_XDECREF(call);
+	Py_XDECREF(args);
+	Py_XDECREF(kwds);
+}
+
+/**
+ * Main loop of a worker process. Never returns.
+ */
+static void processpool_serve(ProcessPool *self, int rfd, int wfd) {
+	PackBuffer in = {NULL, 0, 0}, out = {NULL, 0, 0};
+	PyObject *request, *rval;
+
+	/* interrupts are meant for the parent */
+	signal(SIGINT, SIG_IGN);
+
+	for (;;) {
+		if (1 != processpool_recv(rfd, &in)) _exit(0);
+
+		request = unpack_value(in.data, in.len);
+		processpool_handle(self, request, &out);
+		Py_XDECREF(request);
+		PyErr_Clear();
+
+		if (-1 == processpool_send(wfd, &out)) _exit(1);
+
+		/* back to the template state for the next request */
+		if (! (rval = PyObject_CallMethod((PyObject*) self->sandbox, "reset", NULL))) _exit(1);
+		Py_DECREF(rval);
+	}
+}
+
+/**
+ * Forks worker `i` from the template sandbox.
+ *
+ * Returns 0 on success, -1 with a Python exception set.
+ */
+static int processpool_spawn(ProcessPool *self, int i) {
+	PoolWorker *w = &self->workers[i];
+	int req[2], res[2], j;
+	pid_t pid;
+
+	if (-1 == pipe(req)) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	if (-1 == pipe(res)) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		close(req[0]);
+		close(req[1]);
+		return -1;
+	}
+
+	if (-1 == (pid = fork())) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		close(req[0]);
+		close(req[1]);
+		close(res[0]);
+		close(res[1]);
+		return -1;
+	}
+
+	if (0 == pid) {
+		PyOS_AfterFork();
+		close(req[1]);
+		close(res[0]);
+		/* the other workers must see end of file when the parent goes */
+		for (j = 0; j < self->nworkers; ++j) {
+			if (-1 != self->workers[j].rfd) close(self->workers[j].rfd);
+			if (-1 != self->workers[j].wfd) close(self->workers[j].wfd);
+		}
+		processpool_serve(self, req[0], res[1]);
+	}
+
+	close(req[0]);
+	close(res[1]);
+	fcntl(req[1], F_SETFD, FD_CLOEXEC);
+	fcntl(res[0], F_SETFD, FD_CLOEXEC);
+
+	w->pid = pid;
+	w->wfd = req[1];
+	w->rfd = res[0];
+	++self->spawned;
+
+	return 0;
+}
+
+/**
+ * Terminates worker `i`, if it is running, and waits for it.
+ */
+static void processpool_reap(ProcessPool *self, int i, int kill_it) {
+	PoolWorker *w = &self->workers[i];
+
+	if (-1 != w->wfd) close(w->wfd);
+	if (-1 != w->rfd) close(w->rfd);
+	w->wfd = w->rfd = -1;
+
+	if (w->pid) {
+		if (kill_it) kill(w->pid, SIGKILL);
+		Py_BEGIN_ALLOW_THREADS
+		while (-1 == waitpid(w->pid, NULL, 0) && EINTR == errno);
+		Py_END_ALLOW_THREADS
+		w->pid = 0;
+	}
+}
+
+/**
+ * Stops all workers.
+ */
+static void processpool_close(ProcessPool *self) {
+	int i;
+
+	if (! self->workers) return;
+
+	/* closing the pipes makes idle workers exit */
+	for (i = 0; i < self->nworkers; ++i) processpool_reap(self, i, 0);
+	for (i = 0; i < self->nworkers; ++i) {
+		if (self->workers[i].lock) PyThread_free_lock(self->workers[i].lock);
+	}
+
+	free(self->workers);
+	self->workers = NULL;
+}
+
+static void ProcessPool_dealloc(ProcessPool *self) {
+	processpool_close(self);
+	Py_XDECREF(self->sandbox);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/**
+ * new-function for Python object.
+ *
+ * \param workers The number of worker processes.
+ * \param setup Lua code run once in the template sandbox, before the
+ *              workers are forked.
+ *
+ * All other keyword arguments are passed on to Sandbox().
+ *
+ * Python signature: ProcessPool(workers, setup=None, **sandbox_kwargs)
+ */
+static PyObject* ProcessPool_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	ProcessPool *self = (ProcessPool*) type->tp_alloc(type, 0);
+	PyObject *sandbox_kwds = NULL, *workers = NULL, *setup = NULL, *noargs = NULL, *rval;
+	int i;
+
+	if (! self) return NULL;
+	self->workers = NULL;
+
+	/* workers and setup are taken out, everything else is for the sandbox */
+	if (! (sandbox_kwds = kwds ? PyDict_Copy(kwds) : PyDict_New())) goto error;
+	if (! PyArg_ParseTuple(args, "|OO", &workers, &setup)) goto error;
+	if (! workers && (workers = PyDict_GetItemString(sandbox_kwds, "workers"))) {
+		Py_INCREF(workers);
+		PyDict_DelItemString(sandbox_kwds, "workers");
+	} else {
+		Py_XINCREF(workers);
+	}
+	if (! setup && (setup = PyDict_GetItemString(sandbox_kwds, "setup"))) {
+		Py_INCREF(setup);
+		PyDict_DelItemString(sandbox_kwds, "setup");
+	} else {
+		Py_XINCREF(setup);
+	}
+
+	if (! workers || ! PyInt_Check(workers) || 0 >= PyInt_AS_LONG(workers) || INT_MAX < PyInt_AS_LONG(workers)) {
+		PyErr_SetString(PyExc_ValueError, "ProcessPool requires a positive number of workers.");
+		goto error;
+	}
+	self->nworkers = (int) PyInt_AS_LONG(workers);
+
+	/* the template */
+	if (! (noargs = PyTuple_New(0))) goto error;
+	if (! (self->sandbox = (Sandbox*) PyObject_Call((PyObject*) &SandboxType, noargs, sandbox_kwds))) goto error;
+	if (setup && Py_None != setup) {
+		if (! (rval = PyObject_CallMethod((PyObject*) self->sandbox, "loadstring", "O", setup))) goto error;
+		Py_DECREF(rval);
+		if (! (rval = PyObject_CallMethod((PyObject*) self->sandbox, "call", NULL))) goto error;
+		Py_DECREF(rval);
+	}
+	if (! (rval = PyObject_CallMethod((PyObject*) self->sandbox, "snapshot", NULL))) goto error;
+	Py_DECREF(rval);
+
+	if (! (self->workers = calloc(self->nworkers, sizeof(PoolWorker)))) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	for (i = 0; i < self->nworkers; ++i) {
+		self->workers[i].rfd = self->workers[i].wfd = -1;
+	}
+	for (i = 0; i < self->nworkers; ++i) {
+		if (! (self->workers[i].lock = PyThread_allocate_lock())) {
+			PyErr_NoMemory();
+			goto error;
+		}
+		if (-1 == processpool_spawn(self, i)) goto error;
+	}
+
+	Py_DECREF(sandbox_kwds);
+	Py_DECREF(workers);
+	Py_XDECREF(setup);
+	Py_DECREF(noargs);
+	return (PyObject*) self;
+
+error:
+	Py_XDECREF(sandbox_kwds);
+	Py_XDECREF(workers);
+	Py_XDECREF(setup);
+	Py_XDECREF(noargs);
+	Py_DECREF(self);
+	return NULL;
+}
+
+/**
+ * Picks a worker and locks it, preferring idle ones. Waits without the
+ * GIL if all are busy.
+ */
+static int processpool_acquire(ProcessPool *self) {
+	int i, n = self->nworkers, start = self->next++ % n;
+
+	for (i = 0; i < n; ++i) {
+		if (PyThread_acquire_lock(self->workers[(start + i) % n].lock, NOWAIT_LOCK)) return (start + i) % n;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->workers[start].lock, WAIT_LOCK);
+	Py_END_ALLOW_THREADS
+
+	return start;
+}
+
+/**
+ * Run a script in a worker and return its results.
+ *
+ * The script is called with the given arguments, which are converted like
+ * by Sandbox.call(). Tables in the results are returned as lists and
+ * dicts. Errors are raised as the same exceptions a Sandbox would raise;
+ * WorkerDied is raised if the worker process died.
+ *
+ * Python signature: run(script, *args, timeout=0)
+ */
+static PyObject* ProcessPool_run(ProcessPool *self, PyObject *args, PyObject *kwds) {
+	PyObject *script, *timeout = NULL, *request = NULL, *response = NULL, *rval = NULL;
+	PackBuffer b = {NULL, 0, 0};
+	PoolWorker *w;
+	long status;
+	int i, io;
+
+	if (! self->workers) {
+		PyErr_SetString(PyExc_ValueError, "ProcessPool is closed.");
+		return NULL;
+	}
+
+	if (1 > PyTuple_GET_SIZE(args) || ! PyString_Check(script = PyTuple_GET_ITEM(args, 0))) {
+		PyErr_SetString(PyExc_TypeError, "run() requires a script string.");
+		return NULL;
+	}
+	if (kwds && PyDict_Size(kwds)) {
+		if (1 != PyDict_Size(kwds) || ! (timeout = PyDict_GetItemString(kwds, "timeout"))) {
+			PyErr_SetString(PyExc_TypeError, "run() only accepts the keyword argument timeout.");
+			return NULL;
+		}
+	}
+
+	/* [script, args, timeout] */
+	if (! (request = PyTuple_New(3))) return NULL;
+	Py_INCREF(script);
+	PyTuple_SET_ITEM(request, 0, script);
+	PyTuple_SET_ITEM(request, 1, PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args)));
+	PyTuple_SET_ITEM(request, 2, timeout ? PyNumber_Float(timeout) : PyFloat_FromDouble(0));
+	if (! PyTuple_GET_ITEM(request, 1) || ! PyTuple_GET_ITEM(request, 2)
+	    || -1 == processpool_begin(&b) || -1 == pack_value(&b, request)) goto out;
+
+	i = processpool_acquire(self);
+	w = &self->workers[i];
+	++self->requests;
+
+	/* replace a worker that died while idle before sending it anything */
+	if (w->pid && w->pid == waitpid(w->pid, NULL, WNOHANG)) {
+		++self->deaths;
+		w->pid = 0;
+		processpool_reap(self, i, 0);
+	}
+
+	/* the worker may have died earlier and failed to respawn */
+	if (! w->pid && -1 == processpool_spawn(self, i)) {
+		PyThread_release_lock(w->lock);
+		goto out;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	io = processpool_send(w->wfd, &b);
+	if (-1 != io) io = processpool_recv(w->rfd, &b);
+	Py_END_ALLOW_THREADS
+
+	if (1 != io) {
+		/* worker is gone, replace it */
+		++self->deaths;
+		processpool_reap(self, i, 1);
+		if (-1 == processpool_spawn(self, i)) PyErr_Clear();
+		PyThread_release_lock(w->lock);
+		PyErr_SetString(Exc_WorkerDied, "Worker process died while running the script.");
+		goto out;
+	}
+	PyThread_release_lock(w->lock);
+
+	if (! (response = unpack_value(b.data, b.len))) goto out;
+	if (! PyList_Check(response) || 2 != PyList_GET_SIZE(response) || ! PyInt_Check(PyList_GET_ITEM(response, 0))) {
+		PyErr_SetString(Exc_LuaBoxException, "Malformed response from worker.");
+		goto out;
+	}
+
+	status = PyInt_AS_LONG(PyList_GET_ITEM(response, 0));
+	if (0 == status) {
+		rval = PySequence_Tuple(PyList_GET_ITEM(response, 1));
+	} else if (0 < status && status <= PROCESSPOOL_NUM_EXCEPTIONS) {
+		PyErr_SetObject(*processpool_exceptions[status - 1], PyList_GET_ITEM(response, 1));
+	} else {
+		PyErr_SetString(Exc_LuaBoxException, "Malformed response from worker.");
+	}
+
+out:
+	pack_free(&b);
+	Py_XDECREF(request);
+	Py_XDECREF(response);
+	return rval;
+}
+
+/**
+ * Stop all worker processes. The pool cannot be used afterwards.
+ *
+ * Python signature: close()
+ */
+static PyObject* ProcessPool_close(ProcessPool *self, PyObject *args) {
+	int i;
+
+	if (self->workers) {
+		/* wait for running requests */
+		for (i = 0; i < self->nworkers; ++i) {
+			Py_BEGIN_ALLOW_THREADS
+			PyThread_acquire_lock(self->workers[i].lock, WAIT_LOCK);
+			Py_END_ALLOW_THREADS
+		}
+		/* locks are freed by processpool_close, which expects them released */
+		for (i = 0; i < self->nworkers; ++i) PyThread_release_lock(self->workers[i].lock);
+		processpool_close(self);
+	}
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Returns a dict with pool statistics.
+ *
+ * Python signature: stats()
+ */
+static PyObject* ProcessPool_stats(ProcessPool *self, PyObject *args) {
+	return Py_BuildValue("{s:i,s:k,s:k,s:k}",
+	                     "workers", self->workers ? self->nworkers : 0,
+	                     "spawned", self->spawned,
+	                     "requests", self->requests,
+	                     "deaths", self->deaths);
+}
+
+/**
+ * ProcessPool methods.
+ */
+static PyMethodDef ProcessPool_methods[] = {
+	{"run", SUPPRESS_PYMCFUNCTION_WARNINGS ProcessPool_run, METH_VARARGS | METH_KEYWORDS, "run a script with arguments in a worker process"},
+	{"close", SUPPRESS_PYMCFUNCTION_WARNINGS ProcessPool_close, METH_NOARGS, "stop all worker processes"},
+	{"stats", SUPPRESS_PYMCFUNCTION_WARNINGS ProcessPool_stats, METH_NOARGS, "return request and worker statistics"},
+	{NULL}
+};
+
+/**
+ * INIT-function for ProcessPool type.
+ */
+void ProcessPoolType_INIT(PyTypeObject *t) {
+	t->tp_dealloc = (destructor)ProcessPool_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+	t->tp_doc = "Pool of worker processes forked from an initialized sandbox.";
+	t->tp_methods = ProcessPool_methods;
+	t->tp_new = ProcessPool_new;
+
+	if(PyType_Ready(t) < 0) return;
+}
@@ -0,0 +1,420 @@
+/**
+ * Sampling profiler for lua code run by pcall.
+ *
+ * While profiling, the count hook of the sandbox (see lua_sandbox_hook)
+ * takes a sample each time it fires: it walks the stack with lua_getinfo
+ * and adds the number of instructions since the previous sample to the
+ * stack, and to the current line of the innermost function. Everything is
+ * aggregated in C, without the GIL, into hash maps of bounded size;
+ * samples that do not fit anymore are counted as dropped.
+ *
+ * The overhead is bounded by the sampling interval (in instructions), the
+ * maximum stack depth walked, and the fraction of pcalls that are
+ * profiled at all.
+ */
+#include "luaboxmodule.h"
+
+/* upper bounds */
+#define PROFILER_MAX_DEPTH 256
+#define PROFILER_MAX_ENTRIES 65536
+
+/* maximum length of a frame name */
+#define PROFILER_NAME_SIZE 128
+
+typedef struct {
+	char *key;
+	size_t len;
+	unsigned int hash;
+	unsigned long long weight;
+} ProfileEntry;
+
+/**
+ * Map from byte strings to weights, with open addressing. The index of an
+ * entry never changes, so it can serve as an id.
+ */
+typedef struct {
+	ProfileEntry *entries;
+	int count;
+	int alloc;
+	int *slots;     /* entry index + 1, 0 if empty */
+	int size;       /* number of slots, a power of two */
+} ProfileMap;
+
+struct Profiler {
+	int interval;
+	int max_depth;
+	double rate;
+	double credit;
+	unsigned long calls;
+	unsigned long samples;
+	unsigned long dropped;
+	unsigned long long instructions;
+	ProfileMap frames;   /* frame name -> id */
+	ProfileMap stacks;   /* frame ids, innermost first -> weight */
+	ProfileMap lines;    /* (frame id, line) -> weight */
+};
+
+typedef struct {
+	int frame;
+	int line;
+} ProfileLine;
+
+/* FNV-1a */
+static unsigned int profile_hash(const char *key, size_t len) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; ++i) h = (h ^ (unsigned char) key[i]) * 16777619u;
+	return h;
+}
+
+static void profile_map_free(ProfileMap *m) {
+	int i;
+
+	for (i = 0; i < m->count; ++i) free(m->entries[i].key);
+	free(m->entries);
+	free(m->slots);
+	memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Doubles the number of slots and rehashes. Returns 0 if out of memory.
+ */
+static int profile_map_grow(ProfileMap *m) {
+	int size = m->size ? m->size * 2 : 64, i, j;
+	int *slots = calloc(size, sizeof(int));
+
+	if (! slots) return 0;
+	for (i = 0; i < m->count; ++i) {
+		for (j = m->entries[i].hash & (size - 1); slots[j]; j = (j + 1) & (size - 1));
+		slots[j] = i + 1;
+	}
+
+	free(m->slots);
+	m->slots = slots;
+	m->size = size;
+	return 1;
+}
+
+/**
+ * Returns the id of the entry for `key`, adding it if needed, or -1 if
+ * the map is full or out of memory.
+ */
+static int profile_map_get(ProfileMap *m, const char *key, size_t len) {
+	unsigned int hash = profile_hash(key, len);
+	ProfileEntry *e, *entries;
+	int i, alloc;
+
+	if (m->size) {
+		for (i = hash & (m->size - 1); m->slots[i]; i = (i + 1) & (m->size - 1)) {
+			e = &m->entries[m->slots[i] - 1];
+			if (e->hash == hash && e->len == len && 0 == memcmp(e->key, key, len)) return m->slots[i] - 1;
+		}
+	}
+
+	if (PROFILER_MAX_ENTRIES == m->count) return -1;
+	if (2 * (m->count + 1) > m->size && ! profile_map_grow(m)) return -1;
+
+	if (m->count == m->alloc) {
+		alloc = m->alloc ? m->alloc * 2 : 32;
+		if (! (entries = realloc(m->entries, alloc * sizeof(ProfileEntry)))) return -1;
+		m->entries = entries;
+		m->alloc = alloc;
+	}
+
+	e = &m->entries[m->count];
+	if (! (e->key = malloc(len ? len : 1))) return -1;
+	memcpy(e->key, key, len);
+	e->len = len;
+	e->hash = hash;
+	e->weight = 0;
+
+	for (i = hash & (m->size - 1); m->slots[i]; i = (i + 1) & (m->size - 1));
+	m->slots[i] = ++m->count;
+
+	return m->count - 1;
+}
+
+/**
+ * Writes a name for the function of `ar` to `out`. ';' is used to
+ * separate frames in folded stacks, so it is replaced.
+ */
+static void profiler_frame_name(lua_Debug *ar, char *out) {
+	const char *name = ar->name ? ar->name : "?";
+	char *p;
+
+	if ('C' == ar->what[0]) PyOS_snprintf(out, PROFILER_NAME_SIZE, "%s [C]", name);
+	else if ('m' == ar->what[0]) PyOS_snprintf(out, PROFILER_NAME_SIZE, "main chunk %s", ar->short_src);
+	else PyOS_snprintf(out, PROFILER_NAME_SIZE, "%s %s:%d", name, ar->short_src, ar->linedefined);
+
+	for (p = out; (p = strchr(p, ';')); ++p) *p = ',';
+}
+
+/**
+ * Records a sample of the stack of `L`, weighted with the number of
+ * instructions since the previous one. Called from the count hook.
+ */
+void profiler_sample(Profiler *p, lua_State *L, int weight) {
+	char name[PROFILER_NAME_SIZE];
+	int stack[PROFILER_MAX_DEPTH];
+	int level, depth = 0, id;
+	ProfileLine line;
+	lua_Debug ar;
+
+	++p->samples;
+	p->instructions += weight;
+	line.line = -1;
+
+	for (level = 0; depth < p->max_depth && lua_getstack(L, level, &ar); ++level) {
+		if (! lua_getinfo(L, "Snl", &ar)) break;
+
+		profiler_frame_name(&ar, name);
+		if (-1 == (id = profile_map_get(&p->frames, name, strlen(name)))) goto drop;
+		if (! depth) line.line = ar.currentline;
+		stack[depth++] = id;
+	}
+	if (! depth) goto drop;
+
+	if (-1 == (id = profile_map_get(&p->stacks, (const char*) stack, depth * sizeof(int)))) goto drop;
+	p->stacks.entries[id].weight += weight;
+
+	line.frame = stack[0];
+	if (-1 != (id = profile_map_get(&p->lines, (const char*) &line, sizeof(line)))) {
+		p->lines.entries[id].weight += weight;
+	}
+	return;
+
+drop:
+	++p->dropped;
+}
+
+/**
+ * Called at the start of an outermost pcall. Returns nonzero if the call
+ * is to be profiled, for `rate` of all calls.
+ */
+int profiler_begin(Profiler *p) {
+	p->credit += p->rate;
+	if (p->credit < 1) return 0;
+
+	p->credit -= 1;
+	++p->calls;
+	return 1;
+}
+
+/**
+ * Maximum number of instructions between two samples.
+ */
+int profiler_interval(Profiler *p) {
+	return p->interval;
+}
+
+void profiler_free(Profiler *p) {
+	if (! p) return;
+
+	profile_map_free(&p->frames);
+	profile_map_free(&p->stacks);
+	profile_map_free(&p->lines);
+	free(p);
+}
+
+/**
+ * Start profiling, discarding earlier results. The caller must hold the
+ * sandbox lock.
+ *
+ * Returns 0 on success, -1 with a Python exception set.
+ */
+int luabox_profiler_start(Sandbox *self, int interval, double rate, int max_depth) {
+	Profiler *p;
+
+	if (interval < 1) {
+		PyErr_SetString(PyExc_ValueError, "Interval must be a positive integer.");
+		return -1;
+	}
+	if (! (rate >= 0 && rate <= 1)) {
+		PyErr_SetString(PyExc_ValueError, "Rate must be between 0 and 1.");
+		return -1;
+	}
+	if (max_depth < 1 || max_depth > PROFILER_MAX_DEPTH) {
+		PyErr_Format(PyExc_ValueError, "Maximum depth must be between 1 and %d.", PROFILER_MAX_DEPTH);
+		return -1;
+	}
+
+	if (! (p = calloc(1, sizeof(Profiler)))) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	p->interval = interval;
+	p->rate = rate;
+	p->max_depth = max_depth;
+
+	profiler_free(self->profiler);
+	self->profiler = p;
+	return 0;
+}
+
+/**
+ * Stop profiling further pcalls. The results stay available.
+ */
+void luabox_profiler_stop(Sandbox *self) {
+	if (self->profiler) self->profiler->rate = 0;
+}
+
+/**
+ * Adds `weight` to the value of `key` in `dict`.
+ */
+static int profiler_add(PyObject *dict, PyObject *key, unsigned long long weight) {
+	PyObject *old = PyDict_GetItem(dict, key), *sum, *w;
+	int rval;
+
+	if (! (w = PyLong_FromUnsignedLongLong(weight))) return -1;
+	if (old) {
+		sum = PyNumber_Add(old, w);
+		Py_DECREF(w);
+		if (! sum) return -1;
+	} else sum = w;
+
+	rval = PyDict_SetItem(dict, key, sum);
+	Py_DECREF(sum);
+	return rval;
+}
+
+/**
+ * Returns the flat profile as a dict. The caller must hold the sandbox
+ * lock.
+ *
+ * `functions` maps each function to a tuple of its self and total weight,
+ * i.e. the instructions sampled while it was the innermost function, and
+ * while it was on the stack at all. `lines` maps (function, line) tuples
+ * to the instructions sampled there. `samples`, `instructions`, `calls`
+ * (profiled pcalls) and `dropped` (samples that did not fit) describe the
+ * whole profile.
+ */
+PyObject *luabox_profiler_stats(Sandbox *self) {
+	PyObject *rval = NULL, *names = NULL, *functions = NULL, *lines = NULL;
+	PyObject *name, *key, *pair;
+	Profiler *p = self->profiler;
+	unsigned long long *self_w = NULL, *total = NULL;
+	ProfileEntry *e;
+	ProfileLine line;
+	const int *stack;
+	int i, j, k, depth, status;
+
+	if (! p) {
+		PyErr_SetString(Exc_LuaBoxException, "The profiler was not started.");
+		return NULL;
+	}
+
+	/* per frame sums first, frame ids index these */
+	self_w = calloc(p->frames.count + 1, sizeof(unsigned long long));
+	total = calloc(p->frames.count + 1, sizeof(unsigned long long));
+	if (! self_w || ! total) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < p->stacks.count; ++i) {
+		e = &p->stacks.entries[i];
+		stack = (const int*) e->key;
+		depth = (int) (e->len / sizeof(int));
+
+		self_w[stack[0]] += e->weight;
+		/* recursive functions count once per sample */
+		for (j = 0; j < depth; ++j) {
+			for (k = 0; k < j && stack[k] != stack[j]; ++k);
+			if (k == j) total[stack[j]] += e->weight;
+		}
+	}
+
+	if (! (names = PyList_New(p->frames.count))) goto out;
+	if (! (functions = PyDict_New()) || ! (lines = PyDict_New())) goto out;
+
+	for (i = 0; i < p->frames.count; ++i) {
+		e = &p->frames.entries[i];
+		if (! (name = PyString_FromStringAndSize(e->key, e->len))) goto out;
+		PyList_SET_ITEM(names, i, name);
+
+		if (! total[i]) continue;
+		if (! (pair = Py_BuildValue("(KK)", self_w[i], total[i]))) goto out;
+		status = PyDict_SetItem(functions, name, pair);
+		Py_DECREF(pair);
+		if (-1 == status) goto out;
+	}
+
+	for (i = 0; i < p->lines.count; ++i) {
+		e = &p->lines.entries[i];
+		memcpy(&line, e->key, sizeof(line));
+		if (! (key = Py_BuildValue("(Oi)", PyList_GET_ITEM(names, line.frame), line.line))) goto out;
+		status = profiler_add(lines, key, e->weight);
+		Py_DECREF(key);
+		if (-1 == status) goto out;
+	}
+
+	rval = Py_BuildValue("{s:O,s:O,s:k,s:K,s:k,s:k}",
+		"functions", functions,
+		"lines", lines,
+		"samples", p->samples,
+		"instructions", p->instructions,
+		"calls", p->calls,
+		"dropped", p->dropped);
+
+out:
+	free(self_w);
+	free(total);
+	Py_XDECREF(names);
+	Py_XDECREF(functions);
+	Py_XDECREF(lines);
+	return rval;
+}
+
+/**
+ * Returns the sampled stacks in the folded format used by flamegraph
+ * tools: one string per stack, with the frames from the outermost to the
+ * innermost separated by ';', followed by a space and the weight. The
+ * caller must hold the sandbox lock.
+ */
+PyObject *luabox_profiler_folded(Sandbox *self) {
+	PyObject *rval, *line;
+	PackBuffer b = {NULL, 0, 0};
+	Profiler *p = self->profiler;
+	ProfileEntry *e, *frame;
+	char weight[32];
+	const int *stack;
+	int i, j, depth;
+	size_t n;
+
+	if (! p) {
+		PyErr_SetString(Exc_LuaBoxException, "The profiler was not started.");
+		return NULL;
+	}
+
+	if (! (rval = PyList_New(p->stacks.count))) return NULL;
+
+	for (i = 0; i < p->stacks.count; ++i) {
+		e = &p->stacks.entries[i];
+		stack = (const int*) e->key;
+		depth = (int) (e->len / sizeof(int));
+		PyOS_snprintf(weight, sizeof(weight), " %llu", e->weight);
+
+		b.len = 0;
+		for (j = depth - 1; j >= 0; --j) {
+			frame = &p->frames.entries[stack[j]];
+			n = frame->len + (j ? 1 : strlen(weight));
+			if (-1 == pack_reserve(&b, n)) goto error;
+			memcpy(b.data + b.len, frame->key, frame->len);
+			if (j) b.data[b.len + frame->len] = ';';
+			else memcpy(b.data + b.len + frame->len, weight, strlen(weight));
+			b.len += n;
+		}
+
+		if (! (line = PyString_FromStringAndSize(b.data, b.len))) goto error;
+		PyList_SET_ITEM(rval, i, line);
+	}
+
+	pack_free(&b);
+	return rval;
+
+error:
+	pack_free(&b);
+	Py_DECREF(rval);
+	return NULL;
+}
@@ -12,6 +12,10 @@
  * that allows defining bounds on how much memory the lua interpreter
  * may allocate for a specific lua_State instance. This is configurable
  * as the memory_limit parameter.
+ *
+ * CPU usage is bounded by counting executed VM instructions using a count
+ * hook, see cpu_limit. The same hook enforces the wall-clock timeout of
+ * pcall() and call().
  */
 #include "luaboxmodule.h"
 
@@ -24,8 +28,122 @@ PyTypeObject SandboxType = {
 	/* The other members are initialized in SandboxType_INIT */
 };
 
+/* Default number of instructions between two checks of the cpu limit. */
+#define LUABOX_CPU_GRANULARITY 1000
+
+/* Targeted time in seconds between two clock reads while a deadline is
+ * set, and bounds for the adaptive hook interval. */
+#define LUABOX_CLOCK_INTERVAL 0.001
+#define LUABOX_HOOK_MIN 100
+#define LUABOX_HOOK_MAX (1 << 20)
+
+/* While a deadline is set, the clock is also read by the allocator once
+ * per this many bytes allocated. */
+#define LUABOX_ALLOC_CHECK (64 * 1024)
+
+/* Default number of instructions a call into Python is charged with. */
+#define LUABOX_CALLBACK_COST 100
+
+/* With emergency_gc, a full collection is requested once memory use gets
+ * within 1/LUABOX_GC_HEADROOM of memory_limit. */
+#define LUABOX_GC_HEADROOM 8
+
+/* Collector settings of the gc_policy presets. The incremental ones are
+ * lua's defaults. */
+#define LUABOX_GC_INCREMENTAL_PAUSE 200
+#define LUABOX_GC_INCREMENTAL_STEPMUL 200
+#define LUABOX_GC_GENERATIONAL_PAUSE 100
+#define LUABOX_GC_GENERATIONAL_STEPMUL 400
+
+/* Default limit on the encoded size in dump_value(). */
+#define LUABOX_DUMP_MAX_SIZE (64 * 1024 * 1024)
+
+/* Defaults for start_profiler(). */
+#define LUABOX_PROFILER_INTERVAL 10000
+#define LUABOX_PROFILER_DEPTH 32
+
 /* Forward declarations, as we don't use a sandbox.h header file. */
 static int Sandbox_setmemory_limit(Sandbox *self, PyObject *value, void *closure);
+static int Sandbox_setcpu_limit(Sandbox *self, PyObject *value, void *closure);
+
+/**
+ * Histogram bucket for an allocation of `size` bytes.
+ */
+static inline int memstats_bucket(size_t size) {
+	int bucket;
+
+	if (size <= 16) return 0;
+#ifdef __GNUC__
+	bucket = (int) (sizeof(unsigned long)*8 - __builtin_clzl((unsigned long) size-1)) - 4;
+#else
+	for (bucket = 0, --size; size >> (bucket+4); ++bucket);
+#endif
+	return bucket < MEMSTATS_BUCKETS ? bucket : MEMSTATS_BUCKETS-1;
+}
+
+/**
+ * Requests a full collection once memory use, now `mem`, gets close to
+ * the limit.
+ *
+ * Much of the counted memory may be garbage the incremental collector has
+ * not reached yet, but lua 5.1 cannot collect from within the allocator.
+ * So with `emergency_gc`, while a pcall runs, the count hook is set to
+ * fire after the next instruction once memory use crosses the last
+ * 1/LUABOX_GC_HEADROOM of the limit, and runs a full collection there
+ * (see lua_sandbox_emergency_gc). The limit itself is never exceeded.
+ *
+ * Only sets fields of the lua_State, so it is safe to call from the
+ * allocator.
+ */
+static void lua_sandbox_request_gc(Sandbox *box, size_t mem) {
+	size_t threshold = box->lua_max_mem - box->lua_max_mem / LUABOX_GC_HEADROOM;
+
+	if (box->gc_pending || ! box->pcall_depth || box->coroutine || box->closing) return;
+	if (box->gc_threshold > threshold) threshold = box->gc_threshold;
+	if (mem <= threshold) return;
+
+	box->gc_pending = 1;
+	lua_sethook(box->L, lua_sandbox_hook, LUA_MASKCOUNT, 1);
+}
+
+/**
+ * Runs the full collection requested by lua_sandbox_request_gc and puts
+ * back the regular count hook. Must be called from the hook, so that
+ * errors raised by finalizers are caught by the running pcall.
+ *
+ * If much of the memory is still in use afterwards, the next collection
+ * is only requested once another 1/(2*LUABOX_GC_HEADROOM) of the limit
+ * was allocated, so that each collection is paid for by allocations.
+ */
+static void lua_sandbox_emergency_gc(Sandbox *box) {
+	++box->memstats.emergency_gcs;
+
+	if (box->cpu_limit || box->deadline || box->profiling) lua_sethook(box->L, lua_sandbox_hook, LUA_MASKCOUNT, box->hook_count);
+	else lua_sethook(box->L, NULL, 0, 0);
+
+	/* still pending while finalizers allocate, so they request nothing */
+	lua_gc(box->L, LUA_GCCOLLECT, 0);
+	box->gc_pending = 0;
+	box->gc_threshold = box->lua_current_mem + box->lua_max_mem / (2 * LUABOX_GC_HEADROOM);
+}
+
+/**
+ * Checks the deadline of the running pcall from the allocator, for C
+ * functions that run long without reaching the count hook, e.g. building
+ * a huge string with string.rep. Once the deadline has passed, all
+ * allocations are denied.
+ */
+static int lua_sandbox_past_deadline(Sandbox *box, size_t size) {
+	if (box->timed_out) return 1;
+
+	box->alloc_since_check += size;
+	if (box->alloc_since_check < LUABOX_ALLOC_CHECK) return 0;
+	box->alloc_since_check = 0;
+
+	if (luabox_monotonic() < box->deadline) return 0;
+	box->timed_out = 1;
+	return 1;
+}
 
 /**
  * Memory allocator for lua, that enforces a hard memory limit.
@@ -34,6 +152,16 @@ static int Sandbox_setmemory_limit(Sandbox *self, PyObject *value, void *closure
  *           `lua_max_mem` property will be used as the maximum allowed
  *           allocated memory size in bytes.
  *
+ * If the sandbox has a MemPool, memory is taken from the pool instead of
+ * realloc(). Accounting is done on the sizes requested by lua in both
+ * cases.
+ *
+ * Also keeps the sandbox's MemStats up to date, and denies allocations
+ * once the deadline of the running pcall has passed.
+ *
+ * Close to the limit, a full collection may be requested, see
+ * lua_sandbox_request_gc.
+ *
  * For other parameters, see the documentation of lua_Alloc.
  */
 static void *lua_sandbox_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
@@ -43,28 +171,205 @@ static void *lua_sandbox_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 	size_t newmem_size = nsize-osize;
 //	printf("current limit: %lu\n", box->lua_max_mem);
 	if (nsize == 0) {
+		if (ptr) ++box->memstats.frees;
+
 		/* a free is always allowed */
-		free(ptr);
+		if (box->pool) {
+			/* when closing, the whole pool is released afterwards */
+			if (! box->closing) mempool_realloc(box->pool, ptr, osize, 0);
+		} else free(ptr);
 		nptr = NULL;
 	} else {
+		if (0 < box->deadline && lua_sandbox_past_deadline(box, nsize)) {
+			++box->memstats.denied;
+			return NULL;
+		}
+
 		/* check if we are allowed to consume that much memory */
 		if (0 != box->lua_max_mem && box->lua_max_mem < box->lua_current_mem+newmem_size) {
 			/* too much memory used! */
 //			printf("Memory denied! Would-be size: %ld\n", box->lua_current_mem+newmem_size);
 
+			++box->memstats.denied;
 			return NULL;
 		} else {
 			/* all good, allocate */
-			nptr = realloc(ptr, nsize);
+			if (box->pool) nptr = mempool_realloc(box->pool, ptr, osize, nsize);
+			else nptr = realloc(ptr, nsize);
+
+			/* failed allocations do not count */
+			if (! nptr) {
+				++box->memstats.denied;
+				return NULL;
+			}
 		}
+
+		if (box->emergency_gc && 0 != box->lua_max_mem && nsize > osize) lua_sandbox_request_gc(box, box->lua_current_mem+newmem_size);
+
+		if (ptr) ++box->memstats.reallocs;
+		else ++box->memstats.allocs;
+		++box->memstats.histogram[memstats_bucket(nsize)];
 	}
 
 	/* update memory count */
 	box->lua_current_mem += newmem_size;
+	if (box->lua_current_mem > box->memstats.peak) box->memstats.peak = box->lua_current_mem;
 //	printf("memory usage now: %lu\n", box->lua_current_mem);
 	return nptr;
 }
 
+/**
+ * __gc metamethod of the garbage collection sentinel.
+ *
+ * Lua has no hook for finished collection cycles. Instead, an unreachable
+ * userdata with this finalizer is kept around; it is collected once per
+ * cycle, counts the cycle and creates its own successor.
+ */
+static int lua_sandbox_gc_sentinel(lua_State *L) {
+	Sandbox *box;
+	lua_getallocf(L, (void**) &box);
+
+	++box->memstats.gc_cycles;
+
+	if (! box->closing) {
+		lua_newuserdata(L, 1);
+		luaL_getmetatable(L, "luabox.gcsentinel");
+		lua_setmetatable(L, -2);
+		lua_pop(L, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * lua_CFunction creating the first garbage collection sentinel.
+ */
+static int lua_sandbox_gc_sentinel_init(lua_State *L) {
+	luaL_newmetatable(L, "luabox.gcsentinel");
+	lua_pushcfunction(L, lua_sandbox_gc_sentinel);
+	lua_setfield(L, -2, "__gc");
+
+	lua_newuserdata(L, 1);
+	lua_insert(L, -2);
+	lua_setmetatable(L, -2);
+
+	return 0;
+}
+
+/**
+ * Raises the error for the exceeded cpu limit or deadline in `L`.
+ *
+ * Lua code may catch the error with pcall, so from now on the hook fires
+ * after every instruction and raises it again (see lua_sandbox_hook),
+ * until the flags are reset by the next outermost call.
+ */
+void lua_sandbox_limit_error(lua_State *L, Sandbox *box) {
+	lua_Hook hook = lua_gethook(L);
+
+	box->hook_count = 1;
+	lua_sethook(L, hook ? hook : lua_sandbox_hook, LUA_MASKCOUNT, 1);
+	luaL_error(L, box->cpu_exceeded ? "CPU limit exceeded." : "Timeout.");
+}
+
+/**
+ * Count hook that enforces the cpu limit and the deadline of a pcall.
+ *
+ * Called by lua every `hook_count` instructions, and right after
+ * lua_sandbox_request_gc asked for a collection. Once the sandbox's
+ * `cpu_limit` is used up or its `deadline` has passed, raises a lua error,
+ * which makes the running pcall fail. From then on the hook fires after
+ * every instruction and raises the error again, so lua code catching it
+ * can at most unwind to the outermost call.
+ *
+ * Reading the clock is not free, so with a deadline the hook interval is
+ * adapted to the speed of the code that is running: it is doubled while
+ * the clock is checked more often than every LUABOX_CLOCK_INTERVAL, and
+ * halved when the checks are too far apart. With a cpu limit it never
+ * exceeds `cpu_granularity`, while profiling never the profiler's
+ * interval.
+ */
+void lua_sandbox_hook(lua_State *L, lua_Debug *ar) {
+	Sandbox *box;
+	double now, elapsed;
+	int count;
+	lua_getallocf(L, (void**) &box);
+
+	/* the error was caught by lua code */
+	if (box->cpu_exceeded || box->timed_out) lua_sandbox_limit_error(L, box);
+
+	/* the instructions since the last regular hook are charged in full */
+	if (box->gc_pending) {
+		lua_sandbox_emergency_gc(box);
+		if (! (box->cpu_limit || box->deadline || box->profiling)) return;
+	}
+
+	box->instructions += box->hook_count;
+	if (box->profiling) profiler_sample(box->profiler, L, box->hook_count);
+	if (box->cpu_limit && box->instructions >= box->cpu_limit) {
+		box->cpu_exceeded = 1;
+		lua_sandbox_limit_error(L, box);
+	}
+
+	if (0 >= box->deadline) return;
+
+	now = luabox_monotonic();
+	if (now >= box->deadline) {
+		box->timed_out = 1;
+		lua_sandbox_limit_error(L, box);
+	}
+
+	elapsed = now - box->last_check;
+	box->last_check = now;
+
+	count = box->hook_count;
+	if (elapsed < LUABOX_CLOCK_INTERVAL / 2 && count < LUABOX_HOOK_MAX) count *= 2;
+	else if (elapsed > LUABOX_CLOCK_INTERVAL * 2 && count > LUABOX_HOOK_MIN) count /= 2;
+	if (box->cpu_limit && count > box->cpu_granularity) count = box->cpu_granularity;
+	if (box->profiling && count > profiler_interval(box->profiler)) count = profiler_interval(box->profiler);
+
+	if (count != box->hook_count) {
+		box->hook_count = count;
+		lua_sethook(L, lua_sandbox_hook, LUA_MASKCOUNT, count);
+	}
+}
+
+/**
+ * Acquire the sandbox lock.
+ *
+ * Only one thread at a time may use the lua_State of a sandbox. Must be
+ * called with the GIL held; the GIL is released while waiting for the
+ * lock. The lock is reentrant for the thread holding it, so lua code
+ * calling back into python may use the sandbox again.
+ */
+void Sandbox_lock(Sandbox *self) {
+	long me = PyThread_get_thread_ident();
+
+	/* lock_owner is only ever modified with the GIL held */
+	if (self->lock_depth && self->lock_owner == me) {
+		++self->lock_depth;
+		return;
+	}
+
+	if (! PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(self->lock, WAIT_LOCK);
+		Py_END_ALLOW_THREADS
+	}
+
+	self->lock_owner = me;
+	self->lock_depth = 1;
+}
+
+/**
+ * Release the sandbox lock. Must be called with the GIL held.
+ */
+void Sandbox_unlock(Sandbox *self) {
+	if (--self->lock_depth) return;
+
+	self->lock_owner = 0;
+	PyThread_release_lock(self->lock);
+}
+
 /**
  * Pop the stack to get an error message from lua.
  *
@@ -104,8 +409,23 @@ static int lua_sandbox_panic(lua_State *L) {
  * Deallocation method for python object.
  */
 static void Sandbox_dealloc(Sandbox *self) {
-	if (self->L) lua_close(self->L);
+	if (self->L) {
+		/* with a pool, frees become no-ops during lua_close and all
+		 * memory is returned at once afterwards */
+		self->closing = 1;
+		lua_close(self->L);
+	}
+	if (self->pool) {
+		mempool_destroy(self->pool);
+		free(self->pool);
+	}
 	if (self->lua_error_msg) free(self->lua_error_msg);
+	if (self->lock) PyThread_free_lock(self->lock);
+	Py_XDECREF(self->callbacks);
+	Py_XDECREF(self->tablerefs);
+	profiler_free(self->profiler);
+	/* only after lua_close, the child's globals point to the template */
+	Py_XDECREF(self->template);
 	self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -116,6 +436,99 @@ static PyObject *Sandbox_getmemory_limit(Sandbox *self, void *closure) {
 	return Py_BuildValue("K", self->lua_max_mem);
 }
 
+/**
+ * Getter for memory_used (see lua_current_mem).
+ */
+static PyObject *Sandbox_getmemory_used(Sandbox *self, void *closure) {
+	return Py_BuildValue("n", (Py_ssize_t) self->lua_current_mem);
+}
+
+/**
+ * Returns a dict of memory statistics.
+ *
+ * `histogram` is a list of allocation counts, where entry i counts
+ * allocations of up to 2**(i+4) bytes; the last entry counts all larger
+ * allocations as well.
+ *
+ * Python signature: memory_stats()
+ */
+static PyObject* Sandbox_memory_stats(Sandbox *self, PyObject *args) {
+	MemStats *ms = &self->memstats;
+	PyObject *histogram;
+	int i;
+
+	if (! (histogram = PyList_New(MEMSTATS_BUCKETS))) return NULL;
+	for (i = 0; i < MEMSTATS_BUCKETS; ++i) {
+		PyObject *count = PyLong_FromUnsignedLong(ms->histogram[i]);
+		if (! count) {
+			Py_DECREF(histogram);
+			return NULL;
+		}
+		PyList_SET_ITEM(histogram, i, count);
+	}
+
+	return Py_BuildValue("{s:n,s:n,s:k,s:k,s:k,s:k,s:k,s:k,s:N}",
+	                     "current", (Py_ssize_t) self->lua_current_mem,
+	                     "peak", (Py_ssize_t) ms->peak,
+	                     "allocs", ms->allocs,
+	                     "frees", ms->frees,
+	                     "reallocs", ms->reallocs,
+	                     "denied", ms->denied,
+	                     "gc_cycles", ms->gc_cycles,
+	                     "emergency_gcs", ms->emergency_gcs,
+	                     "histogram", histogram);
+}
+
+/**
+ * Reset all memory statistics. The peak is set to the current usage.
+ *
+ * Python signature: reset_memory_stats()
+ */
+static PyObject* Sandbox_reset_memory_stats(Sandbox *self, PyObject *args) {
+	memset(&self->memstats, 0, sizeof(MemStats));
+	self->memstats.peak = self->lua_current_mem;
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Getter for cpu_limit.
+ */
+static PyObject *Sandbox_getcpu_limit(Sandbox *self, void *closure) {
+	return Py_BuildValue("k", self->cpu_limit);
+}
+
+/**
+ * Getter for cpu_granularity.
+ */
+static PyObject *Sandbox_getcpu_granularity(Sandbox *self, void *closure) {
+	return Py_BuildValue("i", self->cpu_granularity);
+}
+
+/**
+ * Getter for gcpause.
+ */
+static PyObject *Sandbox_getgcpause(Sandbox *self, void *closure) {
+	return Py_BuildValue("i", self->gcpause);
+}
+
+/**
+ * Getter for gcstepmul.
+ */
+static PyObject *Sandbox_getgcstepmul(Sandbox *self, void *closure) {
+	return Py_BuildValue("i", self->gcstepmul);
+}
+
+/**
+ * Getter for gc_policy: the name of the preset matching the collector
+ * settings, or None.
+ */
+static PyObject *Sandbox_getgc_policy(Sandbox *self, void *closure) {
+	if (LUABOX_GC_INCREMENTAL_PAUSE == self->gcpause && LUABOX_GC_INCREMENTAL_STEPMUL == self->gcstepmul) return PyString_FromString("incremental");
+	if (LUABOX_GC_GENERATIONAL_PAUSE == self->gcpause && LUABOX_GC_GENERATIONAL_STEPMUL == self->gcstepmul) return PyString_FromString("generational");
+	Py_RETURN_NONE;
+}
+
 /**
  * Returns the index of the top element of the lua stack.
  * \see lua_gettop.
@@ -123,7 +536,13 @@ static PyObject *Sandbox_getmemory_limit(Sandbox *self, void *closure) {
  * Python signature: gettop()
  */
 static PyObject* Sandbox_gettop(Sandbox *self, PyObject *args) {
-	return Py_BuildValue("i", lua_gettop(self->L));
+	int top;
+
+	Sandbox_lock(self);
+	top = lua_gettop(self->L);
+	Sandbox_unlock(self);
+
+	return Py_BuildValue("i", top);
 }
 
 /**
@@ -136,12 +555,22 @@ static int Sandbox_init(Sandbox *self, PyObject *args, PyObject *kwds) {
 /**
  * Load lua code from string.
  *
+ * Compiled chunks are kept in the bytecode cache, loading the same source
+ * again skips compilation. Precompiled (binary) chunks are rejected, as
+ * lua does not verify bytecode.
+ *
  * \see luaL_loadstring.
  *
  * Python signature: loadstring(s)
  */
 static PyObject* Sandbox_loadstring(Sandbox *self, PyObject *args, PyObject *kwds) {
 	const char *s;
+	size_t len;
+	int status;
+	int use_cache = bytecache_enabled();
+	void *cached;
+	const ByteCode *code = NULL;
+	ByteCode dump = {NULL, 0, 0};
 	static char *kwlist[] = {"s", NULL};
 
 	if (! PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &s)) {
@@ -149,23 +578,55 @@ static PyObject* Sandbox_loadstring(Sandbox *self, PyObject *args, PyObject *kwd
 		return NULL;
 	}
 
-	switch(luaL_loadstring(self->L, s)) {
+	if (LUA_SIGNATURE[0] == s[0]) {
+		PyErr_SetString(Exc_SyntaxError, "Loading precompiled chunks is not allowed.");
+		return NULL;
+	}
+
+	len = strlen(s);
+	cached = bytecache_lookup(s, len, &code);
+
+	Sandbox_lock(self);
+
+	/* lua does not call back into python here */
+	Py_BEGIN_ALLOW_THREADS
+	if (cached) {
+		/* chunk name is stored in the bytecode */
+		status = luaL_loadbuffer(self->L, code->buf, code->len, s);
+	} else {
+		status = luaL_loadstring(self->L, s);
+
+		/* dump compiled function for the cache */
+		if (use_cache && 0 == status && 0 != lua_dump(self->L, bytecode_writer, &dump)) {
+			free(dump.buf);
+			dump.buf = NULL;
+		}
+	}
+	Py_END_ALLOW_THREADS
+
+	if (cached) bytecache_release(cached);
+	else if (dump.buf) bytecache_insert(s, len, &dump);
+
+	switch(status) {
 		case 0: break; /* no error */
 
 		case LUA_ERRSYNTAX:
 			/* pop error from stack */
 			PyErr_SetString(Exc_SyntaxError, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		case LUA_ERRMEM:
 			PyErr_SetString(Exc_OutOfMemory, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		default:
 			PyErr_SetString(Exc_LuaBoxException, luabox_exception_message(self));
-			return NULL;
+			break;
 	}
 
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
 	Py_RETURN_NONE;
 }
 
@@ -178,6 +639,7 @@ static PyObject* Sandbox_loadstring(Sandbox *self, PyObject *args, PyObject *kwd
  */
 static PyObject* Sandbox_loadfile(Sandbox *self, PyObject *args, PyObject *kwds) {
 	const char *filename;
+	int status;
 	static char *kwlist[] = {"filename", NULL};
 
 	if (! PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filename)) {
@@ -185,27 +647,84 @@ static PyObject* Sandbox_loadfile(Sandbox *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
-	switch(luaL_loadfile(self->L, filename)) {
+	Sandbox_lock(self);
+
+	/* lua does not call back into python here */
+	Py_BEGIN_ALLOW_THREADS
+	status = luaL_loadfile(self->L, filename);
+	Py_END_ALLOW_THREADS
+
+	switch(status) {
 		case 0: break; /* no error */
 
 		case LUA_ERRSYNTAX:
 			/* pop error from stack */
 			PyErr_SetString(Exc_SyntaxError, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		case LUA_ERRMEM:
 			PyErr_SetString(Exc_OutOfMemory, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		case LUA_ERRFILE:
 			PyErr_SetString(PyExc_IOError, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		default:
 			PyErr_SetString(Exc_LuaBoxException, luabox_exception_message(self));
-			return NULL;
+			break;
+	}
+
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Load lua code from a buffer, file-like object or iterable of strings,
+ * without first joining the source into a single string.
+ *
+ * \param source A buffer (str, mmap, ...), an object with a read(size)
+ *               method, or an iterable of strings.
+ * \param name Name of the chunk in error messages. Non-printable bytes
+ *             are escaped.
+ *
+ * \see luabox_load
+ *
+ * Python signature: load(source, name='load')
+ */
+static PyObject* Sandbox_load(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"source", "name", NULL};
+	const char *name = "load";
+	Py_ssize_t namelen = 4;
+	PyObject *source;
+	int status;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|s#", kwlist, &source, &name, &namelen)) return NULL;
+
+	Sandbox_lock(self);
+
+	switch(status = luabox_load(self, source, name, namelen)) {
+		case -1: break; /* Python exception set */
+		case 0: break; /* no error */
+
+		case LUA_ERRSYNTAX:
+			PyErr_SetString(Exc_SyntaxError, luabox_exception_message(self));
+			break;
+
+		case LUA_ERRMEM:
+			PyErr_SetString(Exc_OutOfMemory, luabox_exception_message(self));
+			break;
+
+		default:
+			PyErr_SetString(Exc_LuaBoxException, luabox_exception_message(self));
+			break;
 	}
 
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
 	Py_RETURN_NONE;
 }
 
@@ -216,21 +735,103 @@ static PyObject* Sandbox_loadfile(Sandbox *self, PyObject *args, PyObject *kwds)
  *
  * \param memory_limit The initial memory limit, in bytes or 0,
  *                     for no memory limit.
+ * \param pooled If true, lua memory is allocated from a per-sandbox
+ *               MemPool, which is released as a whole when the sandbox
+ *               is destroyed.
+ * \param cpu_limit The maximum number of lua VM instructions a single
+ *                  pcall may execute, or 0 for no limit.
+ * \param template A frozen Sandbox. Globals missing in the new sandbox are
+ *                 copied from it on first use (see template.c).
+ * \param libraries Names of approved standard libraries or library
+ *                  functions, opened on first use (see library.c).
  *
- * Python signature: Sandbox(memory_limit=0)
+ * Python signature: Sandbox(memory_limit=0, pooled=False, cpu_limit=0, template=None, libraries=None)
  */
 static PyObject* Sandbox_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 	Sandbox *self = (Sandbox*) type->tp_alloc(type, 0);
-	self->lua_error_msg = 0;
 
 	if(self) {
 		PyObject *memory_limit = 0;
-		static char *kwlist[] = {"memory_limit", NULL};
-		if(! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &memory_limit)) return NULL;
+		PyObject *cpu_limit = 0;
+		PyObject *template = NULL;
+		PyObject *libraries = NULL;
+		int pooled = 0, status;
+		static char *kwlist[] = {"memory_limit", "pooled", "cpu_limit", "template", "libraries", NULL};
+
+		self->lua_error_msg = 0;
+		self->pool = NULL;
+		self->closing = 0;
+		self->cpu_limit = 0;
+		self->cpu_granularity = LUABOX_CPU_GRANULARITY;
+		self->instructions = 0;
+		self->cpu_exceeded = 0;
+		self->hook_count = LUABOX_CPU_GRANULARITY;
+		self->deadline = 0;
+		self->last_check = 0;
+		self->alloc_since_check = 0;
+		self->timed_out = 0;
+		self->snapshot_ref = LUA_NOREF;
+		self->nrefs = 0;
+		self->callbacks = NULL;
+		self->callback_cost = LUABOX_CALLBACK_COST;
+		self->pcall_depth = 0;
+		self->coroutine = NULL;
+		self->template = NULL;
+		self->frozen = 0;
+		self->lossy_integers = 0;
+		self->libraries = 0;
+		self->profiler = NULL;
+		self->profiling = 0;
+		self->gcpause = LUABOX_GC_INCREMENTAL_PAUSE;
+		self->gcstepmul = LUABOX_GC_INCREMENTAL_STEPMUL;
+		self->emergency_gc = 1;
+		self->gc_pending = 0;
+		self->gc_threshold = 0;
+		self->tablerefs = NULL;
+
+		if(! PyArg_ParseTupleAndKeywords(args, kwds, "|OiOOO", kwlist, &memory_limit, &pooled, &cpu_limit, &template, &libraries)) {
+			Py_DECREF(self);
+			return NULL;
+		}
+
+		if (Py_None == template) template = NULL;
+		if (template) {
+			if (! PyObject_TypeCheck(template, &SandboxType)) {
+				PyErr_SetString(PyExc_TypeError, "Template must be a Sandbox.");
+				Py_DECREF(self);
+				return NULL;
+			}
+			if (! ((Sandbox*) template)->frozen || ((Sandbox*) template)->template) {
+				PyErr_SetString(PyExc_ValueError, "Template must be frozen, and not created from a template itself.");
+				Py_DECREF(self);
+				return NULL;
+			}
+		}
+
+		if (! (self->lock = PyThread_allocate_lock())) {
+			Py_DECREF(self);
+			return PyErr_NoMemory();
+		}
+
+		if (cpu_limit && -1 == Sandbox_setcpu_limit(self, cpu_limit, NULL)) {
+			Py_DECREF(self);
+			return NULL;
+		}
 
 		/* memory_limit is zero if not supplied */
 		if (! memory_limit) self->lua_max_mem = 0;
-		else if (-1 == Sandbox_setmemory_limit(self, memory_limit, NULL)) return NULL;
+		else if (-1 == Sandbox_setmemory_limit(self, memory_limit, NULL)) {
+			Py_DECREF(self);
+			return NULL;
+		}
+
+		if (pooled) {
+			if (! (self->pool = malloc(sizeof(MemPool)))) {
+				Py_DECREF(self);
+				return PyErr_NoMemory();
+			}
+			mempool_init(self->pool);
+		}
 
 		/* initialize lua_state */
 		self->L = lua_newstate(lua_sandbox_alloc, self);
@@ -244,78 +845,559 @@ static PyObject* Sandbox_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 
 		/* set panic function */
 		lua_atpanic(self->L, lua_sandbox_panic);
+
+		/* count garbage collection cycles */
+		if (lua_cpcall(self->L, lua_sandbox_gc_sentinel_init, NULL)) {
+			PyErr_SetString(Exc_OutOfMemory, "Could not instantiate lua state.");
+			Py_DECREF(self);
+			return NULL;
+		}
+
+		if (template && (status = luabox_template_attach(self, (Sandbox*) template))) {
+			if (0 < status) PyErr_SetString(Exc_OutOfMemory, "Could not attach template.");
+			Py_DECREF(self);
+			return NULL;
+		}
+
+		if (libraries && Py_None != libraries && (status = luabox_open_libraries(self, libraries))) {
+			if (0 < status) PyErr_SetString(Exc_OutOfMemory, "Could not set up libraries.");
+			Py_DECREF(self);
+			return NULL;
+		}
 	}
 
 	return (PyObject*)self;
 }
 
 /**
- * Protected-mode lua function call.
+ * Run lua_pcall on the sandbox, translating errors into exceptions.
  *
- * \see lua_pcall.
+ * Resets the cpu accounting and installs the count hook if there is a cpu
+ * limit or a timeout, or the call is profiled, then runs the call without the GIL. The hook is
+ * removed again afterwards, so lua code run outside of a pcall (e.g. by
+ * metamethods) is not affected. The caller must hold the sandbox lock.
+ *
+ * A pcall made from a Python callback while another one is running is
+ * nested: it counts against the budget of the outer call, and can only
+ * shorten its deadline.
+ *
+ * \param timeout Wall-clock time limit in seconds, 0 for none.
  *
- * Python signature: pcall(nargs, nresults, errfunc)
+ * Returns the lua status, with a Python exception set if it is nonzero.
  */
-static PyObject* Sandbox_pcall(Sandbox *self, PyObject *args, PyObject *kwds) {
-	static char *kwlist[] = {"nargs", "nresults", "errfunc", NULL};
-	int nargs = 0, nresults = 0, errfunc = 0;
-	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|iii", kwlist, &nargs, &nresults, &errfunc)) {
-		PyErr_SetString(PyExc_Exception, "Error parsing arguments.");
-		return NULL;
+int luabox_pcall(Sandbox *self, int nargs, int nresults, int errfunc, double timeout) {
+	double outer_deadline = self->deadline, deadline;
+	int status;
+
+	if (self->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot run code in a frozen sandbox.");
+		return LUA_ERRRUN;
+	}
+
+	if (! self->pcall_depth) {
+		/* reset accounting */
+		self->instructions = 0;
+		self->cpu_exceeded = 0;
+		self->timed_out = 0;
+		self->deadline = 0;
+		self->alloc_since_check = 0;
+		self->gc_threshold = 0;
+		self->hook_count = self->cpu_limit ? self->cpu_granularity : LUABOX_CPU_GRANULARITY;
+		self->profiling = self->profiler && profiler_begin(self->profiler);
+		if (self->profiling && (! self->cpu_limit || self->hook_count > profiler_interval(self->profiler))) {
+			self->hook_count = profiler_interval(self->profiler);
+		}
 	}
+	if (0 < timeout) {
+		deadline = luabox_monotonic() + timeout;
+		if (! self->deadline || deadline < self->deadline) {
+			if (! self->deadline) self->last_check = deadline - timeout;
+			self->deadline = deadline;
+		}
+	}
+
+	/* install hook only if needed */
+	if (self->cpu_limit || self->deadline || self->profiling) lua_sethook(self->L, lua_sandbox_hook, LUA_MASKCOUNT, self->hook_count);
+	else lua_sethook(self->L, NULL, 0, 0);
+
+	++self->pcall_depth;
+	Py_BEGIN_ALLOW_THREADS
+	status = lua_pcall(self->L, nargs, nresults, errfunc);
+	Py_END_ALLOW_THREADS
+	--self->pcall_depth;
 
-	switch(lua_pcall(self->L, nargs, nresults, errfunc)) {
+	/* the hook only fires in the main thread, so it may not have run */
+	self->gc_pending = 0;
+
+	/* back to the state of the outer call, if any */
+	self->deadline = self->pcall_depth ? outer_deadline : 0;
+	if (! self->pcall_depth) self->profiling = 0;
+	if (self->pcall_depth && (self->cpu_limit || self->deadline || self->profiling)) lua_sethook(self->L, lua_sandbox_hook, LUA_MASKCOUNT, self->hook_count);
+	else lua_sethook(self->L, NULL, 0, 0);
+
+	switch(status) {
 		case 0: break;
 
 		case LUA_ERRRUN:
+			if (self->cpu_exceeded) {
+				PyErr_SetString(Exc_CPULimitExceeded, luabox_exception_message(self));
+				break;
+			}
+			if (self->timed_out) {
+				PyErr_SetString(Exc_Timeout, luabox_exception_message(self));
+				break;
+			}
 			PyErr_SetString(Exc_RuntimeError, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		case LUA_ERRMEM:
+			/* allocations are denied after the deadline */
+			if (self->timed_out) {
+				PyErr_SetString(Exc_Timeout, luabox_exception_message(self));
+				break;
+			}
 			PyErr_SetString(Exc_OutOfMemory, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		case LUA_ERRERR:
+			/* the limit error is raised again in the error handler */
+			if (self->cpu_exceeded) {
+				PyErr_SetString(Exc_CPULimitExceeded, luabox_exception_message(self));
+				break;
+			}
+			if (self->timed_out) {
+				PyErr_SetString(Exc_Timeout, luabox_exception_message(self));
+				break;
+			}
 			PyErr_SetString(Exc_ErrorError, luabox_exception_message(self));
-			return NULL;
+			break;
 
 		default:
 			PyErr_SetString(Exc_LuaBoxException, luabox_exception_message(self));
-			return NULL;
+			break;
 	}
 
-	Py_RETURN_NONE;
+	return status;
 }
 
 /**
- * Pop top element from the stack.
+ * Protected-mode lua function call.
+ *
+ * \see lua_pcall.
  *
- * Pops the top element from the lua stack and returns it converted to an
- * appropriate Python value.
+ * If a cpu_limit is set, the call is aborted with CPULimitExceeded once
+ * it has executed that many instructions. The number of instructions
+ * used (rounded to the hook interval) is available as `instructions`
+ * afterwards.
  *
- * \see lua_pop
+ * \param timeout If positive, the call is aborted with Timeout after
+ *                that many seconds. The deadline is checked while lua
+ *                code runs, and by the allocator, so C functions building
+ *                large strings are aborted as well. C functions that run
+ *                long without allocating, i.e. backtracking pattern
+ *                matches, are not interrupted.
  *
- * Python signature: pop()
+ * Lua code catching either error with pcall gets it again after its next
+ * instruction, so the call still fails.
+ *
+ * Python signature: pcall(nargs, nresults, errfunc, timeout)
  */
-PyObject* Sandbox_pop(Sandbox *self, PyObject *args) {
-	const int index = -1;
-
-	PyObject *rval;
-	int t = lua_type(self->L, index);
-	switch(t) {
-		case LUA_TTABLE:
-			rval = LuaTableRef_from_stack(self);
-			return rval;
-
+static PyObject* Sandbox_pcall(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"nargs", "nresults", "errfunc", "timeout", NULL};
+	int nargs = 0, nresults = 0, errfunc = 0;
+	double timeout = 0;
+	int status;
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|iiid", kwlist, &nargs, &nresults, &errfunc, &timeout)) {
+		PyErr_SetString(PyExc_Exception, "Error parsing arguments.");
+		return NULL;
+	}
+	if (0 > timeout) {
+		PyErr_SetString(PyExc_ValueError, "Timeout must not be negative.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	status = luabox_pcall(self, nargs, nresults, errfunc, timeout);
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Pop top element from the stack of a thread of the sandbox.
+ *
+ * Pops the top element from the stack of `L` and returns it converted to
+ * an appropriate Python value. `L` is either the sandbox's main state or
+ * a thread created in it. The caller must hold the sandbox lock.
+ *
+ * Tables are returned as LuaTableRefs. Strings of at least
+ * `string_buffer_threshold` bytes are returned as LuaStrings, if the
+ * threshold is set.
+ *
+ * \see lua_pop
+ */
+PyObject *luabox_pop_from(Sandbox *self, lua_State *L) {
+	const int index = -1;
+
+	PyObject *rval;
+	int t = lua_type(L, index);
+	switch(t) {
+		case LUA_TTABLE:
+			rval = LuaTableRef_from_stack(self, L);
+			return rval;
+
+		case LUA_TSTRING:
+			/* large strings are optionally returned without copying */
+			if (0 < self->string_buffer_threshold && lua_objlen(L, index) >= (size_t) self->string_buffer_threshold) {
+				return LuaString_from_stack(self, L);
+			}
+			/* fall through */
+
 		default:
-			rval = lua_to_python(self->L);
+			rval = lua_to_python(L);
 			if (! rval) return NULL; 
-			lua_pop(self->L, 1);
+			lua_pop(L, 1);
 			return rval;
 	}
 
 }
 
+/**
+ * Pop top element from the sandbox's stack.
+ *
+ * \see luabox_pop_from
+ */
+PyObject *luabox_pop(Sandbox *self) {
+	return luabox_pop_from(self, self->L);
+}
+
+/**
+ * Pop top element from the stack.
+ *
+ * \param deep If true, tables are converted to lists and dicts instead
+ *             of being returned as LuaTableRefs.
+ * \param max_depth Maximum nesting depth of tables if `deep` is set.
+ *
+ * \see luabox_pop, lua_to_python_deep
+ *
+ * Python signature: pop(deep=False, max_depth=100)
+ */
+static PyObject* Sandbox_pop(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"deep", "max_depth", NULL};
+	int deep = 0, max_depth = LUABOX_MAX_DEPTH;
+	PyObject *rval;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist, &deep, &max_depth)) return NULL;
+
+	Sandbox_lock(self);
+	if (deep) {
+		rval = lua_to_python_deep(self->L, max_depth);
+		if (rval) lua_pop(self->L, 1);
+	} else {
+		rval = luabox_pop(self);
+	}
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Pop the top `n` elements from the stack.
+ *
+ * Returns them as a tuple, in stack order (the former top element last).
+ * If a value cannot be converted, the stack is left untouched. The caller
+ * must hold the sandbox lock.
+ */
+static PyObject *luabox_pop_n(Sandbox *self, int n) {
+	int top = lua_gettop(self->L), i;
+	PyObject *rval;
+
+	if (n < 0 || n > top) {
+		PyErr_Format(PyExc_IndexError, "Cannot pop %d values from lua stack of size %d.", n, top);
+		return NULL;
+	}
+
+	if (! lua_checkstack(self->L, 1)) {
+		PyErr_SetString(PyExc_MemoryError, "Lua stack overflow.");
+		return NULL;
+	}
+
+	if (! (rval = PyTuple_New(n))) return NULL;
+
+	for (i = 0; i < n; ++i) {
+		PyObject *v;
+
+		/* convert a copy, so the stack is unchanged on errors */
+		lua_pushvalue(self->L, top-n+1+i);
+		if (! (v = luabox_pop(self))) {
+			lua_settop(self->L, top);
+			Py_DECREF(rval);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(rval, i, v);
+	}
+
+	lua_settop(self->L, top-n);
+	return rval;
+}
+
+/**
+ * Pop the top `n` elements from the stack.
+ *
+ * \see luabox_pop_n
+ *
+ * Python signature: pop_n(n)
+ */
+static PyObject* Sandbox_pop_n(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"n", NULL};
+	PyObject *rval;
+	int n;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "i", kwlist, &n)) return NULL;
+
+	Sandbox_lock(self);
+	rval = luabox_pop_n(self, n);
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Pop all elements from the stack.
+ *
+ * \see luabox_pop_n
+ *
+ * Python signature: pop_all()
+ */
+static PyObject* Sandbox_pop_all(Sandbox *self, PyObject *args) {
+	PyObject *rval;
+
+	Sandbox_lock(self);
+	rval = luabox_pop_n(self, lua_gettop(self->L));
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Push all values of a sequence onto the stack. The caller must hold the
+ * sandbox lock.
+ *
+ * Either all values are pushed, or none. Returns the number of values
+ * pushed, -1 on errors.
+ */
+static int luabox_push_many(Sandbox *self, PyObject *values) {
+	int top = lua_gettop(self->L);
+	Py_ssize_t i, n = PySequence_Fast_GET_SIZE(values);
+	PyObject **items = PySequence_Fast_ITEMS(values);
+
+	if (n > INT_MAX || ! lua_checkstack(self->L, (int) n)) {
+		PyErr_SetString(PyExc_MemoryError, "Too many values for lua stack.");
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (! python_to_lua(self->L, items[i])) {
+			lua_settop(self->L, top);
+			return -1;
+		}
+	}
+
+	return (int) n;
+}
+
+/**
+ * Push all values from an iterable onto the stack.
+ *
+ * Python signature: push_many(values)
+ */
+static PyObject* Sandbox_push_many(Sandbox *self, PyObject *iterable) {
+	PyObject *values;
+	int n;
+
+	if (! (values = PySequence_Fast(iterable, "push_many() requires an iterable."))) return NULL;
+
+	Sandbox_lock(self);
+	n = luabox_push_many(self, values);
+	Sandbox_unlock(self);
+
+	Py_DECREF(values);
+
+	if (-1 == n) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Push a buffer of numbers as a lua table with its items at 1..n.
+ *
+ * Objects supporting the new buffer protocol (NumberBuffer, numpy arrays,
+ * memoryview) describe their items themselves. For other buffers, e.g.
+ * array.array or str, the struct module format of the items must be
+ * given. A given format always takes precedence.
+ *
+ * \see luabox_push_array
+ *
+ * Python signature: push_array(buffer, format=None)
+ */
+static PyObject* Sandbox_push_array(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"buffer", "format", NULL};
+	const char *format = NULL;
+	const void *data;
+	PyObject *obj;
+	Py_buffer view;
+	Py_ssize_t len, itemsize;
+	int have_view = 0, ok = 0;
+	char code = 0;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|z", kwlist, &obj, &format)) return NULL;
+
+	if (PyObject_CheckBuffer(obj)) {
+		if (-1 == PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)) return NULL;
+		have_view = 1;
+		data = view.buf;
+		len = view.len;
+		if (! format) format = view.format;
+	} else if (-1 == PyObject_AsReadBuffer(obj, &data, &len)) {
+		return NULL;
+	}
+
+	if (! format) {
+		PyErr_SetString(PyExc_TypeError, "The format of the buffer must be given.");
+		goto out;
+	}
+	if (! (code = numberbuffer_format(format))) {
+		PyErr_Format(PyExc_ValueError, "Unsupported buffer format '%s'.", format);
+		goto out;
+	}
+	itemsize = numberbuffer_itemsize(code);
+	if (len % itemsize) {
+		PyErr_SetString(PyExc_ValueError, "Buffer size is not a multiple of the item size.");
+		goto out;
+	}
+
+	Sandbox_lock(self);
+	ok = luabox_push_array(self, (const char*) data, len / itemsize, code);
+	Sandbox_unlock(self);
+
+out:
+	if (have_view) PyBuffer_Release(&view);
+	if (! ok) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Pop the top element and return it encoded as MessagePack.
+ *
+ * The value is encoded straight from the lua stack; it may be nil, a
+ * boolean, number or string, or a table of those nested up to
+ * `max_depth` levels (at most 100). No table may be reached twice, and the
+ * encoding may take up to `max_size` bytes. If it cannot be encoded, it
+ * stays on the stack.
+ *
+ * \see pack_lua_value
+ *
+ * Python signature: dump_value(max_depth=100, max_size=64MiB)
+ */
+static PyObject* Sandbox_dump_value(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"max_depth", "max_size", NULL};
+	int max_depth = LUABOX_MAX_DEPTH;
+	Py_ssize_t max_size = LUABOX_DUMP_MAX_SIZE;
+	PackBuffer b = {NULL, 0, 0};
+	PyObject *rval = NULL;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|in", kwlist, &max_depth, &max_size)) return NULL;
+	if (max_size < 0) {
+		PyErr_SetString(PyExc_ValueError, "Maximum size must not be negative.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	if (! lua_gettop(self->L)) {
+		PyErr_SetString(PyExc_IndexError, "Lua stack is empty, nothing to dump.");
+	} else if (-1 != pack_lua_value(&b, self->L, -1, max_depth, (size_t) max_size)) {
+		if ((rval = PyString_FromStringAndSize(b.data, b.len))) lua_pop(self->L, 1);
+	}
+	Sandbox_unlock(self);
+
+	pack_free(&b);
+	return rval;
+}
+
+/**
+ * Decode MessagePack data and push the value on top of the stack.
+ *
+ * Arrays and maps become lua tables, created directly in the sandbox and
+ * counted against its memory limit.
+ *
+ * \see luabox_unpack_value
+ *
+ * Python signature: load_value(data)
+ */
+static PyObject* Sandbox_load_value(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"data", NULL};
+	const char *data;
+	Py_ssize_t len;
+	int ok;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#", kwlist, &data, &len)) return NULL;
+
+	Sandbox_lock(self);
+	ok = luabox_unpack_value(self, data, (size_t) len);
+	Sandbox_unlock(self);
+
+	if (! ok) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Call the function on top of the stack.
+ *
+ * Pushes all arguments, calls the function in protected mode and returns
+ * all of its results as a tuple. The only keyword argument accepted is
+ * `timeout`, as for pcall().
+ *
+ * \see lua_pcall
+ *
+ * Python signature: call(*args, timeout=0)
+ */
+static PyObject* Sandbox_call(Sandbox *self, PyObject *args, PyObject *kwds) {
+	PyObject *rval = NULL, *value;
+	double timeout = 0;
+	int base, nargs;
+
+	if (kwds && PyDict_Size(kwds)) {
+		if (1 != PyDict_Size(kwds) || ! (value = PyDict_GetItemString(kwds, "timeout"))) {
+			PyErr_SetString(PyExc_TypeError, "call() only accepts the keyword argument timeout.");
+			return NULL;
+		}
+		timeout = PyFloat_AsDouble(value);
+		if (-1.0 == timeout && PyErr_Occurred()) return NULL;
+		if (0 > timeout) {
+			PyErr_SetString(PyExc_ValueError, "Timeout must not be negative.");
+			return NULL;
+		}
+	}
+
+	Sandbox_lock(self);
+
+	/* index below the function */
+	base = lua_gettop(self->L) - 1;
+	if (base < 0) {
+		PyErr_SetString(PyExc_IndexError, "Lua stack is empty, nothing to call.");
+		goto out;
+	}
+
+	if (-1 == (nargs = luabox_push_many(self, args))) goto out;
+	if (luabox_pcall(self, nargs, LUA_MULTRET, 0, timeout)) goto out;
+
+	rval = luabox_pop_n(self, lua_gettop(self->L) - base);
+
+out:
+	Sandbox_unlock(self);
+	return rval;
+}
+
 /**
  * Push a value on top of the lua stack.
  *
@@ -332,15 +1414,294 @@ PyObject *Sandbox_push(Sandbox *self, PyObject *args, PyObject *kwds) {
 		return NULL;
 	}
 
+	Sandbox_lock(self);
 	if (! python_to_lua(self->L, value)) {
 		/* Error string is set by python_to_loa. */
+		Sandbox_unlock(self);
 		return NULL;
 	}
+	Sandbox_unlock(self);
 
 	/* all done */
 	Py_RETURN_NONE;
 }
 
+/**
+ * Snapshot the global environment.
+ *
+ * \see luabox_snapshot
+ *
+ * Python signature: snapshot()
+ */
+static PyObject* Sandbox_snapshot(Sandbox *self, PyObject *args) {
+	int status;
+
+	if (self->pcall_depth) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot snapshot a sandbox while it is running.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	if ((status = luabox_snapshot(self))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, luabox_exception_message(self));
+	}
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Reset the sandbox to the last snapshot.
+ *
+ * Fails if there is no snapshot or LuaTableRefs into the sandbox are
+ * still alive.
+ *
+ * \see luabox_restore
+ *
+ * Python signature: reset()
+ */
+static PyObject* Sandbox_reset(Sandbox *self, PyObject *args) {
+	int status;
+
+	if (LUA_NOREF == self->snapshot_ref) {
+		PyErr_SetString(Exc_LuaBoxException, "Sandbox has no snapshot to reset to.");
+		return NULL;
+	}
+
+	/* children refer to the template's objects by address */
+	if (self->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot reset a frozen sandbox.");
+		return NULL;
+	}
+
+	if (self->nrefs) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot reset sandbox while LuaTableRefs are alive.");
+		return NULL;
+	}
+
+	if (self->pcall_depth) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot reset a sandbox while it is running.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	if ((status = luabox_restore(self))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, luabox_exception_message(self));
+	}
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Returns how often each requested library was opened, and the time and
+ * lua memory that took.
+ *
+ * \see luabox_library_stats
+ *
+ * Python signature: library_stats()
+ */
+static PyObject* Sandbox_library_stats(Sandbox *self, PyObject *args) {
+	return luabox_library_stats(self);
+}
+
+/**
+ * Start the sampling profiler, discarding earlier results.
+ *
+ * Profiled pcalls are sampled every `interval` instructions at most. Each
+ * sample adds the instructions since the previous one to the current
+ * stack, walked up to `max_depth` frames. Only `rate` of all pcalls are
+ * profiled, so profiling can stay enabled on a fraction of the traffic.
+ * Coroutines are not sampled.
+ *
+ * \see profiler.c
+ *
+ * Python signature: start_profiler(interval=10000, rate=1.0, max_depth=32)
+ */
+static PyObject* Sandbox_start_profiler(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"interval", "rate", "max_depth", NULL};
+	int interval = LUABOX_PROFILER_INTERVAL, max_depth = LUABOX_PROFILER_DEPTH, status;
+	double rate = 1.0;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|idi", kwlist, &interval, &rate, &max_depth)) return NULL;
+
+	Sandbox_lock(self);
+	if (self->pcall_depth) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot start the profiler while the sandbox is running.");
+		status = -1;
+	} else status = luabox_profiler_start(self, interval, rate, max_depth);
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Stop profiling. The results stay available until the profiler is
+ * started again.
+ *
+ * Python signature: stop_profiler()
+ */
+static PyObject* Sandbox_stop_profiler(Sandbox *self, PyObject *args) {
+	Sandbox_lock(self);
+	luabox_profiler_stop(self);
+	Sandbox_unlock(self);
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Returns the flat profile.
+ *
+ * \see luabox_profiler_stats
+ *
+ * Python signature: profiler_stats()
+ */
+static PyObject* Sandbox_profiler_stats(Sandbox *self, PyObject *args) {
+	PyObject *rval;
+
+	Sandbox_lock(self);
+	rval = luabox_profiler_stats(self);
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Returns the sampled stacks as folded lines for flamegraphs.
+ *
+ * \see luabox_profiler_folded
+ *
+ * Python signature: profiler_folded()
+ */
+static PyObject* Sandbox_profiler_folded(Sandbox *self, PyObject *args) {
+	PyObject *rval;
+
+	Sandbox_lock(self);
+	rval = luabox_profiler_folded(self);
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Freeze the sandbox for use as a template.
+ *
+ * A frozen sandbox cannot run lua code, register functions, have its
+ * tables modified or be reset anymore, so its globals stay as they are
+ * while other sandboxes copy from it. This cannot be undone.
+ *
+ * \see template.c
+ *
+ * Python signature: freeze()
+ */
+static PyObject* Sandbox_freeze(Sandbox *self, PyObject *args) {
+	if (self->pcall_depth) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot freeze a sandbox while it is running.");
+		return NULL;
+	}
+
+	self->frozen = 1;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Create a coroutine from the function on top of the stack, which is
+ * popped.
+ *
+ * \see Coroutine_from_stack
+ *
+ * Python signature: coroutine()
+ */
+static PyObject* Sandbox_coroutine(Sandbox *self, PyObject *args) {
+	PyObject *rval;
+
+	Sandbox_lock(self);
+	rval = Coroutine_from_stack(self);
+	Sandbox_unlock(self);
+
+	return rval;
+}
+
+/**
+ * Make a Python callable available to lua code as a global function.
+ *
+ * The function's arguments are converted like pop() does and passed to
+ * the callable. Its result is pushed like push() does; a tuple returns
+ * multiple values, None returns nothing. A Python exception raised by the
+ * callable becomes a lua error with the exception's name and message.
+ *
+ * The callable may use the sandbox, e.g. to call back into lua. Each
+ * call is charged `callback_cost` instructions against the cpu limit.
+ *
+ * \see luabox_register
+ *
+ * Python signature: register(name, callable)
+ */
+static PyObject* Sandbox_register(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"name", "callable", NULL};
+	const char *name;
+	PyObject *callable;
+	int status;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "sO", kwlist, &name, &callable)) return NULL;
+
+	if (! PyCallable_Check(callable)) {
+		PyErr_SetString(PyExc_TypeError, "Object is not callable.");
+		return NULL;
+	}
+
+	/* children only copy the callables that existed when they were created */
+	if (self->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot register functions in a frozen sandbox.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	if (0 < (status = luabox_register(self, name, callable))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, luabox_exception_message(self));
+	}
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Make a global function that yields to the host.
+ *
+ * Calling it from a coroutine yields the name followed by the arguments
+ * to whoever resumes the coroutine, e.g. a Scheduler's on_yield. The
+ * values the coroutine is resumed with are returned by the call.
+ *
+ * \see luabox_register_async
+ *
+ * Python signature: register_async(name)
+ */
+static PyObject* Sandbox_register_async(Sandbox *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"name", NULL};
+	const char *name;
+	int status;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name)) return NULL;
+
+	if (self->frozen) {
+		PyErr_SetString(Exc_LuaBoxException, "Cannot register functions in a frozen sandbox.");
+		return NULL;
+	}
+
+	Sandbox_lock(self);
+	if ((status = luabox_register_async(self, name))) {
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, luabox_exception_message(self));
+	}
+	Sandbox_unlock(self);
+
+	if (status) return NULL;
+	Py_RETURN_NONE;
+}
+
 /**
  * Setter for memory_limit (see lua_max_mem).
  */
@@ -361,12 +1722,163 @@ static int Sandbox_setmemory_limit(Sandbox *self, PyObject *value, void *closure
 }
 
 /**
- * Getter/Setter struct.
+ * Setter for cpu_limit.
+ */
+static int Sandbox_setcpu_limit(Sandbox *self, PyObject *value, void *closure) {
+	if (! value) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete cpu limit.");
+		return -1;
+	}
+
+	if (! PyInt_Check(value) && ! PyLong_Check(value)) {
+		PyErr_SetString(PyExc_TypeError, "CPU limit must be an integer.");
+		return -1;
+	}
+
+	self->cpu_limit = PyInt_AsUnsignedLongMask(value);
+
+	return 0;
+}
+
+/**
+ * Setter for cpu_granularity.
  *
- * Currently, only contains memory_limit.
+ * Larger values make the cpu limit cheaper to enforce, but less precise.
+ */
+static int Sandbox_setcpu_granularity(Sandbox *self, PyObject *value, void *closure) {
+	long granularity;
+
+	if (! value) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete cpu granularity.");
+		return -1;
+	}
+
+	if (! PyInt_Check(value)) {
+		PyErr_SetString(PyExc_TypeError, "CPU granularity must be an integer.");
+		return -1;
+	}
+
+	granularity = PyInt_AsLong(value);
+	if (granularity < 1 || granularity > INT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "CPU granularity must be a positive integer.");
+		return -1;
+	}
+
+	self->cpu_granularity = (int) granularity;
+
+	return 0;
+}
+
+/**
+ * Applies collector settings to the lua state.
+ */
+static void Sandbox_setgc(Sandbox *self, int pause, int stepmul) {
+	Sandbox_lock(self);
+	self->gcpause = pause;
+	self->gcstepmul = stepmul;
+	lua_gc(self->L, LUA_GCSETPAUSE, pause);
+	lua_gc(self->L, LUA_GCSETSTEPMUL, stepmul);
+	Sandbox_unlock(self);
+}
+
+/**
+ * Converts a collector setting, which is a percentage.
+ */
+static int Sandbox_gc_setting(PyObject *value, const char *name) {
+	long percent;
+
+	if (! value) {
+		PyErr_Format(PyExc_TypeError, "Cannot delete %s.", name);
+		return -1;
+	}
+
+	if (! PyInt_Check(value)) {
+		PyErr_Format(PyExc_TypeError, "%s must be an integer.", name);
+		return -1;
+	}
+
+	percent = PyInt_AsLong(value);
+	if (percent < 1 || percent > INT_MAX) {
+		PyErr_Format(PyExc_ValueError, "%s must be a positive integer.", name);
+		return -1;
+	}
+
+	return (int) percent;
+}
+
+/**
+ * Setter for gcpause.
+ *
+ * A collection cycle starts once memory use reaches gcpause percent of
+ * what was in use after the previous one. Smaller values collect more
+ * often.
+ */
+static int Sandbox_setgcpause(Sandbox *self, PyObject *value, void *closure) {
+	int pause = Sandbox_gc_setting(value, "gcpause");
+
+	if (-1 == pause) return -1;
+	Sandbox_setgc(self, pause, self->gcstepmul);
+	return 0;
+}
+
+/**
+ * Setter for gcstepmul.
+ *
+ * The collector works gcstepmul percent as fast as memory is allocated.
+ * Larger values make cycles shorter, but the steps longer.
+ */
+static int Sandbox_setgcstepmul(Sandbox *self, PyObject *value, void *closure) {
+	int stepmul = Sandbox_gc_setting(value, "gcstepmul");
+
+	if (-1 == stepmul) return -1;
+	Sandbox_setgc(self, self->gcpause, stepmul);
+	return 0;
+}
+
+/**
+ * Setter for gc_policy.
+ *
+ * "incremental" restores lua's defaults. "generational" is meant for
+ * scripts allocating lots of short-lived objects: lua 5.1 has no
+ * generational collector, so a new cycle starts as soon as the previous
+ * one has finished, and cycles run at twice the speed. Garbage is then
+ * reclaimed soon after it was created, at the cost of more collector work.
+ */
+static int Sandbox_setgc_policy(Sandbox *self, PyObject *value, void *closure) {
+	const char *policy;
+
+	if (! value) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete gc policy.");
+		return -1;
+	}
+
+	if (! PyString_Check(value)) {
+		PyErr_SetString(PyExc_TypeError, "GC policy must be a string.");
+		return -1;
+	}
+
+	policy = PyString_AS_STRING(value);
+	if (0 == strcmp(policy, "incremental")) Sandbox_setgc(self, LUABOX_GC_INCREMENTAL_PAUSE, LUABOX_GC_INCREMENTAL_STEPMUL);
+	else if (0 == strcmp(policy, "generational")) Sandbox_setgc(self, LUABOX_GC_GENERATIONAL_PAUSE, LUABOX_GC_GENERATIONAL_STEPMUL);
+	else {
+		PyErr_SetString(PyExc_ValueError, "GC policy must be 'incremental' or 'generational'.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Getter/Setter struct.
  */
 static PyGetSetDef Sandbox_getseters[] = {
 	{"memory_limit", (getter)Sandbox_getmemory_limit, (setter)Sandbox_setmemory_limit, "maximum allowed script memory usage (in bytes)", NULL},
+	{"memory_used", (getter)Sandbox_getmemory_used, NULL, "current script memory usage (in bytes)", NULL},
+	{"cpu_limit", (getter)Sandbox_getcpu_limit, (setter)Sandbox_setcpu_limit, "maximum number of instructions per pcall, 0 for no limit", NULL},
+	{"cpu_granularity", (getter)Sandbox_getcpu_granularity, (setter)Sandbox_setcpu_granularity, "number of instructions between cpu limit checks", NULL},
+	{"gcpause", (getter)Sandbox_getgcpause, (setter)Sandbox_setgcpause, "memory use relative to the last collection at which a new cycle starts (in percent)", NULL},
+	{"gcstepmul", (getter)Sandbox_getgcstepmul, (setter)Sandbox_setgcstepmul, "speed of the collector relative to allocation (in percent)", NULL},
+	{"gc_policy", (getter)Sandbox_getgc_policy, (setter)Sandbox_setgc_policy, "'incremental' or 'generational' collector preset, None for custom settings", NULL},
 	{NULL}
 };
 
@@ -374,6 +1886,12 @@ static PyGetSetDef Sandbox_getseters[] = {
  * Sandbox attributes.
  */
 static PyMemberDef Sandbox_members[] = {
+	{"instructions", T_ULONG, offsetof(Sandbox, instructions), READONLY, "instructions used by the last pcall (in multiples of the hook interval)"},
+	{"callback_cost", T_ULONG, offsetof(Sandbox, callback_cost), 0, "instructions charged against the cpu limit per call of a registered Python callable"},
+	{"emergency_gc", T_INT, offsetof(Sandbox, emergency_gc), 0, "if nonzero, a full collection runs once lua code gets within 1/8 of memory_limit"},
+	{"lossy_integers", T_INT, offsetof(Sandbox, lossy_integers), 0, "if nonzero, integers beyond 2**53 are rounded when pushed instead of raising OverflowError"},
+	{"frozen", T_INT, offsetof(Sandbox, frozen), READONLY, "nonzero once the sandbox is frozen for use as a template"},
+	{"string_buffer_threshold", T_PYSSIZET, offsetof(Sandbox, string_buffer_threshold), 0, "strings of at least this many bytes are returned as zero-copy LuaString buffers, 0 to disable"},
 	{NULL}
 };
 
@@ -384,9 +1902,30 @@ static PyMethodDef Sandbox_methods[] = {
 	{"gettop", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_gettop, METH_NOARGS, "get number of elements in stack"},
 	{"loadfile", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_loadfile, METH_KEYWORDS, "load a file"},
 	{"loadstring", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_loadstring, METH_KEYWORDS, "load a string"},
+	{"load", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_load, METH_KEYWORDS, "load a chunk from a buffer, file-like object or iterable of strings"},
 	{"pcall", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_pcall, METH_KEYWORDS, "protected function call"},
 	{"push", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_push, METH_KEYWORDS, "push value on top of lua stack"},
-	{"pop", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_pop, METH_NOARGS, "pop and return"},
+	{"push_many", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_push_many, METH_O, "push all values of an iterable"},
+	{"push_array", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_push_array, METH_KEYWORDS, "push a buffer of numbers as a lua table"},
+	{"dump_value", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_dump_value, METH_KEYWORDS, "pop a value and return it encoded as MessagePack"},
+	{"load_value", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_load_value, METH_KEYWORDS, "push a value decoded from MessagePack"},
+	{"pop_n", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_pop_n, METH_KEYWORDS, "pop n values and return them as a tuple"},
+	{"pop_all", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_pop_all, METH_NOARGS, "pop all values and return them as a tuple"},
+	{"call", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_call, METH_VARARGS | METH_KEYWORDS, "call function on top of stack with arguments, return all results"},
+	{"pop", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_pop, METH_KEYWORDS, "pop and return"},
+	{"memory_stats", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_memory_stats, METH_NOARGS, "return allocation counters and size histogram"},
+	{"reset_memory_stats", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_reset_memory_stats, METH_NOARGS, "reset allocation counters"},
+	{"library_stats", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_library_stats, METH_NOARGS, "return the cost of opening each requested library"},
+	{"start_profiler", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_start_profiler, METH_KEYWORDS, "sample the stacks of pcalls"},
+	{"stop_profiler", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_stop_profiler, METH_NOARGS, "stop sampling, keeping the results"},
+	{"profiler_stats", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_profiler_stats, METH_NOARGS, "return the flat profile"},
+	{"profiler_folded", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_profiler_folded, METH_NOARGS, "return the sampled stacks in folded format"},
+	{"snapshot", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_snapshot, METH_NOARGS, "remember the current global environment"},
+	{"reset", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_reset, METH_NOARGS, "restore the global environment from the snapshot"},
+	{"freeze", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_freeze, METH_NOARGS, "stop running code, for use as a template"},
+	{"coroutine", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_coroutine, METH_NOARGS, "create a coroutine from the function on top of stack"},
+	{"register", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_register, METH_KEYWORDS, "make a Python callable available as a global lua function"},
+	{"register_async", SUPPRESS_PYMCFUNCTION_WARNINGS Sandbox_register_async, METH_KEYWORDS, "make a global lua function that yields its arguments to the host"},
 	{NULL}
 };
 
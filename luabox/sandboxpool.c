@@ -0,0 +1,228 @@
+/**
+ * Pool of pre-initialized sandboxes.
+ *
+ * Creating a Sandbox sets up a new lua_State from scratch. A SandboxPool
+ * keeps a number of idle sandboxes around, each with a snapshot of its
+ * initial global environment. A released sandbox is reset to that
+ * snapshot and handed out again by the next acquire(), which is a lot
+ * cheaper than building a new one.
+ *
+ * Sandboxes that cannot be reset (because LuaTableRefs into them are
+ * still alive, or the reset fails) are discarded.
+ */
+#include "luaboxmodule.h"
+
+PyTypeObject SandboxPoolType = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                  /*ob_size*/
+	"luabox.SandboxPool",               /*tp_name*/
+	sizeof(SandboxPool)                 /*tp_basicsize*/
+
+	/* The other members are initialized in SandboxPoolType_INIT */
+};
+
+/**
+ * Create a new sandbox with the pool's settings and snapshot it.
+ */
+static PyObject *SandboxPool_create(SandboxPool *self) {
+	PyObject *args, *sandbox, *rval;
+
+	if (! (args = PyTuple_New(0))) return NULL;
+	sandbox = PyObject_Call((PyObject*) &SandboxType, args, self->sandbox_kwds);
+	Py_DECREF(args);
+	if (! sandbox) return NULL;
+
+	if (! (rval = PyObject_CallMethod(sandbox, "snapshot", NULL))) {
+		Py_DECREF(sandbox);
+		return NULL;
+	}
+	Py_DECREF(rval);
+
+	++self->created;
+	return sandbox;
+}
+
+static void SandboxPool_dealloc(SandboxPool *self) {
+	Py_XDECREF(self->idle);
+	Py_XDECREF(self->sandbox_kwds);
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+/**
+ * new-function for Python object.
+ *
+ * \param size The number of idle sandboxes kept in the pool. The pool is
+ *             filled up front.
+ *
+ * All other keyword arguments are passed on to Sandbox().
+ *
+ * Python signature: SandboxPool(size, **sandbox_kwargs)
+ */
+static PyObject* SandboxPool_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	SandboxPool *self = (SandboxPool*) type->tp_alloc(type, 0);
+	PyObject *size = NULL;
+	Py_ssize_t i;
+
+	if (! self) return NULL;
+
+	/* size is taken out, everything else is for the sandboxes */
+	self->sandbox_kwds = kwds ? PyDict_Copy(kwds) : PyDict_New();
+	self->idle = PyList_New(0);
+	if (! self->sandbox_kwds || ! self->idle) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	if (1 == PyTuple_GET_SIZE(args)) {
+		size = PyTuple_GET_ITEM(args, 0);
+		Py_INCREF(size);
+	} else if (0 == PyTuple_GET_SIZE(args) && (size = PyDict_GetItemString(self->sandbox_kwds, "size"))) {
+		Py_INCREF(size);
+		PyDict_DelItemString(self->sandbox_kwds, "size");
+	}
+
+	if (! size || ! PyInt_Check(size)) {
+		PyErr_SetString(PyExc_TypeError, "SandboxPool requires an integer size.");
+		Py_XDECREF(size);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->size = PyInt_AsSsize_t(size);
+	Py_DECREF(size);
+	if (self->size < 0) {
+		PyErr_SetString(PyExc_ValueError, "Pool size must not be negative.");
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	/* pre-warm */
+	for (i = 0; i < self->size; ++i) {
+		PyObject *sandbox = SandboxPool_create(self);
+		if (! sandbox || -1 == PyList_Append(self->idle, sandbox)) {
+			Py_XDECREF(sandbox);
+			Py_DECREF(self);
+			return NULL;
+		}
+		Py_DECREF(sandbox);
+	}
+
+	return (PyObject*) self;
+}
+
+/**
+ * Get a sandbox from the pool. If no idle sandbox is available, a new one
+ * is created.
+ *
+ * Python signature: acquire()
+ */
+static PyObject* SandboxPool_acquire(SandboxPool *self, PyObject *args) {
+	Py_ssize_t n = PyList_GET_SIZE(self->idle);
+	PyObject *sandbox;
+
+	if (n) {
+		sandbox = PyList_GET_ITEM(self->idle, n-1);
+		Py_INCREF(sandbox);
+		if (-1 == PyList_SetSlice(self->idle, n-1, n, NULL)) {
+			Py_DECREF(sandbox);
+			return NULL;
+		}
+		++self->reused;
+	} else {
+		if (! (sandbox = SandboxPool_create(self))) return NULL;
+	}
+
+	++self->acquired;
+	return sandbox;
+}
+
+/**
+ * Return a sandbox to the pool.
+ *
+ * The sandbox is reset to its snapshot and kept if the pool is not full.
+ * It must not be used by the caller afterwards.
+ *
+ * Python signature: release(sandbox)
+ */
+static PyObject* SandboxPool_release(SandboxPool *self, PyObject *sandbox) {
+	PyObject *rval;
+	double start;
+
+	if (! PyObject_TypeCheck(sandbox, &SandboxType)) {
+		PyErr_SetString(PyExc_TypeError, "Only sandboxes can be released into a pool.");
+		return NULL;
+	}
+
+	switch (PySequence_Contains(self->idle, sandbox)) {
+		case 0: break;
+		case 1:
+			PyErr_SetString(PyExc_ValueError, "Sandbox has already been released.");
+			return NULL;
+		default:
+			return NULL;
+	}
+
+	if (PyList_GET_SIZE(self->idle) >= self->size || ((Sandbox*) sandbox)->nrefs) {
+		++self->discarded;
+		Py_RETURN_NONE;
+	}
+
+	start = luabox_monotonic();
+	rval = PyObject_CallMethod(sandbox, "reset", NULL);
+	self->reset_time += luabox_monotonic() - start;
+
+	if (! rval) {
+		/* unusable, let it go */
+		PyErr_Clear();
+		++self->discarded;
+		Py_RETURN_NONE;
+	}
+	Py_DECREF(rval);
+	++self->resets;
+
+	if (-1 == PyList_Append(self->idle, sandbox)) return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/**
+ * Returns a dict with pool statistics.
+ *
+ * Python signature: stats()
+ */
+static PyObject* SandboxPool_stats(SandboxPool *self, PyObject *args) {
+	return Py_BuildValue("{s:n,s:n,s:k,s:k,s:k,s:k,s:k,s:d,s:d,s:d}",
+	                     "size", self->size,
+	                     "idle", PyList_GET_SIZE(self->idle),
+	                     "created", self->created,
+	                     "acquired", self->acquired,
+	                     "reused", self->reused,
+	                     "discarded", self->discarded,
+	                     "resets", self->resets,
+	                     "reset_time", self->reset_time,
+	                     "avg_reset_time", self->resets ? self->reset_time / self->resets : 0.0,
+	                     "reuse_rate", self->acquired ? (double) self->reused / self->acquired : 0.0);
+}
+
+/**
+ * SandboxPool methods.
+ */
+static PyMethodDef SandboxPool_methods[] = {
+	{"acquire", SUPPRESS_PYMCFUNCTION_WARNINGS SandboxPool_acquire, METH_NOARGS, "get a sandbox from the pool"},
+	{"release", SUPPRESS_PYMCFUNCTION_WARNINGS SandboxPool_release, METH_O, "reset a sandbox and return it to the pool"},
+	{"stats", SUPPRESS_PYMCFUNCTION_WARNINGS SandboxPool_stats, METH_NOARGS, "return reuse and reset statistics"},
+	{NULL}
+};
+
+/**
+ * INIT-function for SandboxPool type.
+ */
+void SandboxPoolType_INIT(PyTypeObject *t) {
+	t->tp_dealloc = (destructor)SandboxPool_dealloc;
+	t->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+	t->tp_doc = "Pool of pre-initialized sandboxes that are reset on release.";
+	t->tp_methods = SandboxPool_methods;
+	t->tp_new = SandboxPool_new;
+
+	if(PyType_Ready(t) < 0) return;
+}
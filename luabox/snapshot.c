@@ -0,0 +1,255 @@
+/**
+ * Snapshots of the global environment of a sandbox.
+ *
+ * A snapshot records everything a script can reach and change through
+ * the globals: the contents and metatables of all tables reachable from
+ * the globals table (recursively, including the globals table itself,
+ * metatables and tables held in upvalues), the upvalues of all reachable
+ * functions, and the metatable shared by all strings. Restoring a
+ * snapshot puts all of these back into place, removing anything a script
+ * added. Objects created after the snapshot become garbage, unless the
+ * host still holds references to them.
+ *
+ * Both operations allocate lua memory and are run through lua_cpcall, so
+ * that running out of memory is reported as an error instead of causing
+ * a panic.
+ */
+#include "luaboxmodule.h"
+
+/* fields of the snapshot table */
+#define SNAPSHOT_TABLES 1       /* table -> shallow copy of its contents */
+#define SNAPSHOT_META 2         /* table -> its metatable */
+#define SNAPSHOT_UPVALUES 3     /* function -> array of its upvalues */
+#define SNAPSHOT_STRINGMETA 4   /* metatable of all strings */
+
+/**
+ * Pushes a shallow copy of the table at `idx`.
+ */
+static void snapshot_copy_table(lua_State *L, int idx) {
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+}
+
+/**
+ * Replaces the contents of the table at `dst` with those of the table at
+ * `src`.
+ */
+static void snapshot_restore_table(lua_State *L, int dst, int src) {
+	/* clearing existing fields during traversal is allowed */
+	lua_pushnil(L);
+	while (lua_next(L, dst)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, dst);
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, src)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, dst);
+	}
+}
+
+/**
+ * Appends the value at the (absolute) index `idx` to the `work` list, if
+ * it is a table or function not in `seen` yet.
+ */
+static void snapshot_mark(lua_State *L, int idx, int seen, int work) {
+	if (! lua_istable(L, idx) && ! lua_isfunction(L, idx)) return;
+
+	lua_pushvalue(L, idx);
+	lua_rawget(L, seen);
+	if (! lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen);
+
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, work, (int) lua_objlen(L, work) + 1);
+}
+
+/**
+ * lua_CFunction creating a snapshot for the sandbox passed as a light
+ * userdata, and storing it in the registry.
+ */
+static int snapshot_take(lua_State *L) {
+	Sandbox *box = (Sandbox*) lua_touserdata(L, 1);
+	int snap, tables, metas, upvalues, seen, work, v, ups, i;
+	size_t n;
+
+	lua_createtable(L, 4, 0);
+	snap = lua_gettop(L);
+	lua_newtable(L);
+	tables = lua_gettop(L);
+	lua_newtable(L);
+	metas = lua_gettop(L);
+	lua_newtable(L);
+	upvalues = lua_gettop(L);
+	lua_newtable(L);
+	seen = lua_gettop(L);
+	lua_newtable(L);
+	work = lua_gettop(L);
+
+	/* roots: the globals and the string metatable */
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	snapshot_mark(L, lua_gettop(L), seen, work);
+	lua_pushliteral(L, "");
+	if (lua_getmetatable(L, -1)) {
+		snapshot_mark(L, lua_gettop(L), seen, work);
+		lua_rawseti(L, snap, SNAPSHOT_STRINGMETA);
+	}
+	lua_settop(L, work);
+
+	/* iterative, as tables may be nested deeply */
+	luaL_checkstack(L, 8, "Snapshot stack overflow.");
+	while ((n = lua_objlen(L, work))) {
+		lua_rawgeti(L, work, (int) n);
+		v = lua_gettop(L);
+		lua_pushnil(L);
+		lua_rawseti(L, work, (int) n);
+
+		if (lua_istable(L, v)) {
+			lua_pushvalue(L, v);
+			snapshot_copy_table(L, v);
+			lua_rawset(L, tables);
+
+			if (lua_getmetatable(L, v)) {
+				snapshot_mark(L, lua_gettop(L), seen, work);
+				lua_pushvalue(L, v);
+				lua_insert(L, -2);
+				lua_rawset(L, metas);
+			}
+
+			lua_pushnil(L);
+			while (lua_next(L, v)) {
+				snapshot_mark(L, lua_gettop(L) - 1, seen, work);
+				snapshot_mark(L, lua_gettop(L), seen, work);
+				lua_pop(L, 1);
+			}
+		} else {
+			/* lua and C closures alike */
+			lua_newtable(L);
+			ups = lua_gettop(L);
+			for (i = 1; lua_getupvalue(L, v, i); ++i) {
+				snapshot_mark(L, lua_gettop(L), seen, work);
+				lua_rawseti(L, ups, i);
+			}
+			if (i > 1) {
+				lua_pushvalue(L, v);
+				lua_insert(L, -2);
+				lua_rawset(L, upvalues);
+			}
+		}
+
+		lua_settop(L, work);
+	}
+
+	lua_pushvalue(L, tables);
+	lua_rawseti(L, snap, SNAPSHOT_TABLES);
+	lua_pushvalue(L, metas);
+	lua_rawseti(L, snap, SNAPSHOT_META);
+	lua_pushvalue(L, upvalues);
+	lua_rawseti(L, snap, SNAPSHOT_UPVALUES);
+
+	lua_settop(L, snap);
+	if (LUA_NOREF != box->snapshot_ref) luaL_unref(L, LUA_REGISTRYINDEX, box->snapshot_ref);
+	box->snapshot_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
+/**
+ * lua_CFunction restoring the snapshot passed as a light userdata pointing
+ * to the sandbox, then collecting all garbage.
+ */
+static int snapshot_restore(lua_State *L) {
+	Sandbox *box = (Sandbox*) lua_touserdata(L, 1);
+	int snap, tables, metas, upvalues, i;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, box->snapshot_ref);
+	snap = lua_gettop(L);
+
+	/* table contents and metatables, nil if there was none */
+	lua_rawgeti(L, snap, SNAPSHOT_TABLES);
+	tables = lua_gettop(L);
+	lua_rawgeti(L, snap, SNAPSHOT_META);
+	metas = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, tables)) {
+		snapshot_restore_table(L, lua_gettop(L) - 1, lua_gettop(L));
+		lua_pushvalue(L, -2);
+		lua_rawget(L, metas);
+		lua_setmetatable(L, -3);
+		lua_pop(L, 1);
+	}
+
+	/* upvalues */
+	lua_rawgeti(L, snap, SNAPSHOT_UPVALUES);
+	upvalues = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, upvalues)) {
+		for (i = 1; lua_getupvalue(L, -2, i); ++i) {
+			lua_pop(L, 1);
+			lua_rawgeti(L, -1, i);
+			lua_setupvalue(L, -3, i);
+		}
+		lua_pop(L, 1);
+	}
+
+	/* string metatable, nil if there was none */
+	lua_pushliteral(L, "");
+	lua_rawgeti(L, snap, SNAPSHOT_STRINGMETA);
+	lua_setmetatable(L, -2);
+
+	lua_settop(L, 0);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+
+	return 0;
+}
+
+/**
+ * Snapshot the current global environment of a sandbox, replacing any
+ * previous snapshot. Must be called with the sandbox lock held.
+ *
+ * Returns the lua error status, 0 on success.
+ */
+int luabox_snapshot(Sandbox *self) {
+	lua_sethook(self->L, NULL, 0, 0);
+
+	return lua_cpcall(self->L, snapshot_take, self);
+}
+
+/**
+ * Reset a sandbox to its snapshot.
+ *
+ * Clears the stack, restores the globals, and runs a full garbage
+ * collection. Must be called with the sandbox lock held.
+ *
+ * Returns the lua error status, 0 on success.
+ */
+int luabox_restore(Sandbox *self) {
+	int status;
+
+	lua_sethook(self->L, NULL, 0, 0);
+	lua_settop(self->L, 0);
+
+	if ((status = lua_cpcall(self->L, snapshot_restore, self))) return status;
+
+	self->instructions = 0;
+	self->cpu_exceeded = 0;
+	self->timed_out = 0;
+
+	return 0;
+}
@@ -0,0 +1,572 @@
+/**
+ * Sandboxes created from a frozen template.
+ *
+ * Separate lua states cannot share values, so a child cannot simply refer
+ * to the tables of its template. Instead, the globals table of a child has
+ * an __index metamethod. The first time the child reads a global, the
+ * metamethod copies it from the template and stores the copy as a global
+ * of the child. Creating a child costs no more than creating an empty
+ * sandbox, and the child only pays for the globals it actually uses. All
+ * writes go to the child's own copies.
+ *
+ * A value is copied in two phases, so a lua error (e.g. running out of
+ * memory) never unwinds across the two states. A protected call in the
+ * template serializes the value into a C buffer, then a protected call in
+ * the child rebuilds it from there.
+ *
+ * What gets copied:
+ *  - Tables are copied deeply, together with their metatables. Each object
+ *    of the template is copied at most once into a child, so cycles and
+ *    shared references are preserved, also between globals. The child
+ *    keeps its copies in a table keyed by the template object's address,
+ *    which stays valid as the template no longer changes.
+ *  - Lua functions are copied as bytecode, with their upvalues and
+ *    environment. Upvalues shared between functions become separate
+ *    copies.
+ *  - The template's globals table is replaced by the child's wherever it
+ *    occurs.
+ *  - Userdata and threads cannot be copied.
+ *
+ * Every name is looked up in the template at most once. The child
+ * remembers names it has looked up, found or not, so assigning nil to a
+ * copied global removes it, and reading a name missing from both (e.g.
+ * `if DEBUG then`) does not lock the template every time. Both tables are
+ * upvalues of the __index metamethod and are thus reset by restoring a
+ * snapshot.
+ *
+ * Iterating the globals of a child only finds the globals it has used.
+ */
+#include "luaboxmodule.h"
+
+/* maximum length of an error message passed on from the template */
+#define TEMPLATE_MSG_SIZE 256
+
+/* stack index of the table of objects dumped by this copy */
+#define TEMPLATE_SEEN 2
+
+/* stack index of the child's table of copied objects in template_load */
+#define TEMPLATE_COPIED 3
+
+/* upvalues of template_index */
+#define TEMPLATE_SANDBOX lua_upvalueindex(1)
+#define TEMPLATE_OBJECTS lua_upvalueindex(2)
+#define TEMPLATE_KNOWN lua_upvalueindex(3)
+
+/* serialized value tags */
+enum {
+	TEMPLATE_NIL,
+	TEMPLATE_FALSE,
+	TEMPLATE_TRUE,
+	TEMPLATE_NUMBER,
+	TEMPLATE_STRING,
+	TEMPLATE_LIGHTUSERDATA,
+	TEMPLATE_GLOBALS,
+	TEMPLATE_REF,
+	TEMPLATE_TABLE,
+	TEMPLATE_END,
+	TEMPLATE_LFUNCTION,
+	TEMPLATE_CFUNCTION
+};
+
+/**
+ * A global being copied: its key, the buffer holding its serialized value,
+ * and the child's table of copied objects, at stack index `objects` of
+ * `child`.
+ */
+typedef struct {
+	int type;
+	const char *str;
+	size_t len;
+	lua_Number num;
+	ByteCode out;
+	size_t pos;
+	lua_State *child;
+	int objects;
+} TemplateCopy;
+
+/**
+ * Appends `n` bytes to the buffer, raising a lua error in `L` if out of
+ * memory.
+ */
+static void template_write(lua_State *L, TemplateCopy *tc, const void *p, size_t n) {
+	if (bytecode_writer(L, p, n, &tc->out)) luaL_error(L, "Not enough memory to copy from template.");
+}
+
+static void template_write_tag(lua_State *L, TemplateCopy *tc, unsigned char tag) {
+	template_write(L, tc, &tag, 1);
+}
+
+static void template_dump_value(lua_State *S, TemplateCopy *tc, int idx, int depth);
+
+/**
+ * Serializes the upvalues and the environment of the function at `idx`.
+ */
+static void template_dump_closure(lua_State *S, TemplateCopy *tc, int idx, int depth) {
+	int i, n;
+
+	for (n = 0; lua_getupvalue(S, idx, n + 1); ++n) lua_pop(S, 1);
+	template_write(S, tc, &n, sizeof(n));
+	for (i = 1; i <= n; ++i) {
+		lua_getupvalue(S, idx, i);
+		template_dump_value(S, tc, lua_gettop(S), depth + 1);
+		lua_pop(S, 1);
+	}
+
+	lua_getfenv(S, idx);
+	template_dump_value(S, tc, lua_gettop(S), depth + 1);
+	lua_pop(S, 1);
+}
+
+/**
+ * Serializes the value at the absolute index `idx` of the template.
+ */
+static void template_dump_value(lua_State *S, TemplateCopy *tc, int idx, int depth) {
+	lua_Number num;
+	const char *str;
+	size_t len;
+	void *ptr;
+	lua_CFunction fn;
+	ByteCode code;
+	const void *id;
+	int failed, copied;
+
+	if (depth > LUABOX_MAX_DEPTH) luaL_error(S, "Template value nested too deeply.");
+	luaL_checkstack(S, 3, "Template value nested too deeply.");
+
+	switch (lua_type(S, idx)) {
+		case LUA_TNIL:
+			template_write_tag(S, tc, TEMPLATE_NIL);
+			return;
+
+		case LUA_TBOOLEAN:
+			template_write_tag(S, tc, lua_toboolean(S, idx) ? TEMPLATE_TRUE : TEMPLATE_FALSE);
+			return;
+
+		case LUA_TNUMBER:
+			num = lua_tonumber(S, idx);
+			template_write_tag(S, tc, TEMPLATE_NUMBER);
+			template_write(S, tc, &num, sizeof(num));
+			return;
+
+		case LUA_TSTRING:
+			str = lua_tolstring(S, idx, &len);
+			template_write_tag(S, tc, TEMPLATE_STRING);
+			template_write(S, tc, &len, sizeof(len));
+			template_write(S, tc, str, len);
+			return;
+
+		case LUA_TLIGHTUSERDATA:
+			ptr = lua_touserdata(S, idx);
+			template_write_tag(S, tc, TEMPLATE_LIGHTUSERDATA);
+			template_write(S, tc, &ptr, sizeof(ptr));
+			return;
+
+		case LUA_TTABLE:
+		case LUA_TFUNCTION:
+			break;
+
+		default:
+			luaL_error(S, "Cannot copy a %s from the template.", luaL_typename(S, idx));
+			return;
+	}
+
+	if (lua_rawequal(S, idx, LUA_GLOBALSINDEX)) {
+		template_write_tag(S, tc, TEMPLATE_GLOBALS);
+		return;
+	}
+
+	/*
+	 * Objects dumped before by this copy, or copied into the child by an
+	 * earlier one, are referenced by address. Reading the child's table
+	 * does not allocate, and the child is waiting for this copy.
+	 */
+	id = lua_topointer(S, idx);
+	lua_pushlightuserdata(tc->child, (void*) id);
+	lua_rawget(tc->child, tc->objects);
+	copied = ! lua_isnil(tc->child, -1);
+	lua_pop(tc->child, 1);
+	lua_pushvalue(S, idx);
+	lua_rawget(S, TEMPLATE_SEEN);
+	if (copied || ! lua_isnil(S, -1)) {
+		lua_pop(S, 1);
+		template_write_tag(S, tc, TEMPLATE_REF);
+		template_write(S, tc, &id, sizeof(id));
+		return;
+	}
+	lua_pop(S, 1);
+
+	lua_pushvalue(S, idx);
+	lua_pushboolean(S, 1);
+	lua_rawset(S, TEMPLATE_SEEN);
+
+	if (lua_istable(S, idx)) {
+		len = lua_objlen(S, idx);
+		template_write_tag(S, tc, TEMPLATE_TABLE);
+		template_write(S, tc, &id, sizeof(id));
+		template_write(S, tc, &len, sizeof(len));
+
+		lua_pushnil(S);
+		while (lua_next(S, idx)) {
+			template_dump_value(S, tc, lua_gettop(S) - 1, depth + 1);
+			template_dump_value(S, tc, lua_gettop(S), depth + 1);
+			lua_pop(S, 1);
+		}
+		template_write_tag(S, tc, TEMPLATE_END);
+
+		if (lua_getmetatable(S, idx)) {
+			template_dump_value(S, tc, lua_gettop(S), depth + 1);
+			lua_pop(S, 1);
+		} else {
+			template_write_tag(S, tc, TEMPLATE_NIL);
+		}
+		return;
+	}
+
+	if (lua_iscfunction(S, idx)) {
+		fn = lua_tocfunction(S, idx);
+		template_write_tag(S, tc, TEMPLATE_CFUNCTION);
+		template_write(S, tc, &id, sizeof(id));
+		template_write(S, tc, &fn, sizeof(fn));
+	} else {
+		/* the bytecode, prefixed with its length */
+		code.buf = NULL;
+		code.len = code.alloc = 0;
+		lua_pushvalue(S, idx);
+		failed = lua_dump(S, bytecode_writer, &code);
+		lua_pop(S, 1);
+
+		template_write_tag(S, tc, TEMPLATE_LFUNCTION);
+		template_write(S, tc, &id, sizeof(id));
+		failed = failed
+			|| bytecode_writer(S, &code.len, sizeof(code.len), &tc->out)
+			|| bytecode_writer(S, code.buf, code.len, &tc->out);
+		free(code.buf);
+		if (failed) luaL_error(S, "Not enough memory to copy from template.");
+	}
+
+	template_dump_closure(S, tc, idx, depth);
+}
+
+/**
+ * lua_CFunction serializing the global of the template described by the
+ * TemplateCopy passed as a light userdata.
+ */
+static int template_dump(lua_State *S) {
+	TemplateCopy *tc = (TemplateCopy*) lua_touserdata(S, 1);
+
+	lua_newtable(S); /* TEMPLATE_SEEN */
+
+	switch (tc->type) {
+		case LUA_TSTRING: lua_pushlstring(S, tc->str, tc->len); break;
+		case LUA_TBOOLEAN: lua_pushboolean(S, 0 != tc->num); break;
+		default: lua_pushnumber(S, tc->num); break;
+	}
+	lua_rawget(S, LUA_GLOBALSINDEX);
+
+	template_dump_value(S, tc, lua_gettop(S), 0);
+	return 0;
+}
+
+/**
+ * Reads `n` bytes from the buffer.
+ */
+static void template_read(lua_State *C, TemplateCopy *tc, void *dst, size_t n) {
+	if (n > tc->out.len - tc->pos) luaL_error(C, "Corrupt template copy.");
+	memcpy(dst, tc->out.buf + tc->pos, n);
+	tc->pos += n;
+}
+
+static int template_read_tag(lua_State *C, TemplateCopy *tc) {
+	unsigned char tag;
+	template_read(C, tc, &tag, 1);
+	return tag;
+}
+
+static void template_load_value(lua_State *C, TemplateCopy *tc, int objects);
+
+/**
+ * Sets the environment of the function on top of the stack to the next
+ * value from the buffer.
+ */
+static void template_load_env(lua_State *C, TemplateCopy *tc, int objects) {
+	template_load_value(C, tc, objects);
+	lua_setfenv(C, -2);
+}
+
+/**
+ * Stores the copy on top of the stack as that of the template object `id`.
+ */
+static void template_load_object(lua_State *C, int objects, void *id) {
+	lua_pushlightuserdata(C, id);
+	lua_pushvalue(C, -2);
+	lua_rawset(C, objects);
+}
+
+/**
+ * Pushes the next value from the buffer onto the child's stack. `objects`
+ * is the index of the table mapping template objects to the copies made
+ * by this copy; earlier copies are in TEMPLATE_COPIED.
+ */
+static void template_load_value(lua_State *C, TemplateCopy *tc, int objects) {
+	lua_Number num;
+	size_t len;
+	void *ptr, *id;
+	lua_CFunction fn;
+	int i, n;
+
+	luaL_checkstack(C, 3, "Template value nested too deeply.");
+
+	switch (template_read_tag(C, tc)) {
+		case TEMPLATE_NIL:
+			lua_pushnil(C);
+			return;
+
+		case TEMPLATE_FALSE:
+			lua_pushboolean(C, 0);
+			return;
+
+		case TEMPLATE_TRUE:
+			lua_pushboolean(C, 1);
+			return;
+
+		case TEMPLATE_NUMBER:
+			template_read(C, tc, &num, sizeof(num));
+			lua_pushnumber(C, num);
+			return;
+
+		case TEMPLATE_STRING:
+			template_read(C, tc, &len, sizeof(len));
+			if (len > tc->out.len - tc->pos) luaL_error(C, "Corrupt template copy.");
+			lua_pushlstring(C, tc->out.buf + tc->pos, len);
+			tc->pos += len;
+			return;
+
+		case TEMPLATE_LIGHTUSERDATA:
+			template_read(C, tc, &ptr, sizeof(ptr));
+			lua_pushlightuserdata(C, ptr);
+			return;
+
+		case TEMPLATE_GLOBALS:
+			lua_pushvalue(C, LUA_GLOBALSINDEX);
+			return;
+
+		case TEMPLATE_REF:
+			template_read(C, tc, &id, sizeof(id));
+			lua_pushlightuserdata(C, id);
+			lua_rawget(C, objects);
+			if (lua_isnil(C, -1)) {
+				lua_pop(C, 1);
+				lua_pushlightuserdata(C, id);
+				lua_rawget(C, TEMPLATE_COPIED);
+			}
+			return;
+
+		case TEMPLATE_TABLE:
+			template_read(C, tc, &id, sizeof(id));
+			template_read(C, tc, &len, sizeof(len));
+			lua_createtable(C, len > INT_MAX ? 0 : (int) len, 0);
+			template_load_object(C, objects, id);
+
+			while (tc->pos < tc->out.len && TEMPLATE_END != tc->out.buf[tc->pos]) {
+				template_load_value(C, tc, objects);
+				template_load_value(C, tc, objects);
+				lua_rawset(C, -3);
+			}
+			template_read_tag(C, tc);
+
+			template_load_value(C, tc, objects);
+			if (lua_istable(C, -1)) lua_setmetatable(C, -2);
+			else lua_pop(C, 1);
+			return;
+
+		case TEMPLATE_LFUNCTION:
+			template_read(C, tc, &id, sizeof(id));
+			template_read(C, tc, &len, sizeof(len));
+			if (len > tc->out.len - tc->pos) luaL_error(C, "Corrupt template copy.");
+			/* produced by lua_dump in the template, so it can be trusted */
+			if (luaL_loadbuffer(C, tc->out.buf + tc->pos, len, "=template")) lua_error(C);
+			tc->pos += len;
+			template_load_object(C, objects, id);
+
+			template_read(C, tc, &n, sizeof(n));
+			for (i = 1; i <= n; ++i) {
+				template_load_value(C, tc, objects);
+				lua_setupvalue(C, -2, i);
+			}
+			template_load_env(C, tc, objects);
+			return;
+
+		case TEMPLATE_CFUNCTION:
+			/* upvalues have to be in place before the closure exists */
+			template_read(C, tc, &id, sizeof(id));
+			template_read(C, tc, &fn, sizeof(fn));
+			template_read(C, tc, &n, sizeof(n));
+			luaL_checkstack(C, n, "Too many upvalues.");
+			for (i = 0; i < n; ++i) template_load_value(C, tc, objects);
+			lua_pushcclosure(C, fn, n);
+			template_load_object(C, objects, id);
+			template_load_env(C, tc, objects);
+			return;
+
+		default:
+			luaL_error(C, "Corrupt template copy.");
+	}
+}
+
+/**
+ * lua_CFunction rebuilding the serialized global in the child and storing
+ * it in the child's globals. The arguments are the TemplateCopy as a light
+ * userdata, the key and the table of copied objects (TEMPLATE_COPIED).
+ *
+ * New copies are only added to that table once complete, so that an
+ * error halfway never leaves partial copies to be referenced later.
+ */
+static int template_load(lua_State *C) {
+	TemplateCopy *tc = (TemplateCopy*) lua_touserdata(C, 1);
+
+	lua_newtable(C);
+	lua_pushvalue(C, 2);
+	template_load_value(C, tc, 4);
+	lua_rawset(C, LUA_GLOBALSINDEX);
+
+	lua_pushnil(C);
+	while (lua_next(C, 4)) {
+		lua_pushvalue(C, -2);
+		lua_insert(C, -2);
+		lua_rawset(C, TEMPLATE_COPIED);
+	}
+
+	return 0;
+}
+
+/**
+ * Acquires the lock of the template. Children usually run lua code
+ * without the GIL, so unlike Sandbox_lock this must not require it; the
+ * GIL is only released while waiting if this thread holds it.
+ *
+ * Returns nonzero if the lock was taken, zero if this thread already held
+ * it.
+ */
+static int template_lock(Sandbox *template) {
+	PyThreadState *tstate;
+
+	if (template->lock_depth && template->lock_owner == PyThread_get_thread_ident()) return 0;
+	if (PyThread_acquire_lock(template->lock, NOWAIT_LOCK)) return 1;
+
+	tstate = PyGILState_GetThisThreadState();
+	if (tstate && tstate == _PyThreadState_Current) {
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(template->lock, WAIT_LOCK);
+		Py_END_ALLOW_THREADS
+	} else {
+		PyThread_acquire_lock(template->lock, WAIT_LOCK);
+	}
+	return 1;
+}
+
+/**
+ * __index metamethod of the globals of a child. The upvalues are the
+ * template sandbox, the table mapping template objects to their copies,
+ * and the set of names looked up before.
+ */
+static int template_index(lua_State *C) {
+	Sandbox *template = (Sandbox*) lua_touserdata(C, TEMPLATE_SANDBOX);
+	lua_State *S = template->L;
+	char msg[TEMPLATE_MSG_SIZE];
+	TemplateCopy tc;
+	int status, locked, top;
+
+	tc.type = lua_type(C, 2);
+	switch (tc.type) {
+		case LUA_TSTRING: tc.str = lua_tolstring(C, 2, &tc.len); break;
+		case LUA_TNUMBER: tc.num = lua_tonumber(C, 2); if (tc.num != tc.num) return 0; break;
+		case LUA_TBOOLEAN: tc.num = lua_toboolean(C, 2); break;
+		/* other keys cannot exist in the template */
+		default: return 0;
+	}
+
+	/* deleted by the child, or missing in the template */
+	lua_settop(C, 2);
+	lua_pushvalue(C, 2);
+	lua_rawget(C, TEMPLATE_KNOWN);
+	if (! lua_isnil(C, -1)) return 0;
+	lua_pop(C, 1);
+
+	/* pushed up front, so that failing to push them cannot leak the buffer */
+	lua_pushcfunction(C, template_load);
+	lua_pushlightuserdata(C, &tc);
+	lua_pushvalue(C, 2);
+	lua_pushvalue(C, TEMPLATE_OBJECTS);
+
+	tc.out.buf = NULL;
+	tc.out.len = tc.out.alloc = 0;
+	tc.pos = 0;
+	tc.child = C;
+	tc.objects = lua_gettop(C);
+
+	locked = template_lock(template);
+	top = lua_gettop(S);
+	if ((status = lua_cpcall(S, template_dump, &tc))) {
+		PyOS_snprintf(msg, TEMPLATE_MSG_SIZE, "%s", LUA_TSTRING == lua_type(S, -1) ? lua_tostring(S, -1) : "Could not copy from template.");
+	}
+	lua_settop(S, top);
+	if (locked) PyThread_release_lock(template->lock);
+
+	if (status) {
+		free(tc.out.buf);
+		return luaL_error(C, "%s", msg);
+	}
+
+	/* not a global of the template either */
+	if (TEMPLATE_NIL == tc.out.buf[0]) {
+		free(tc.out.buf);
+		lua_settop(C, 2);
+	} else {
+		status = lua_pcall(C, 3, 0, 0);
+		free(tc.out.buf);
+		if (status) return lua_error(C);
+	}
+
+	lua_pushvalue(C, 2);
+	lua_pushboolean(C, 1);
+	lua_rawset(C, TEMPLATE_KNOWN);
+
+	lua_rawget(C, 1);
+	return 1;
+}
+
+/**
+ * lua_CFunction installing the metatable of the globals of a child.
+ */
+static int template_attach(lua_State *C) {
+	lua_createtable(C, 0, 1);
+	lua_pushlightuserdata(C, lua_touserdata(C, 1));
+	lua_newtable(C); /* TEMPLATE_OBJECTS */
+	lua_newtable(C); /* TEMPLATE_KNOWN */
+	lua_pushcclosure(C, template_index, 3);
+	lua_setfield(C, -2, "__index");
+	lua_setmetatable(C, LUA_GLOBALSINDEX);
+	return 0;
+}
+
+/**
+ * Make `child` read missing globals from `template`, which must be frozen.
+ * The child keeps a reference to the template.
+ *
+ * Functions registered with Sandbox.register() refer to their callable by
+ * its index, so the child starts with a copy of the template's callables.
+ *
+ * Returns the lua error status, 0 on success, or -1 with a Python
+ * exception set.
+ */
+int luabox_template_attach(Sandbox *child, Sandbox *template) {
+	int status;
+
+	if (template->callbacks && ! (child->callbacks = PyList_GetSlice(template->callbacks, 0, PyList_GET_SIZE(template->callbacks)))) return -1;
+
+	if (! (status = lua_cpcall(child->L, template_attach, template))) {
+		Py_INCREF(template);
+		child->template = (PyObject*) template;
+	}
+	return status;
+}
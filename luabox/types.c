@@ -3,34 +3,46 @@
  */
 #include "luaboxmodule.h"
 
+/* 2**63, the bounds of a 64-bit long as a double */
+#define LUABOX_LONG_BOUND 9223372036854775808.0
+
+/* 2**53, the largest magnitude up to which every integer is a double */
+#define LUABOX_EXACT_BOUND 9007199254740992.0
+
 /**
- * Converts the primitive lua object on top of the stack to a python object.
- *
- * Does not pop it from the stack.
+ * Converts a lua number, returning an int if it is integral and fits into
+ * a long, otherwise a float.
  */
-PyObject *lua_to_python(lua_State *L) {
-	const int index = -1;
-
-	if (0 == lua_gettop(L)) {
-		PyErr_SetString(PyExc_IndexError, "Lua stack is empty.");
-		return NULL;
+static PyObject *lua_number_to_python(lua_Number n) {
+	/* note: code assumes lua_Number is double */
+	if (n >= -LUABOX_LONG_BOUND && n < LUABOX_LONG_BOUND && n >= LONG_MIN && n <= LONG_MAX) {
+		long l = (long) n;
+		if ((lua_Number) l == n) return PyInt_FromLong(l);
 	}
+	return PyFloat_FromDouble(n);
+}
 
+/**
+ * Converts the primitive lua object at `index` to a python object.
+ */
+static PyObject *lua_value_to_python(lua_State *L, int index) {
 	int t = lua_type(L, index);
 	switch(t) {
 		case LUA_TNIL:
 			Py_RETURN_NONE;
 
 		case LUA_TNUMBER:
-			/* note: code assumes lua_Number is double */
-			return Py_BuildValue("d", lua_tonumber(L, index));
+			return lua_number_to_python(lua_tonumber(L, index));
 
 		case LUA_TBOOLEAN:
 			if (lua_toboolean(L, index)) Py_RETURN_TRUE;
 			else Py_RETURN_FALSE;
 
-		case LUA_TSTRING:
-			return Py_BuildValue("s", lua_tostring(L, index));
+		case LUA_TSTRING: {
+			size_t len;
+			const char *str = lua_tolstring(L, index, &len);
+			return PyString_FromStringAndSize(str, len);
+		}
 
 		default:
 			lua_typename(L, t);
@@ -39,10 +51,176 @@ PyObject *lua_to_python(lua_State *L) {
 }
 
 /**
- * Puts a new lua object on the stack that is a copy of the given Python
- * object.
+ * Converts the primitive lua object on top of the stack to a python object.
+ *
+ * Does not pop it from the stack.
  */
-int python_to_lua(lua_State *L, PyObject *obj) {
+PyObject *lua_to_python(lua_State *L) {
+	if (0 == lua_gettop(L)) {
+		PyErr_SetString(PyExc_IndexError, "Lua stack is empty.");
+		return NULL;
+	}
+
+	return lua_value_to_python(L, -1);
+}
+
+static PyObject *lua_table_to_python(lua_State *L, int index, PyObject *seen, int depth);
+
+/**
+ * Converts the lua object at `index`, recursing into tables.
+ */
+static PyObject *lua_value_to_python_deep(lua_State *L, int index, PyObject *seen, int depth) {
+	if (lua_istable(L, index)) return lua_table_to_python(L, index, seen, depth);
+	return lua_value_to_python(L, index);
+}
+
+/**
+ * Converts the lua table at (absolute) `index` to a list or dict.
+ *
+ * A table is turned into a list if its keys are exactly 1..n, otherwise
+ * into a dict. Every table is converted only once; tables that are
+ * referenced multiple times (including cycles) map to the same python
+ * object. `seen` maps table addresses to the python objects.
+ */
+static PyObject *lua_table_to_python(lua_State *L, int index, PyObject *seen, int depth) {
+	PyObject *id, *rval;
+	size_t n, count = 0, i;
+	int is_list;
+
+	if (depth <= 0) {
+		PyErr_SetString(PyExc_ValueError, "Lua table nesting exceeds max_depth.");
+		return NULL;
+	}
+
+	if (! (id = PyLong_FromVoidPtr((void*) lua_topointer(L, index)))) return NULL;
+	if ((rval = PyDict_GetItem(seen, id))) {
+		Py_DECREF(id);
+		Py_INCREF(rval);
+		return rval;
+	}
+
+	if (! lua_checkstack(L, 3)) {
+		Py_DECREF(id);
+		PyErr_SetString(PyExc_MemoryError, "Lua stack overflow while converting table.");
+		return NULL;
+	}
+
+	/* check whether the keys are exactly 1..n */
+	n = lua_objlen(L, index);
+	is_list = (n > 0);
+	if (is_list) {
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			lua_Number k;
+
+			lua_pop(L, 1);
+			++count;
+
+			k = lua_tonumber(L, -1);
+			if (LUA_TNUMBER != lua_type(L, -1) || k < 1 || k > n || k != (lua_Number)(size_t) k) {
+				is_list = 0;
+				lua_pop(L, 1);
+				break;
+			}
+		}
+		if (count != n) is_list = 0;
+	}
+
+	rval = is_list ? PyList_New(n) : PyDict_New();
+	if (! rval || -1 == PyDict_SetItem(seen, id, rval)) {
+		Py_DECREF(id);
+		Py_XDECREF(rval);
+		return NULL;
+	}
+	Py_DECREF(id);
+
+	if (is_list) {
+		for (i = 0; i < n; ++i) {
+			PyObject *v;
+
+			lua_rawgeti(L, index, i+1);
+			v = lua_value_to_python_deep(L, lua_gettop(L), seen, depth-1);
+			lua_pop(L, 1);
+
+			if (! v) {
+				Py_DECREF(rval);
+				return NULL;
+			}
+			PyList_SET_ITEM(rval, i, v);
+		}
+	} else {
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			PyObject *k, *v;
+			int top = lua_gettop(L);
+
+			k = lua_value_to_python_deep(L, top-1, seen, depth-1);
+			v = k ? lua_value_to_python_deep(L, top, seen, depth-1) : NULL;
+			lua_pop(L, 1);
+
+			if (! v || -1 == PyDict_SetItem(rval, k, v)) {
+				Py_XDECREF(k);
+				Py_XDECREF(v);
+				Py_DECREF(rval);
+				lua_pop(L, 1);
+				return NULL;
+			}
+			Py_DECREF(k);
+			Py_DECREF(v);
+		}
+	}
+
+	return rval;
+}
+
+/**
+ * Converts the lua object on top of the stack to a python object,
+ * converting tables (and nested tables) to lists or dicts in a single
+ * pass.
+ *
+ * Does not pop it from the stack.
+ *
+ * \param max_depth Maximum table nesting depth.
+ */
+PyObject *lua_to_python_deep(lua_State *L, int max_depth) {
+	PyObject *seen, *rval;
+
+	if (0 == lua_gettop(L)) {
+		PyErr_SetString(PyExc_IndexError, "Lua stack is empty.");
+		return NULL;
+	}
+
+	if (! lua_istable(L, -1)) return lua_value_to_python(L, -1);
+
+	if (! (seen = PyDict_New())) return NULL;
+	rval = lua_table_to_python(L, lua_gettop(L), seen, max_depth);
+	Py_DECREF(seen);
+
+	return rval;
+}
+
+/**
+ * Called when an integer cannot be pushed without rounding. Fails with
+ * OverflowError, unless the sandbox owning `L` allows lossy integers.
+ */
+static int python_inexact_integer(lua_State *L) {
+	Sandbox *box;
+	lua_getallocf(L, (void**) &box);
+
+	if (box->lossy_integers) return 1;
+
+	PyErr_SetString(PyExc_OverflowError, "Integer cannot be represented exactly as a lua number.");
+	return 0;
+}
+
+/**
+ * Puts a new lua object on the stack that is a copy of the given primitive
+ * Python object.
+ *
+ * Integers beyond 2**53 are rounded by lua_Number, which is an error
+ * unless the sandbox's `lossy_integers` is set.
+ */
+static int python_scalar_to_lua(lua_State *L, PyObject *obj) {
 	/* PyBool is a subtype of Int, so check first if it is a boolean. */
 	if (PyBool_Check(obj)) {
 		/* Boolean */
@@ -56,18 +234,30 @@ int python_to_lua(lua_State *L, PyObject *obj) {
 		}
 	} else if (PyInt_Check(obj)) {
 		/* Integer */
+		long l = PyInt_AS_LONG(obj);
+		lua_Number n = (lua_Number) l;
 
-		/* convert to double (lua_Number), then push */
-		lua_pushnumber(L, (lua_Number) PyInt_AS_LONG(obj));
+		/* a long of more than 53 bits may not survive the round trip */
+		if (! (n >= -LUABOX_LONG_BOUND && n < LUABOX_LONG_BOUND && (long) n == l) && ! python_inexact_integer(L)) return 0;
+		lua_pushnumber(L, n);
 	} else if (PyLong_Check(obj)) {
 		/* Long Integer */
-		lua_pushnumber(L, (lua_Number) PyLong_AsDouble(obj));
+		lua_Number n = (lua_Number) PyLong_AsDouble(obj);
 
-		/* check for exception */
-		if (PyErr_Occurred()) {
-			lua_pop(L, 1); // pop error value from PyLong_AsDouble (== -1.0)
-			return 0;
+		if (-1.0 == n && PyErr_Occurred()) return 0;
+
+		/* below 2**53 the conversion is exact, otherwise compare */
+		if (n >= LUABOX_EXACT_BOUND || n <= -LUABOX_EXACT_BOUND) {
+			PyObject *back = PyLong_FromDouble(n);
+			int exact;
+
+			if (! back) return 0;
+			exact = PyObject_RichCompareBool(back, obj, Py_EQ);
+			Py_DECREF(back);
+			if (-1 == exact) return 0;
+			if (! exact && ! python_inexact_integer(L)) return 0;
 		}
+		lua_pushnumber(L, n);
 	} else if (PyFloat_Check(obj)) {
 		/* Float */
 		lua_pushnumber(L, (lua_Number) PyFloat_AsDouble(obj));
@@ -76,6 +266,13 @@ int python_to_lua(lua_State *L, PyObject *obj) {
 		lua_pushlstring(L, PyString_AS_STRING(obj), PyString_GET_SIZE(obj));
 	} else if (Py_None == obj) {
 		lua_pushnil(L);
+	} else if (! PyUnicode_Check(obj) && PyObject_CheckReadBuffer(obj)) {
+		/* buffer, bytearray, mmap, ... - pushed without an intermediate str */
+		const void *buf;
+		Py_ssize_t len;
+
+		if (-1 == PyObject_AsReadBuffer(obj, &buf, &len)) return 0;
+		lua_pushlstring(L, (const char*) buf, len);
 	}
 	else {
 		PyErr_Format(PyExc_TypeError, "Don't know how to convert type '%s' to lua object.", obj->ob_type->tp_name);
@@ -84,3 +281,180 @@ int python_to_lua(lua_State *L, PyObject *obj) {
 
 	return 1;
 }
+
+/* Arguments for python_container_to_lua, passed through lua_cpcall. */
+typedef struct {
+	PyObject *obj;
+	PyObject *seen;
+	int ok;
+	int ref;
+} PythonToLuaArgs;
+
+static int python_value_to_lua(lua_State *L, PyObject *obj, PyObject *seen, int depth);
+
+/**
+ * Puts a new lua table on the stack that is a copy of the given dict, list
+ * or tuple, converting nested containers as well.
+ *
+ * Tables are pre-sized to the length of the Python object. Lua errors
+ * (i.e. running out of memory) are not caught, so this must run in
+ * protected mode. Only borrowed references are held across lua calls to
+ * make sure nothing leaks if an error occurs.
+ *
+ * \param seen Set of the ids of containers currently being converted,
+ *             used to detect cycles.
+ */
+static int python_container_to_lua(lua_State *L, PyObject *obj, PyObject *seen, int depth) {
+	PyObject *id;
+	Py_ssize_t i, n;
+	int rval = 1, t;
+
+	if (depth <= 0) {
+		PyErr_SetString(PyExc_ValueError, "Nesting of Python object exceeds max depth.");
+		return 0;
+	}
+
+	if (! lua_checkstack(L, 3)) {
+		PyErr_SetString(PyExc_MemoryError, "Lua stack overflow while converting Python object.");
+		return 0;
+	}
+
+	/* mark as in progress */
+	if (! (id = PyLong_FromVoidPtr(obj))) return 0;
+	switch (PySet_Contains(seen, id)) {
+		case 0:
+			if (0 == PySet_Add(seen, id)) break;
+			/* fall through */
+		case -1:
+			Py_DECREF(id);
+			return 0;
+		default:
+			Py_DECREF(id);
+			PyErr_SetString(PyExc_ValueError, "Cannot convert self-referencing Python object to lua.");
+			return 0;
+	}
+	Py_DECREF(id);
+
+	if (PyDict_Check(obj)) {
+		PyObject *k, *v;
+
+		lua_createtable(L, 0, (int) PyDict_Size(obj));
+		t = lua_gettop(L);
+
+		i = 0;
+		while (PyDict_Next(obj, &i, &k, &v)) {
+			if (! python_value_to_lua(L, k, seen, depth-1)) {
+				rval = 0;
+				break;
+			}
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				PyErr_SetString(PyExc_ValueError, "None cannot be used as a lua table key.");
+				rval = 0;
+				break;
+			}
+			if (! python_value_to_lua(L, v, seen, depth-1)) {
+				lua_pop(L, 1);
+				rval = 0;
+				break;
+			}
+			lua_rawset(L, t);
+		}
+	} else {
+		int is_list = PyList_Check(obj);
+
+		n = is_list ? PyList_GET_SIZE(obj) : PyTuple_GET_SIZE(obj);
+		lua_createtable(L, (int) n, 0);
+		t = lua_gettop(L);
+
+		/* lists might shrink during conversion, so check size every time */
+		for (i = 0; i < (is_list ? PyList_GET_SIZE(obj) : n); ++i) {
+			PyObject *v = is_list ? PyList_GET_ITEM(obj, i) : PyTuple_GET_ITEM(obj, i);
+			if (! python_value_to_lua(L, v, seen, depth-1)) {
+				rval = 0;
+				break;
+			}
+			lua_rawseti(L, t, (int) i+1);
+		}
+	}
+
+	if (! rval) lua_pop(L, 1);
+
+	/* done, unmark */
+	if ((id = PyLong_FromVoidPtr(obj))) {
+		PySet_Discard(seen, id);
+		Py_DECREF(id);
+	}
+
+	return rval;
+}
+
+static int python_value_to_lua(lua_State *L, PyObject *obj, PyObject *seen, int depth) {
+	if (PyDict_Check(obj) || PyList_Check(obj) || PyTuple_Check(obj)) {
+		return python_container_to_lua(L, obj, seen, depth);
+	}
+	return python_scalar_to_lua(L, obj);
+}
+
+/**
+ * Puts a new lua object on the stack that is a copy of the given Python
+ * object, like python_to_lua. Lua errors are not caught, so this must run
+ * in protected mode. `seen` is an empty set, used to detect
+ * self-references.
+ */
+int python_to_lua_unprotected(lua_State *L, PyObject *obj, PyObject *seen) {
+	return python_value_to_lua(L, obj, seen, LUABOX_MAX_DEPTH);
+}
+
+/**
+ * lua_CFunction wrapper for python_container_to_lua, storing the result in
+ * the registry.
+ */
+static int python_to_lua_protected(lua_State *L) {
+	PythonToLuaArgs *args = (PythonToLuaArgs*) lua_touserdata(L, 1);
+
+	args->ok = python_container_to_lua(L, args->obj, args->seen, LUABOX_MAX_DEPTH);
+	if (args->ok) args->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
+/**
+ * Puts a new lua object on the stack that is a copy of the given Python
+ * object.
+ *
+ * Dicts, lists and tuples are converted to lua tables, recursively. The
+ * memory used for them is allocated by lua, so it counts towards the
+ * memory limit of a sandbox; running out of memory raises OutOfMemory.
+ */
+int python_to_lua(lua_State *L, PyObject *obj) {
+	PythonToLuaArgs args;
+	int status;
+
+	if (! (PyDict_Check(obj) || PyList_Check(obj) || PyTuple_Check(obj))) {
+		return python_scalar_to_lua(L, obj);
+	}
+
+	args.obj = obj;
+	args.ok = 0;
+	args.ref = LUA_NOREF;
+	if (! (args.seen = PySet_New(NULL))) return 0;
+
+	status = lua_cpcall(L, python_to_lua_protected, &args);
+	Py_DECREF(args.seen);
+
+	if (status) {
+		/* lua error, message is on the stack */
+		PyErr_SetString(LUA_ERRMEM == status ? Exc_OutOfMemory : Exc_LuaBoxException, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	if (! args.ok) return 0;
+
+	/* move table from registry onto the stack */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, args.ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, args.ref);
+
+	return 1;
+}
@@ -5,18 +5,9 @@ import luabox
 
 class LuaSandbox(luabox.Sandbox):
 	def stack_as_tuple(self):
-		l = []
-		for i in range(0,self.gettop()):
-			l.append(self.pop())
-		l.reverse()
-		return tuple(l)
-	def run(self, *args):
-		# push all arguments onto stack
-		#print "NOT pushing args"
-		#self.pcall(nargs = len(args))
-
-		self.pcall(nargs = 0, nresults = luabox.LUA_MULTRET)
-		return self.stack_as_tuple()
+		return self.pop_all()
+	def run(self, *args, **kwargs):
+		return self.call(*args, **kwargs)
 
 s = LuaSandbox()
 #s.loadstring("a = {a = 'b', c = {x = 5}, [{three = four}] = 99, [2] = 1}; return a")
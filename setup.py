@@ -1,8 +1,11 @@
 #!/usr/bin/env python
 # coding=utf8
 
-from setuptools import setup, Extension
+from setuptools import setup, Extension, Command
 import commands
+import os
+import subprocess
+import sys
 
 # function below from http://code.activestate.com/recipes/502261-python-distutils-pkg-config/
 def pkgconfig(*packages, **kw):
@@ -15,10 +18,48 @@ mod = Extension('luabox',
                 ['luabox/luaboxmodule.c',
                  'luabox/sandbox.c',
                  'luabox/types.c',
-                 'luabox/luatableref.c'],
+                 'luabox/luatableref.c',
+                 'luabox/luatableiter.c',
+                 'luabox/luastring.c',
+                 'luabox/mempool.c',
+                 'luabox/bytecache.c',
+                 'luabox/snapshot.c',
+                 'luabox/sandboxpool.c',
+                 'luabox/callback.c',
+                 'luabox/pack.c',
+                 'luabox/processpool.c',
+                 'luabox/coroutine.c',
+                 'luabox/template.c',
+                 'luabox/numberbuffer.c',
+                 'luabox/loader.c',
+                 'luabox/library.c',
+                 'luabox/profiler.c'],
                 **pkgconfig('lua5.1'))
 
+class bench(Command):
+	description = "build the extension in place and run the benchmark suite"
+	user_options = [('output=', 'o', "write JSON results to file"),
+	                ('filter=', 'f', "only run benchmarks matching filter")]
+
+	def initialize_options(self):
+		self.output = None
+		self.filter = None
+
+	def finalize_options(self):
+		pass
+
+	def run(self):
+		build_ext = self.get_finalized_command('build_ext')
+		build_ext.inplace = 1
+		self.run_command('build_ext')
+
+		args = [sys.executable, 'bench/luabench.py']
+		if self.output: args += ['-o', self.output]
+		if self.filter: args += ['-f', self.filter]
+		subprocess.check_call(args, env = dict(os.environ, PYTHONPATH = '.'))
+
 setup(name = 'LuaBox',
       version = '0.1',
       description = 'Allows running sandbox instances of lua with memory and CPU usage bounds inside python to execute user-submitted code.',
-      ext_modules = [mod])
+      ext_modules = [mod],
+      cmdclass = {'bench': bench})
@@ -0,0 +1,4 @@
+#!/usr/bin/env lua
+
+while true do
+end
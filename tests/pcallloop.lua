@@ -0,0 +1,13 @@
+#!/usr/bin/env lua
+
+-- Run with a cpu_limit or a timeout, and the base library. The call must
+-- fail with CPULimitExceeded or Timeout although the script catches the
+-- error again and again.
+
+local f = function() while true do end end
+local handler = function(e) while true do end end
+
+while true do
+	pcall(f)
+	xpcall(f, handler)
+end
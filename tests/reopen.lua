@@ -0,0 +1,19 @@
+#!/usr/bin/env lua
+
+-- Needs the base, coroutine and string libraries. Libraries are opened
+-- again once their global is removed; run it a second time after
+-- resetting to a snapshot taken before the first run.
+
+-- coroutine before base, both are opened by luaopen_base
+assert(coroutine.status(coroutine.create(type)) == "suspended")
+assert(type(pairs) == "function")
+
+string = nil
+assert(string.len("") == 0)
+assert(("abc"):upper() == "ABC")
+
+coroutine = nil
+assert(coroutine.running() == nil)
+
+pairs = nil
+assert(type(pairs) == "function")
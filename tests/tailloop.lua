@@ -0,0 +1,12 @@
+#!/usr/bin/env lua
+
+-- Run as a coroutine resumed with a slice. Each resume must return with
+-- status 'preempted', although the loops run in a function entered by a
+-- tail call and in an unnamed function.
+
+local function main()
+	(function() for i = 1, 1000000 do end end)()
+	while true do end
+end
+
+return main()